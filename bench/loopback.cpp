@@ -0,0 +1,193 @@
+#include "./loopback.hpp"
+
+#include <solanaceae/contact/components.hpp>
+#include <solanaceae/tox_contacts/components.hpp>
+
+#include <entt/entity/registry.hpp>
+#include <entt/entity/handle.hpp>
+
+#include <sodium.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+Tox_Err_Friend_Custom_Packet LoopbackTox::toxFriendSendLosslessPacket(const uint32_t, const std::vector<uint8_t>&) {
+	return TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND; // group only
+}
+
+Tox_Err_Group_Send_Custom_Packet LoopbackTox::toxGroupSendCustomPacket(const uint32_t group_number, const bool, const std::vector<uint8_t>& data) {
+	if (group_number != 0u) {
+		return TOX_ERR_GROUP_SEND_CUSTOM_PACKET_GROUP_NOT_FOUND;
+	}
+
+	if (!_net.broadcast(_self, data)) {
+		return TOX_ERR_GROUP_SEND_CUSTOM_PACKET_DISCONNECTED;
+	}
+	return TOX_ERR_GROUP_SEND_CUSTOM_PACKET_OK;
+}
+
+Tox_Err_Group_Send_Custom_Private_Packet LoopbackTox::toxGroupSendCustomPrivatePacket(const uint32_t group_number, const uint32_t peer_id, const bool, const std::vector<uint8_t>& data) {
+	if (group_number != 0u) {
+		return TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_GROUP_NOT_FOUND;
+	}
+
+	if (peer_id >= _net.size() || peer_id == _self) {
+		return TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_PEER_NOT_FOUND;
+	}
+
+	if (!_net.send(_self, peer_id, true, data)) {
+		return TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_DISCONNECTED;
+	}
+	return TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK;
+}
+
+LoopbackPeer::LoopbackPeer(
+	ToxI& t,
+	ToxEventProviderI& tep,
+	ContactHandle4 group,
+	std::vector<Contact4> peers
+) : ToxP2PRNG(t, tep), _group(group), _peers(std::move(peers)) {
+}
+
+std::vector<ContactHandle4> LoopbackPeer::groupPeers(void) const {
+	std::vector<ContactHandle4> c_vec;
+	c_vec.reserve(_peers.size());
+	for (const auto c : _peers) {
+		c_vec.push_back(ContactHandle4{*_group.registry(), c});
+	}
+	return c_vec;
+}
+
+ContactHandle4 LoopbackPeer::getContactFriend(const uint32_t friend_number) {
+	return getContactGroupPeer(0u, friend_number);
+}
+
+ContactHandle4 LoopbackPeer::getContactGroup(const uint32_t group_number) {
+	if (group_number != 0u) {
+		return {};
+	}
+	return _group;
+}
+
+ContactHandle4 LoopbackPeer::getContactGroupPeer(const uint32_t group_number, const uint32_t peer_number) {
+	if (group_number != 0u || peer_number >= _peers.size()) {
+		return {};
+	}
+	return ContactHandle4{*_group.registry(), _peers[peer_number]};
+}
+
+LoopbackNet::LoopbackNet(const size_t peer_count) {
+	ToxKey chat_id;
+	randombytes_buf(chat_id.data.data(), chat_id.data.size());
+
+	std::vector<ToxKey> keys(peer_count);
+	for (auto& key : keys) {
+		randombytes_buf(key.data.data(), key.data.size());
+	}
+
+	_nodes.reserve(peer_count);
+	for (size_t i = 0; i < peer_count; i++) {
+		auto& node = *_nodes.emplace_back(std::make_unique<Node>(*this, static_cast<uint32_t>(i)));
+
+		const ContactHandle4 group{node.cr, node.cr.create()};
+		group.emplace<Contact::Components::ToxGroupEphemeral>(0u);
+		group.emplace<Contact::Components::ToxGroupPersistent>(chat_id);
+
+		std::vector<Contact4> peers;
+		peers.reserve(peer_count);
+		for (size_t j = 0; j < peer_count; j++) {
+			const ContactHandle4 c{node.cr, node.cr.create()};
+			c.emplace<Contact::Components::Parent>(group.entity());
+			c.emplace<Contact::Components::ConnectionState>(Contact::Components::ConnectionState::direct);
+			c.emplace<Contact::Components::ToxGroupPeerEphemeral>(0u, static_cast<uint32_t>(j));
+			c.emplace<Contact::Components::ToxGroupPeerPersistent>(chat_id, keys[j]);
+			if (j == i) {
+				c.emplace<Contact::Components::TagSelfStrong>();
+				group.emplace<Contact::Components::Self>(c.entity());
+			}
+			peers.push_back(c.entity());
+		}
+		group.emplace<Contact::Components::ParentOf>(peers);
+
+		node.p2prng = std::make_unique<LoopbackPeer>(node.tox, node.tep, group, std::move(peers));
+
+		// only measuring the protocol, not the rate limit
+		auto sq_config = node.p2prng->getSendQueueConfig();
+		sq_config.rate_bytes = std::numeric_limits<uint32_t>::max();
+		sq_config.burst_bytes = std::numeric_limits<uint32_t>::max();
+		node.p2prng->setSendQueueConfig(sq_config);
+	}
+}
+
+LoopbackNet::~LoopbackNet(void) {
+	// instances before the registries they point into
+	for (auto& node : _nodes) {
+		node->p2prng.reset();
+	}
+}
+
+bool LoopbackNet::enqueue(Packet&& pkg) {
+	_in_flight.push_back(std::move(pkg));
+	return true;
+}
+
+LoopbackNet::Packet LoopbackNet::makePacket(const uint32_t from, const uint32_t to, const bool _private, const std::vector<uint8_t>& data) {
+	Packet pkg;
+	pkg.from = from;
+	pkg.to = to;
+	pkg._private = _private;
+	if (!_free_buffers.empty()) {
+		pkg.data = std::move(_free_buffers.back());
+		_free_buffers.pop_back();
+	}
+	pkg.data.assign(data.cbegin(), data.cend());
+	return pkg;
+}
+
+void LoopbackNet::deliverPacket(Packet& pkg) {
+	_nodes.at(pkg.to)->p2prng->receive(pkg.from, ByteSpan{pkg.data}, pkg._private);
+	_delivered++;
+	_free_buffers.push_back(std::move(pkg.data));
+}
+
+void LoopbackNet::dropPacket(Packet& pkg) {
+	_free_buffers.push_back(std::move(pkg.data));
+}
+
+size_t LoopbackNet::deliver(const size_t max) {
+	size_t count = 0;
+	while (count < max && !_in_flight.empty()) {
+		// handlers send, which can reallocate the deque
+		Packet pkg = std::move(_in_flight.front());
+		_in_flight.pop_front();
+		deliverPacket(pkg);
+		count++;
+	}
+	return count;
+}
+
+float LoopbackNet::iterate(const float time_delta) {
+	float min_interval = std::numeric_limits<float>::max();
+	for (auto& node : _nodes) {
+		min_interval = std::min(min_interval, node->p2prng->iterate(time_delta));
+	}
+	return min_interval;
+}
+
+bool LoopbackNet::send(const uint32_t from, const uint32_t to, const bool _private, const std::vector<uint8_t>& data) {
+	_sent++;
+	return enqueue(makePacket(from, to, _private, data));
+}
+
+bool LoopbackNet::broadcast(const uint32_t from, const std::vector<uint8_t>& data) {
+	_sent++;
+	bool any = false;
+	for (size_t i = 0; i < _nodes.size(); i++) {
+		if (i != from) {
+			any = enqueue(makePacket(from, static_cast<uint32_t>(i), false, data)) || any;
+		}
+	}
+	return any;
+}
+
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <solanaceae/tox_p2prng/tox_p2prng.hpp>
+#include <solanaceae/toxcore/tox_default_impl.hpp>
+#include <solanaceae/contact/fwd.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// N ToxP2PRNG instances in one ngc group, packets get delivered in memory
+// every instance has its own contact registry, like separate clients would
+// the group number is always 0 and peer numbers are the instance indices
+
+class LoopbackNet;
+
+// ToxP2PRNG only ever sends packets, the rest of the default impl stays unused
+class LoopbackTox : public ToxDefaultImpl {
+	LoopbackNet& _net;
+	const uint32_t _self;
+
+	public:
+		LoopbackTox(LoopbackNet& net, const uint32_t self) : _net(net), _self(self) {}
+
+		Tox_Err_Friend_Custom_Packet toxFriendSendLosslessPacket(const uint32_t friend_number, const std::vector<uint8_t>& data) override;
+		Tox_Err_Group_Send_Custom_Packet toxGroupSendCustomPacket(const uint32_t group_number, const bool lossless, const std::vector<uint8_t>& data) override;
+		Tox_Err_Group_Send_Custom_Private_Packet toxGroupSendCustomPrivatePacket(const uint32_t group_number, const uint32_t peer_id, const bool lossless, const std::vector<uint8_t>& data) override;
+};
+
+// resolves tox numbers from its own registry instead of a contact model
+class LoopbackPeer : public ToxP2PRNG {
+	ContactHandle4 _group;
+	std::vector<Contact4> _peers; // by peer number, self included
+
+	public:
+		LoopbackPeer(
+			ToxI& t,
+			ToxEventProviderI& tep,
+			ContactHandle4 group,
+			std::vector<Contact4> peers
+		);
+
+		ContactHandle4 group(void) const { return _group; }
+		// everyone in the group, self included
+		std::vector<ContactHandle4> groupPeers(void) const;
+
+		bool receive(const uint32_t peer_number, ByteSpan data, const bool _private) {
+			return handleGroupPacket(0u, peer_number, data, _private);
+		}
+
+	public: // internals, for the microbenchmarks
+		using ToxP2PRNG::RngState;
+		using ToxP2PRNG::getRngSate;
+
+		using ToxP2PRNG::handleFriendPacket;
+		using ToxP2PRNG::handle_init_with_hmac;
+
+		using ToxP2PRNG::send_init_with_hmac;
+		using ToxP2PRNG::send_init_with_hmac_digest;
+		using ToxP2PRNG::send_hmac;
+		using ToxP2PRNG::send_hmac_request;
+		using ToxP2PRNG::send_secret;
+		using ToxP2PRNG::send_secret_request;
+		using ToxP2PRNG::send_secret_with_next_hmac;
+		using ToxP2PRNG::send_init_chained;
+		using ToxP2PRNG::send_hmac_bundle;
+
+	protected:
+		// friend numbers are peer numbers too, nothing is sent to friends but packets can be fed in
+		ContactHandle4 getContactFriend(const uint32_t friend_number) override;
+		ContactHandle4 getContactGroup(const uint32_t group_number) override;
+		ContactHandle4 getContactGroupPeer(const uint32_t group_number, const uint32_t peer_number) override;
+};
+
+class LoopbackNet {
+	public:
+		struct Packet {
+			uint32_t from {0u};
+			uint32_t to {0u};
+			bool _private {true};
+			std::vector<uint8_t> data;
+		};
+
+	private:
+		struct Node {
+			ContactRegistry4 cr;
+			ToxEventProviderI tep;
+			LoopbackTox tox;
+			std::unique_ptr<LoopbackPeer> p2prng;
+
+			Node(LoopbackNet& net, const uint32_t self) : tox(net, self) {}
+		};
+
+		std::vector<std::unique_ptr<Node>> _nodes;
+		std::deque<Packet> _in_flight;
+
+		// delivered packets give their buffers back, so steady state sends dont allocate
+		std::vector<std::vector<uint8_t>> _free_buffers;
+
+		uint64_t _delivered {0u};
+		uint64_t _sent {0u}; // send calls, a broadcast is one
+
+	protected:
+		// gets every packet sent, returning false makes the send fail as disconnected
+		// the default delivers in send order
+		virtual bool enqueue(Packet&& pkg);
+
+		Packet makePacket(const uint32_t from, const uint32_t to, const bool _private, const std::vector<uint8_t>& data);
+		void deliverPacket(Packet& pkg);
+		void dropPacket(Packet& pkg); // lost on the way, only gives the buffer back
+
+	public:
+		explicit LoopbackNet(const size_t peer_count);
+		virtual ~LoopbackNet(void);
+
+		size_t size(void) const { return _nodes.size(); }
+		LoopbackPeer& peer(const size_t i) { return *_nodes.at(i)->p2prng; }
+		ContactRegistry4& registry(const size_t i) { return _nodes.at(i)->cr; }
+
+		uint64_t delivered(void) const { return _delivered; }
+		uint64_t sent(void) const { return _sent; }
+		virtual size_t inFlight(void) const { return _in_flight.size(); }
+
+		// delivers until nothing is in flight (or max), including whatever gets sent in response
+		// returns the number of packets delivered
+		virtual size_t deliver(const size_t max = ~size_t(0));
+
+		// iterates every instance, returns the smallest wanted interval
+		float iterate(const float time_delta);
+
+		// called by LoopbackTox
+		bool send(const uint32_t from, const uint32_t to, const bool _private, const std::vector<uint8_t>& data);
+		bool broadcast(const uint32_t from, const std::vector<uint8_t>& data);
+};
+
@@ -0,0 +1,343 @@
+#include "./loopback.hpp"
+
+#include <solanaceae/tox_p2prng/log.hpp>
+
+#include <entt/container/dense_map.hpp>
+
+#include <sodium.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+// N instances generating with each other over in memory delivery
+// reports throughput, time to DONE (on every peer), allocations and packets per generation
+// packets counts deliveries, sends counts send calls (a group broadcast is one)
+//
+// usage: tox_p2prng_loopback_harness [--peers 2,10,50,200] [--concurrent 1,100,1000,10000]
+//        [--gens n] [--max-packets n] [--broadcast]
+
+static std::atomic<uint64_t> g_allocations {0u};
+
+void* operator new(std::size_t size) {
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* ptr = std::malloc(size == 0 ? 1 : size); ptr != nullptr) {
+		return ptr;
+	}
+	throw std::bad_alloc{};
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	return std::malloc(size == 0 ? 1 : size);
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+
+using Clock = std::chrono::steady_clock;
+
+struct RunConfig {
+	size_t peers {2u};
+	size_t concurrent {1u};
+	size_t gens {0u}; // 0 is max(concurrent, 100)
+	bool broadcast {false};
+};
+
+struct RunResult {
+	size_t gens {0u};
+	double seconds {0.};
+	std::vector<double> time_to_done; // ms, sorted
+	uint64_t allocations {0u};
+	uint64_t pool_allocations {0u};
+	uint64_t packets {0u}; // delivered
+	uint64_t sends {0u}; // a group broadcast counts once
+	size_t mismatches {0u}; // peers that disagree on a result
+	bool stalled {false};
+};
+
+class Run {
+	struct Gen {
+		Clock::time_point start;
+		size_t done {0u};
+		std::array<uint8_t, 32> result_hash {};
+	};
+
+	// one per instance, the subscription has to live as long as the run
+	struct Listener : public P2PRNGEventI {
+		Run& _run;
+		P2PRNGEventProviderI::SubscriptionReference _sr;
+
+		Listener(Run& run, P2PRNGI& p2prng) : _run(run), _sr(p2prng.newSubRef(this)) {
+			_sr.subscribe(P2PRNG_Event::done);
+		}
+
+		bool onEvent(const P2PRNG::Events::Done& e) override {
+			_run.onDone(e);
+			return false;
+		}
+	};
+
+	LoopbackNet& _net;
+	std::vector<std::unique_ptr<Listener>> _listeners;
+	std::vector<std::vector<ContactHandle4>> _c_vecs; // per initiator
+
+	entt::dense_map<ToxP2PRNG::ID, Gen, ToxP2PRNG::IDHash> _running;
+
+	void onDone(const P2PRNG::Events::Done& e) {
+		if (e.id.size != ToxP2PRNG::ID{}.size()) {
+			return;
+		}
+		ToxP2PRNG::ID gen_id;
+		std::copy(e.id.cbegin(), e.id.cend(), gen_id.begin());
+
+		auto it = _running.find(gen_id);
+		if (it == _running.end()) {
+			return;
+		}
+
+		auto& gen = it->second;
+		std::array<uint8_t, 32> result_hash;
+		crypto_generichash(result_hash.data(), result_hash.size(), e.result.ptr, e.result.size, nullptr, 0);
+		if (gen.done == 0u) {
+			gen.result_hash = result_hash;
+		} else if (gen.result_hash != result_hash) {
+			result.mismatches++;
+		}
+
+		if (++gen.done == _net.size()) {
+			result.time_to_done.push_back(std::chrono::duration<double, std::milli>(Clock::now() - gen.start).count());
+			_running.erase(it);
+		}
+	}
+
+	public:
+		RunResult result;
+
+		explicit Run(LoopbackNet& net) : _net(net) {
+			for (size_t i = 0; i < _net.size(); i++) {
+				_listeners.push_back(std::make_unique<Listener>(*this, _net.peer(i)));
+				_c_vecs.push_back(_net.peer(i).groupPeers());
+			}
+		}
+
+		size_t running(void) const { return _running.size(); }
+
+		bool start(const size_t n) {
+			const uint64_t user_data = n;
+			const auto id = _net.peer(n % _net.size()).newGernationPeers(
+				_c_vecs[n % _net.size()],
+				ByteSpan{reinterpret_cast<const uint8_t*>(&user_data), sizeof(user_data)}
+			);
+			if (id.size() != ToxP2PRNG::ID{}.size()) {
+				return false;
+			}
+
+			ToxP2PRNG::ID gen_id;
+			std::copy(id.cbegin(), id.cend(), gen_id.begin());
+			_running[gen_id].start = Clock::now();
+			return true;
+		}
+};
+
+static double percentile(const std::vector<double>& sorted, const double p) {
+	if (sorted.empty()) {
+		return 0.;
+	}
+	return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+static RunResult runConfig(const RunConfig& config) {
+	LoopbackNet net{config.peers};
+	for (size_t i = 0; i < net.size(); i++) {
+		auto& p2prng = net.peer(i);
+		p2prng.setGroupBroadcast(config.broadcast);
+
+		// everything running has to fit, nothing gets evicted for the cap
+		auto ev_config = p2prng.getEvictionConfig();
+		ev_config.max_sessions = std::max(ev_config.max_sessions, config.concurrent * 2u);
+		ev_config.max_remote_sessions_per_peer = 0u;
+		p2prng.setEvictionConfig(ev_config);
+	}
+
+	Run run{net};
+	run.result.time_to_done.reserve(config.gens);
+
+	const uint64_t pool_allocated_before = [&net]() {
+		uint64_t sum = 0u;
+		for (size_t i = 0; i < net.size(); i++) {
+			sum += net.peer(i).getPkgPoolStats().allocated;
+		}
+		return sum;
+	}();
+	const uint64_t allocations_before = g_allocations.load();
+	const uint64_t delivered_before = net.delivered();
+	const uint64_t sent_before = net.sent();
+
+	const auto time_start = Clock::now();
+	auto time_last_iterate = time_start;
+	size_t started = 0u;
+	size_t idle_rounds = 0u;
+	while (run.result.time_to_done.size() < config.gens) {
+		while (run.running() < config.concurrent && started < config.gens) {
+			if (!run.start(started)) {
+				std::cerr << "failed to start generation " << started << "\n";
+				run.result.stalled = true;
+				break;
+			}
+			started++;
+		}
+		if (run.result.stalled) {
+			break;
+		}
+
+		const size_t finished_before = run.result.time_to_done.size();
+		const size_t delivered = net.deliver();
+
+		const auto now = Clock::now();
+		net.iterate(std::chrono::duration<float>(now - time_last_iterate).count());
+		time_last_iterate = now;
+
+		if (delivered == 0u && net.inFlight() == 0u && run.result.time_to_done.size() == finished_before) {
+			// nothing left that could make progress
+			if (++idle_rounds > 1000u) {
+				run.result.stalled = true;
+				break;
+			}
+		} else {
+			idle_rounds = 0u;
+		}
+	}
+	run.result.seconds = std::chrono::duration<double>(Clock::now() - time_start).count();
+
+	run.result.gens = run.result.time_to_done.size();
+	run.result.allocations = g_allocations.load() - allocations_before;
+	run.result.packets = net.delivered() - delivered_before;
+	run.result.sends = net.sent() - sent_before;
+	for (size_t i = 0; i < net.size(); i++) {
+		run.result.pool_allocations += net.peer(i).getPkgPoolStats().allocated;
+	}
+	run.result.pool_allocations -= pool_allocated_before;
+	std::sort(run.result.time_to_done.begin(), run.result.time_to_done.end());
+
+	return std::move(run.result);
+}
+
+static std::vector<size_t> parseList(const std::string& str) {
+	std::vector<size_t> list;
+	size_t pos = 0;
+	while (pos < str.size()) {
+		size_t end = str.find(',', pos);
+		if (end == std::string::npos) {
+			end = str.size();
+		}
+		list.push_back(std::stoull(str.substr(pos, end - pos)));
+		pos = end + 1;
+	}
+	return list;
+}
+
+int main(int argc, char** argv) {
+	std::vector<size_t> peer_counts {2u, 10u, 50u, 200u};
+	std::vector<size_t> concurrent_counts {1u, 100u, 1000u, 10000u};
+	size_t gens {0u};
+	double max_packets {5e7};
+	bool broadcast {false};
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg {argv[i]};
+		const bool has_value = i + 1 < argc;
+		if (arg == "--peers" && has_value) {
+			peer_counts = parseList(argv[++i]);
+		} else if (arg == "--concurrent" && has_value) {
+			concurrent_counts = parseList(argv[++i]);
+		} else if (arg == "--gens" && has_value) {
+			gens = std::stoull(argv[++i]);
+		} else if (arg == "--max-packets" && has_value) {
+			max_packets = std::stod(argv[++i]);
+		} else if (arg == "--broadcast") {
+			broadcast = true;
+		} else {
+			std::cerr << "usage: " << argv[0] << " [--peers 2,10,50,200] [--concurrent 1,100,1000,10000] [--gens n] [--max-packets n] [--broadcast]\n";
+			return 1;
+		}
+	}
+
+	if (sodium_init() < 0) {
+		std::cerr << "sodium_init failed\n";
+		return 1;
+	}
+
+	TP2PRNGLog::setLevel(TP2PRNGLog::Level::warn);
+
+	std::cout
+		<< std::setw(6) << "peers"
+		<< std::setw(12) << "concurrent"
+		<< std::setw(8) << "gens"
+		<< std::setw(12) << "gens/s"
+		<< std::setw(10) << "p50 ms"
+		<< std::setw(10) << "p90 ms"
+		<< std::setw(10) << "p99 ms"
+		<< std::setw(13) << "allocs/gen"
+		<< std::setw(12) << "pool/gen"
+		<< std::setw(13) << "packets/gen"
+		<< std::setw(11) << "sends/gen"
+		<< "\n"
+	;
+
+	bool ok = true;
+	for (const size_t peers : peer_counts) {
+		for (const size_t concurrent : concurrent_counts) {
+			RunConfig config;
+			config.peers = std::max<size_t>(peers, 2u);
+			config.concurrent = std::max<size_t>(concurrent, 1u);
+			config.gens = gens != 0u ? gens : std::max<size_t>(config.concurrent, 100u);
+			config.broadcast = broadcast;
+
+			std::cout << std::setw(6) << config.peers << std::setw(12) << config.concurrent;
+
+			// init, hmacs and secrets, every peer to every peer
+			const double estimate = 3. * config.peers * config.peers * config.gens;
+			if (estimate > max_packets) {
+				std::cout << "  skipped, ~" << estimate << " packets (--max-packets)\n";
+				continue;
+			}
+			std::cout.flush();
+
+			const auto res = runConfig(config);
+			const double gens_done = std::max<double>(res.gens, 1.);
+
+			std::cout
+				<< std::setw(8) << res.gens
+				<< std::setw(12) << std::fixed << std::setprecision(1) << res.gens / res.seconds
+				<< std::setw(10) << std::setprecision(3) << percentile(res.time_to_done, 0.5)
+				<< std::setw(10) << percentile(res.time_to_done, 0.9)
+				<< std::setw(10) << percentile(res.time_to_done, 0.99)
+				<< std::setw(13) << std::setprecision(1) << res.allocations / gens_done
+				<< std::setw(12) << res.pool_allocations / gens_done
+				<< std::setw(13) << res.packets / gens_done
+				<< std::setw(11) << res.sends / gens_done
+				<< std::defaultfloat
+			;
+			if (res.stalled) {
+				std::cout << "  STALLED";
+				ok = false;
+			}
+			if (res.mismatches != 0u) {
+				std::cout << "  " << res.mismatches << " MISMATCHED RESULTS";
+				ok = false;
+			}
+			std::cout << "\n";
+		}
+	}
+
+	return ok ? 0 : 1;
+}
+
@@ -0,0 +1,656 @@
+#include "./loopback.hpp"
+
+#include <solanaceae/tox_p2prng/log.hpp>
+#include <solanaceae/tox_p2prng/pkg_codec.hpp>
+#include <solanaceae/contact/components.hpp>
+#include <solanaceae/tox_contacts/components.hpp>
+
+#include <entt/entity/registry.hpp>
+#include <entt/entity/handle.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <sodium.h>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+// microbenchmarks of the per packet and per generation paths of a single instance
+// the instances are the loopback ones, what they send gets thrown away (or captured)
+//
+// usage: tox_p2prng_microbench [--benchmark_filter=regex] [--benchmark_format=json] [--benchmark_out=file]
+// the arguments are fixed, so runs can be diffed by name
+
+using PKG = ToxP2PRNG::PKG;
+
+// the recipient kind byte of a friend packet, see tox_p2prng.cpp
+static constexpr uint8_t g_pkg_id_friend {0xB1};
+
+class BenchNet : public LoopbackNet {
+	public:
+		enum class Mode {
+			deliver, // like the loopback net
+			capture, // kept in captured, not delivered
+			discard,
+		};
+		Mode mode {Mode::deliver};
+		std::vector<Packet> captured;
+
+	protected:
+		bool enqueue(Packet&& pkg) override {
+			switch (mode) {
+				case Mode::deliver:
+					return LoopbackNet::enqueue(std::move(pkg));
+				case Mode::capture:
+					captured.push_back(std::move(pkg));
+					return true;
+				case Mode::discard:
+					break;
+			}
+			dropPacket(pkg);
+			return true;
+		}
+
+	public:
+		using LoopbackNet::LoopbackNet;
+};
+
+static ToxP2PRNG::ID benchID(const uint64_t n) {
+	ToxP2PRNG::ID id {};
+	std::memcpy(id.data(), &n, sizeof(n));
+	return id;
+}
+
+static const std::vector<uint8_t> g_initial_state {'b', 'e', 'n', 'c', 'h', 'm', 'r', 'k'};
+
+// eviction by cap stays on, so sessions created per iteration dont grow without bound
+static void noRemoteQuota(ToxP2PRNG& p2prng) {
+	auto ev_config = p2prng.getEvictionConfig();
+	ev_config.max_remote_sessions_per_peer = 0u;
+	p2prng.setEvictionConfig(ev_config);
+}
+
+// everything is exchanged, every peer is DONE
+static ToxP2PRNG::ID doneGeneration(BenchNet& net) {
+	net.mode = BenchNet::Mode::deliver;
+	const auto id_vec = net.peer(0).newGernationPeers(net.peer(0).groupPeers(), ByteSpan{g_initial_state});
+	net.deliver();
+
+	ToxP2PRNG::ID id {};
+	if (id_vec.size() == id.size()) {
+		std::memcpy(id.data(), id_vec.data(), id.size());
+	}
+	return id;
+}
+
+// a packet peer from would send to peer to for id, empty if it did not send one
+static std::vector<uint8_t> capturePacket(BenchNet& net, const size_t from, const size_t to, const PKG type, const ToxP2PRNG::ID& id) {
+	auto& p2prng = net.peer(from);
+	const auto c_vec = p2prng.groupPeers();
+	const auto* rng_state = p2prng.getRngSate(c_vec.at(from), ByteSpan{id});
+	if (rng_state == nullptr) {
+		return {};
+	}
+
+	net.captured.clear();
+	net.mode = BenchNet::Mode::capture;
+	switch (type) {
+		case PKG::HMAC:
+			p2prng.send_hmac(c_vec.at(to), ByteSpan{id}, ByteSpan{rng_state->hmacs.at(rng_state->self_idx)});
+			break;
+		case PKG::HMAC_REQUEST:
+			p2prng.send_hmac_request(c_vec.at(to), ByteSpan{id});
+			break;
+		case PKG::SECRET:
+			p2prng.send_secret(c_vec.at(to), ByteSpan{id}, ByteSpan{rng_state->secrets.at(rng_state->self_idx)});
+			break;
+		case PKG::SECRET_REQUEST:
+			p2prng.send_secret_request(c_vec.at(to), ByteSpan{id});
+			break;
+		default:
+			break;
+	}
+	net.mode = BenchNet::Mode::discard;
+
+	if (net.captured.empty()) {
+		return {};
+	}
+	return std::move(net.captured.front().data);
+}
+
+// a standalone session of peer 0 over all peers, initial state filled
+static void fillRngState(LoopbackPeer::RngState& rng_state, LoopbackPeer& p2prng, const ToxP2PRNG::ID& id) {
+	rng_state.setContacts(p2prng.groupPeers());
+	rng_state.fillInitialState(ByteSpan{id}, ByteSpan{g_initial_state});
+}
+
+////////////////////////////////////////
+// receiving
+
+// a generation that is DONE on both sides, so nothing but the parsing and lookup changes state
+static void BM_HandleGroupPacket(benchmark::State& state) {
+	BenchNet net{2};
+	const auto id = doneGeneration(net);
+	const auto pkg = capturePacket(net, 0u, 1u, static_cast<PKG>(state.range(0)), id);
+	if (pkg.empty()) {
+		state.SkipWithError("no packet");
+		return;
+	}
+
+	auto& p2prng = net.peer(1);
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(p2prng.receive(0u, ByteSpan{pkg}, true));
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(state.iterations() * pkg.size());
+}
+BENCHMARK(BM_HandleGroupPacket)->ArgName("type")
+	->Arg(static_cast<int64_t>(PKG::HMAC))
+	->Arg(static_cast<int64_t>(PKG::HMAC_REQUEST))
+	->Arg(static_cast<int64_t>(PKG::SECRET))
+	->Arg(static_cast<int64_t>(PKG::SECRET_REQUEST))
+;
+
+static void BM_HandleFriendPacket(benchmark::State& state) {
+	BenchNet net{2};
+	const auto id = doneGeneration(net);
+	auto pkg = capturePacket(net, 0u, 1u, static_cast<PKG>(state.range(0)), id);
+	if (pkg.empty()) {
+		state.SkipWithError("no packet");
+		return;
+	}
+	pkg[0] = g_pkg_id_friend;
+
+	auto& p2prng = net.peer(1);
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(p2prng.handleFriendPacket(0u, ByteSpan{pkg}));
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(state.iterations() * pkg.size());
+}
+BENCHMARK(BM_HandleFriendPacket)->ArgName("type")
+	->Arg(static_cast<int64_t>(PKG::HMAC))
+	->Arg(static_cast<int64_t>(PKG::SECRET))
+;
+
+// heap and inline bytes of a session, hash map nodes estimated
+static size_t sessionBytes(const LoopbackPeer::RngState& rng_state) {
+	const auto slotsBytes = [](const auto& peer_slots) {
+		return peer_slots.slots.capacity() * sizeof(peer_slots.slots.front()) + peer_slots.received.capacity() / 8u;
+	};
+
+	return sizeof(rng_state)
+		+ rng_state.contacts.capacity() * sizeof(ContactHandle4)
+		+ rng_state.contact_index.size() * (sizeof(std::pair<Contact4, uint16_t>) + sizeof(size_t) * 2u)
+		+ rng_state.is_buffer.capacity()
+		+ slotsBytes(rng_state.hmacs)
+		+ slotsBytes(rng_state.secrets)
+		+ slotsBytes(rng_state.next_hmacs)
+		+ rng_state.secrets_verifying.capacity() / 8u
+	;
+}
+
+// a duplicate secret from the last participant, the contact to index lookup and the received check
+static void BM_HandlePacketPeers(benchmark::State& state) {
+	const size_t peers = static_cast<size_t>(state.range(0));
+	BenchNet net{peers};
+	const auto id = doneGeneration(net);
+	const auto pkg = capturePacket(net, peers - 1u, 0u, PKG::SECRET, id);
+	if (pkg.empty()) {
+		state.SkipWithError("no packet");
+		return;
+	}
+
+	auto& p2prng = net.peer(0);
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(p2prng.receive(static_cast<uint32_t>(peers - 1u), ByteSpan{pkg}, true));
+	}
+	state.SetItemsProcessed(state.iterations());
+
+	if (const auto* rng_state = p2prng.getRngSate(p2prng.groupPeers().at(0), ByteSpan{id}); rng_state != nullptr) {
+		state.counters["session_bytes"] = static_cast<double>(sessionBytes(*rng_state));
+	}
+}
+BENCHMARK(BM_HandlePacketPeers)->ArgName("peers")->Arg(2)->Arg(10)->Arg(100);
+
+// the INIT_WITH_HMAC peer 0 sends peer 1, with the full peer list
+// a full peer list fits up to ~40 peers, empty if it does not
+static std::vector<uint8_t> captureInitWithHMAC(BenchNet& net) {
+	auto& initiator = net.peer(0);
+	const auto c_vec = initiator.groupPeers();
+	const auto id = benchID(0u);
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac {};
+
+	net.captured.clear();
+	net.mode = BenchNet::Mode::capture;
+	initiator.send_init_with_hmac(c_vec.at(1), ByteSpan{id}, c_vec, ByteSpan{g_initial_state}, ByteSpan{hmac});
+	net.mode = BenchNet::Mode::discard;
+
+	if (net.captured.empty()) {
+		return {};
+	}
+	return std::move(net.captured.front().data);
+}
+
+// a new generation every iteration, including the hmacs sent in response
+static void runHandleInitWithHMAC(benchmark::State& state, BenchNet& net) {
+	auto pkg = captureInitWithHMAC(net);
+	if (pkg.empty()) {
+		state.SkipWithError("init does not fit");
+		return;
+	}
+
+	auto& p2prng = net.peer(1);
+	noRemoteQuota(p2prng);
+
+	const auto from = p2prng.groupPeers().at(0);
+	uint8_t* id_ptr = pkg.data() + PkgCodec::header_size;
+	const ByteSpan body {id_ptr + PkgCodec::id_size, pkg.size() - PkgCodec::header_size - PkgCodec::id_size};
+
+	// the first one indexes the registry
+	p2prng.handle_init_with_hmac(from, ByteSpan{id_ptr, PkgCodec::id_size}, body);
+
+	uint64_t n {0u};
+	for (auto _ : state) {
+		n++;
+		std::memcpy(id_ptr, &n, sizeof(n));
+		benchmark::DoNotOptimize(p2prng.handle_init_with_hmac(from, ByteSpan{id_ptr, PkgCodec::id_size}, body));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_HandleInitWithHMAC(benchmark::State& state) {
+	BenchNet net{static_cast<size_t>(state.range(0))};
+	runHandleInitWithHMAC(state, net);
+}
+BENCHMARK(BM_HandleInitWithHMAC)->ArgName("peers")->Arg(2)->Arg(10)->Arg(20)->Arg(40);
+
+// resolving the peer list should not depend on how many other contacts there are
+// half unrelated friends, half peers of another group
+static void BM_HandleInitWithHMACRegistry(benchmark::State& state) {
+	BenchNet net{10};
+
+	auto& cr = net.registry(1);
+	const size_t filler = static_cast<size_t>(state.range(0));
+
+	ToxKey chat_id;
+	randombytes_buf(chat_id.data.data(), chat_id.data.size());
+	const ContactHandle4 group{cr, cr.create()};
+	group.emplace<Contact::Components::ToxGroupPersistent>(chat_id);
+
+	for (size_t i = 0; i < filler; i++) {
+		ToxKey key;
+		randombytes_buf(key.data.data(), key.data.size());
+
+		const ContactHandle4 c{cr, cr.create()};
+		if (i % 2 == 0) {
+			c.emplace<Contact::Components::ToxFriendPersistent>(key);
+		} else {
+			c.emplace<Contact::Components::Parent>(group.entity());
+			c.emplace<Contact::Components::ToxGroupPeerPersistent>(chat_id, key);
+		}
+	}
+
+	runHandleInitWithHMAC(state, net);
+}
+BENCHMARK(BM_HandleInitWithHMACRegistry)->ArgName("contacts")->Arg(1000)->Arg(10000)->Arg(100000);
+
+// starting a generation, the init is encoded once and sent to every other peer
+// old sessions get evicted by the cap
+static void BM_NewGeneration(benchmark::State& state) {
+	BenchNet net{static_cast<size_t>(state.range(0))};
+	net.mode = BenchNet::Mode::discard;
+	auto& p2prng = net.peer(0);
+	const auto c_vec = p2prng.groupPeers();
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(p2prng.newGernationPeers(c_vec, ByteSpan{g_initial_state}));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_NewGeneration)->ArgName("peers")->Arg(2)->Arg(5)->Arg(10)->Arg(20)->Arg(40);
+
+////////////////////////////////////////
+// session state
+
+static void BM_FillInitialState(benchmark::State& state) {
+	BenchNet net{static_cast<size_t>(state.range(0))};
+	const auto id = benchID(1u);
+
+	LoopbackPeer::RngState rng_state;
+	rng_state.setContacts(net.peer(0).groupPeers());
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(rng_state.fillInitialState(ByteSpan{id}, ByteSpan{g_initial_state}));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FillInitialState)->ArgName("peers")->Arg(2)->Arg(10)->Arg(50)->Arg(200);
+
+// combines every secret, not only the tail left by the incremental combine
+static void BM_GenFinalResult(benchmark::State& state) {
+	BenchNet net{static_cast<size_t>(state.range(0))};
+	const auto id = benchID(1u);
+
+	LoopbackPeer::RngState rng_state;
+	fillRngState(rng_state, net.peer(0), id);
+
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac {};
+	std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret {};
+	for (size_t i = 0; i < rng_state.contacts.size(); i++) {
+		randombytes_buf(secret.data(), secret.size());
+		rng_state.hmacs.set(i, hmac);
+		rng_state.secrets.set(i, secret);
+	}
+
+	for (auto _ : state) {
+		rng_state.final_result.clear();
+		rng_state.combine_next = 0u;
+		rng_state.genFinalResult();
+		benchmark::DoNotOptimize(rng_state.final_result.data());
+	}
+	if (rng_state.final_result.empty()) {
+		state.SkipWithError("no result");
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GenFinalResult)->ArgName("peers")->Arg(2)->Arg(10)->Arg(50)->Arg(200);
+
+// from the last secret packet to the done event on peer 1, a finished generation with one secret taken out again
+// what is left to combine depends on which one arrives last:
+// last:0 the first in contact order (all of them), last:1 the last in contact order (only the tail)
+// undoing the secret is part of the timed loop, it is small next to the verify and combine
+static void BM_LastSecretToDone(benchmark::State& state) {
+	const size_t peers = static_cast<size_t>(state.range(0));
+	const size_t missing = state.range(1) == 0 ? 0u : peers - 1u;
+
+	BenchNet net{peers};
+	const auto id = doneGeneration(net);
+	const auto pkg = capturePacket(net, missing, 1u, PKG::SECRET, id);
+
+	auto& p2prng = net.peer(1);
+	auto* rng_state = p2prng.getRngSate(p2prng.groupPeers().at(1), ByteSpan{id});
+	if (pkg.empty() || rng_state == nullptr) {
+		state.SkipWithError("no generation");
+		return;
+	}
+
+	// everything in front of the missing one is combined already
+	rng_state->secrets.erase(missing);
+	rng_state->combine_next = 0u;
+	rng_state->advanceCombine();
+	const auto combine_state = rng_state->combine_state;
+
+	for (auto _ : state) {
+		rng_state->secrets.erase(missing);
+		rng_state->final_result.clear();
+		rng_state->combine_state = combine_state;
+		rng_state->combine_next = static_cast<uint16_t>(missing);
+
+		benchmark::DoNotOptimize(p2prng.receive(static_cast<uint32_t>(missing), ByteSpan{pkg}, true));
+	}
+	if (rng_state->final_result.empty()) {
+		state.SkipWithError("not done");
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LastSecretToDone)->ArgNames({"peers", "last"})
+	->Args({50, 0})->Args({50, 1})
+	->Args({100, 0})->Args({100, 1})
+	->Args({200, 0})->Args({200, 1})
+;
+
+// the last hmac arriving with every secret already there, all of them get verified in one go
+// the generation is finished on peer 1 and the last hmac is taken out again, like above
+// wall time, the workers verify in parallel
+static void BM_LastHMACVerify(benchmark::State& state) {
+	const size_t peers = static_cast<size_t>(state.range(0));
+	const size_t missing = peers - 1u;
+
+	BenchNet net{peers};
+	const auto id = doneGeneration(net);
+	const auto pkg = capturePacket(net, missing, 1u, PKG::HMAC, id);
+
+	auto& p2prng = net.peer(1);
+	auto* rng_state = p2prng.getRngSate(p2prng.groupPeers().at(1), ByteSpan{id});
+	if (pkg.empty() || rng_state == nullptr) {
+		state.SkipWithError("no generation");
+		return;
+	}
+	p2prng.setCryptoWorkers(static_cast<size_t>(state.range(1)));
+
+	for (auto _ : state) {
+		rng_state->hmacs.erase(missing);
+		rng_state->final_result.clear();
+		rng_state->combine_next = 0u;
+
+		benchmark::DoNotOptimize(p2prng.receive(static_cast<uint32_t>(missing), ByteSpan{pkg}, true));
+	}
+	if (rng_state->final_result.empty()) {
+		state.SkipWithError("not done");
+	}
+	state.SetItemsProcessed(state.iterations() * peers);
+}
+BENCHMARK(BM_LastHMACVerify)->ArgNames({"pending", "workers"})
+	->Args({64, 0})->Args({64, 4})
+	->Args({128, 0})->Args({128, 4})
+	->Args({256, 0})->Args({256, 4})
+	->UseRealTime()
+;
+
+// halfway through the hmacs, the longest path
+static void BM_GetState(benchmark::State& state) {
+	BenchNet net{static_cast<size_t>(state.range(0))};
+	const auto id = benchID(1u);
+
+	LoopbackPeer::RngState rng_state;
+	fillRngState(rng_state, net.peer(0), id);
+
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac {};
+	for (size_t i = 0; i < rng_state.contacts.size() / 2; i++) {
+		rng_state.hmacs.set(i, hmac);
+	}
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(rng_state.getState());
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetState)->ArgName("peers")->Arg(2)->Arg(200);
+
+static void BM_GetRngSate(benchmark::State& state) {
+	BenchNet net{2};
+	net.mode = BenchNet::Mode::discard;
+	auto& p2prng = net.peer(0);
+	auto ev_config = p2prng.getEvictionConfig();
+	ev_config.max_sessions = 0u;
+	p2prng.setEvictionConfig(ev_config);
+
+	const auto c_vec = p2prng.groupPeers();
+	std::vector<std::vector<uint8_t>> ids;
+	ids.reserve(state.range(0));
+	for (int64_t i = 0; i < state.range(0); i++) {
+		ids.push_back(p2prng.newGernationPeers(c_vec, ByteSpan{g_initial_state}));
+	}
+
+	size_t i {0u};
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(p2prng.getRngSate(c_vec.at(1), ByteSpan{ids[i]}));
+		if (++i == ids.size()) {
+			i = 0u;
+		}
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetRngSate)->ArgName("sessions")->Arg(1)->Arg(1000)->Arg(100000);
+
+////////////////////////////////////////
+// sending
+// serializing and queueing, the loopback tox copies every packet once more
+
+template<typename Fn>
+static void runSend(benchmark::State& state, BenchNet& net, Fn&& fn) {
+	net.mode = BenchNet::Mode::discard;
+	const auto c = net.peer(0).groupPeers().at(1);
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(fn(c));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_SendInitWithHMAC(benchmark::State& state) {
+	BenchNet net{static_cast<size_t>(state.range(0))};
+	auto& p2prng = net.peer(0);
+	const auto id = benchID(1u);
+	const auto c_vec = p2prng.groupPeers();
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac {};
+
+	runSend(state, net, [&](ContactHandle4 c) {
+		return p2prng.send_init_with_hmac(c, ByteSpan{id}, c_vec, ByteSpan{g_initial_state}, ByteSpan{hmac});
+	});
+}
+BENCHMARK(BM_SendInitWithHMAC)->ArgName("peers")->Arg(2)->Arg(10)->Arg(40);
+
+// the digest and every fragment
+static void BM_SendInitWithHMACDigest(benchmark::State& state) {
+	BenchNet net{static_cast<size_t>(state.range(0))};
+	auto& p2prng = net.peer(0);
+	const auto id = benchID(1u);
+
+	LoopbackPeer::RngState rng_state;
+	rng_state.setContacts(p2prng.groupPeers());
+	rng_state.is_digest = ToxP2PRNG::ID{};
+	rng_state.fillInitialState(ByteSpan{id}, ByteSpan{g_initial_state});
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac {};
+	rng_state.hmacs.set(rng_state.self_idx, hmac);
+
+	runSend(state, net, [&](ContactHandle4 c) {
+		return p2prng.send_init_with_hmac_digest(c, ByteSpan{id}, rng_state);
+	});
+}
+BENCHMARK(BM_SendInitWithHMACDigest)->ArgName("peers")->Arg(50)->Arg(200);
+
+static void BM_SendHMAC(benchmark::State& state) {
+	BenchNet net{2};
+	auto& p2prng = net.peer(0);
+	const auto id = benchID(1u);
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac {};
+
+	runSend(state, net, [&](ContactHandle4 c) {
+		return p2prng.send_hmac(c, ByteSpan{id}, ByteSpan{hmac});
+	});
+}
+BENCHMARK(BM_SendHMAC);
+
+static void BM_SendHMACRequest(benchmark::State& state) {
+	BenchNet net{2};
+	auto& p2prng = net.peer(0);
+	const auto id = benchID(1u);
+
+	runSend(state, net, [&](ContactHandle4 c) {
+		return p2prng.send_hmac_request(c, ByteSpan{id});
+	});
+}
+BENCHMARK(BM_SendHMACRequest);
+
+static void BM_SendSecret(benchmark::State& state) {
+	BenchNet net{2};
+	auto& p2prng = net.peer(0);
+	const auto id = benchID(1u);
+	std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret {};
+
+	runSend(state, net, [&](ContactHandle4 c) {
+		return p2prng.send_secret(c, ByteSpan{id}, ByteSpan{secret});
+	});
+}
+BENCHMARK(BM_SendSecret);
+
+static void BM_SendSecretRequest(benchmark::State& state) {
+	BenchNet net{2};
+	auto& p2prng = net.peer(0);
+	const auto id = benchID(1u);
+
+	runSend(state, net, [&](ContactHandle4 c) {
+		return p2prng.send_secret_request(c, ByteSpan{id});
+	});
+}
+BENCHMARK(BM_SendSecretRequest);
+
+static void BM_SendSecretWithNextHMAC(benchmark::State& state) {
+	BenchNet net{2};
+	auto& p2prng = net.peer(0);
+	const auto id = benchID(1u);
+	std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret {};
+	std::array<uint8_t, P2PRNG_MAC_LEN> next_hmac {};
+
+	runSend(state, net, [&](ContactHandle4 c) {
+		return p2prng.send_secret_with_next_hmac(c, ByteSpan{id}, ByteSpan{secret}, ByteSpan{next_hmac});
+	});
+}
+BENCHMARK(BM_SendSecretWithNextHMAC);
+
+static void BM_SendInitChained(benchmark::State& state) {
+	BenchNet net{2};
+	auto& p2prng = net.peer(0);
+	const auto id = benchID(2u);
+
+	LoopbackPeer::RngState rng_state;
+	fillRngState(rng_state, p2prng, id);
+	rng_state.chained_from = benchID(1u);
+	std::array<uint8_t, P2PRNG_MAC_LEN> next_hmac {};
+	std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret {};
+	rng_state.secrets.set(rng_state.self_idx, secret);
+	rng_state.next_hmacs.set(rng_state.self_idx, next_hmac);
+
+	runSend(state, net, [&](ContactHandle4 c) {
+		return p2prng.send_init_chained(c, ByteSpan{id}, rng_state);
+	});
+}
+BENCHMARK(BM_SendInitChained);
+
+// looks up every generation of the bundle
+static void BM_SendHMACBundle(benchmark::State& state) {
+	BenchNet net{2};
+	net.mode = BenchNet::Mode::discard;
+	auto& p2prng = net.peer(0);
+	const auto c_vec = p2prng.groupPeers();
+
+	const std::vector<ByteSpan> initial_states(state.range(0), ByteSpan{g_initial_state});
+	const auto ids = p2prng.newGenerationBatch(c_vec, initial_states);
+	const auto* rng_state = ids.empty() ? nullptr : p2prng.getRngSate(c_vec.at(0), ByteSpan{ids.front()});
+	if (rng_state == nullptr || !rng_state->bundle_id.has_value()) {
+		state.SkipWithError("no bundle");
+		return;
+	}
+	const auto bundle_id = rng_state->bundle_id.value();
+	const auto bundle_size = rng_state->bundle_size;
+
+	runSend(state, net, [&](ContactHandle4 c) {
+		return p2prng.send_hmac_bundle(c, ByteSpan{bundle_id}, bundle_size);
+	});
+}
+BENCHMARK(BM_SendHMACBundle)->ArgName("bundle_size")->Arg(4)->Arg(16);
+
+int main(int argc, char** argv) {
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+		return 1;
+	}
+
+	if (sodium_init() < 0) {
+		std::cerr << "sodium_init failed\n";
+		return 1;
+	}
+
+	// duplicates are expected here, dont drown the output in warnings
+	TP2PRNGLog::setLevel(TP2PRNGLog::Level::error);
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	return 0;
+}
+
@@ -0,0 +1,467 @@
+#include "./loopback.hpp"
+
+#include <solanaceae/tox_p2prng/id_hash.hpp>
+#include <solanaceae/tox_p2prng/log.hpp>
+
+#include <entt/container/dense_map.hpp>
+
+#include <sodium.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// deterministic network simulation in virtual time
+// lossy, reordering, duplicating links with latency and peers dropping offline,
+// thousands of generations, checks that every peer ends up with the same result
+// everything (including the randomness of the instances) follows from the seed,
+// so a failing seed can be replayed
+//
+// usage: tox_p2prng_net_sim [--seed n] [--peers n] [--gens n] [--concurrent n]
+//        [--loss p] [--dup p] [--reorder p] [--latency min_ms,max_ms]
+//        [--disconnects per_peer_per_minute] [--step ms] [--min-done fraction]
+//        [--check-determinism]
+
+// libsodium randomness from a seed, the stream is ratcheted forward on every call
+namespace SeededRandom {
+	static std::array<uint8_t, randombytes_SEEDBYTES> g_seed {};
+
+	static void buf(void* const out, const size_t size) {
+		randombytes_buf_deterministic(out, size, g_seed.data());
+		crypto_generichash(g_seed.data(), g_seed.size(), g_seed.data(), g_seed.size(), nullptr, 0);
+	}
+
+	static uint32_t random(void) {
+		uint32_t value;
+		buf(&value, sizeof(value));
+		return value;
+	}
+
+	static uint32_t uniform(const uint32_t upper_bound) {
+		if (upper_bound < 2u) {
+			return 0u;
+		}
+		// rejection sampling, like the default
+		const uint32_t min = -upper_bound % upper_bound;
+		uint32_t value;
+		do {
+			value = random();
+		} while (value < min);
+		return value % upper_bound;
+	}
+
+	static const char* name(void) { return "net_sim_seeded"; }
+	static void stir(void) {}
+	static int close(void) { return 0; }
+
+	static randombytes_implementation g_impl {name, random, stir, uniform, buf, close};
+
+	static void reseed(const uint64_t seed) {
+		g_seed.fill(0u);
+		std::memcpy(g_seed.data(), &seed, sizeof(seed));
+	}
+} // SeededRandom
+
+struct SimConfig {
+	uint64_t seed {1u};
+	size_t peers {5u};
+	size_t gens {2000u};
+	size_t concurrent {50u};
+
+	double loss {0.02}; // per packet
+	double dup {0.01}; // per packet
+	double reorder {0.05}; // per packet, gets held back by up to latency_max extra
+	double latency_min {0.02}; // seconds
+	double latency_max {0.2};
+	double disconnects {0.5}; // per peer and minute
+	double offline_min {1.};
+	double offline_max {20.};
+
+	double step {0.05}; // virtual seconds per iterate
+};
+
+struct SimResult {
+	size_t started {0u};
+	size_t done {0u}; // on every peer, with the same result
+	size_t mismatched {0u};
+	size_t val_errors {0u};
+	double virtual_seconds {0.};
+
+	uint64_t sent {0u};
+	uint64_t lost {0u};
+	uint64_t duplicated {0u};
+	uint64_t refused {0u}; // send attempts while offline
+	size_t disconnects {0u};
+
+	std::array<uint8_t, 32> digest {}; // over all results, in start order
+};
+
+// in flight packets ordered by arrival time, the sequence number keeps ties in send order
+class SimNet : public LoopbackNet {
+	struct Scheduled {
+		double due;
+		uint64_t seq;
+		Packet pkg;
+	};
+	static bool later(const Scheduled& a, const Scheduled& b) {
+		return a.due > b.due || (a.due == b.due && a.seq > b.seq);
+	}
+
+	const SimConfig& _config;
+	std::mt19937_64 _rng;
+	std::vector<Scheduled> _heap;
+	uint64_t _seq {0u};
+	double _now {0.};
+
+	std::vector<double> _offline_until;
+
+	// std distributions are implementation defined, this has to replay everywhere
+	double uniform(void) { return static_cast<double>(_rng() >> 11) * 0x1.0p-53; }
+	double uniform(const double min, const double max) { return min + (max - min) * uniform(); }
+	bool chance(const double p) { return p > 0. && uniform() < p; }
+
+	void schedule(Packet&& pkg, double due) {
+		_heap.push_back(Scheduled{due, _seq++, std::move(pkg)});
+		std::push_heap(_heap.begin(), _heap.end(), later);
+	}
+
+	protected:
+		bool enqueue(Packet&& pkg) override {
+			if (offline(pkg.from) || offline(pkg.to)) {
+				result.refused++;
+				dropPacket(pkg);
+				return false;
+			}
+
+			result.sent++;
+
+			if (chance(_config.dup)) {
+				result.duplicated++;
+				schedule(makePacket(pkg.from, pkg.to, pkg._private, pkg.data), _now + uniform(_config.latency_min, _config.latency_max));
+			}
+
+			if (chance(_config.loss)) {
+				result.lost++;
+				dropPacket(pkg);
+				return true; // the sender cant tell
+			}
+
+			double due = _now + uniform(_config.latency_min, _config.latency_max);
+			if (chance(_config.reorder)) {
+				due += uniform(0., _config.latency_max);
+			}
+			schedule(std::move(pkg), due);
+
+			return true;
+		}
+
+	public:
+		SimResult result;
+
+		explicit SimNet(const SimConfig& config) :
+			LoopbackNet(config.peers),
+			_config(config),
+			_rng(config.seed),
+			_offline_until(config.peers, 0.)
+		{
+		}
+
+		double now(void) const { return _now; }
+		bool offline(const size_t i) const { return _offline_until[i] > _now; }
+
+		size_t inFlight(void) const override { return _heap.size(); }
+
+		// everything that arrived by now, including responses that arrive right away
+		size_t deliver(const size_t max = ~size_t(0)) override {
+			size_t count = 0;
+			while (count < max && !_heap.empty() && _heap.front().due <= _now) {
+				std::pop_heap(_heap.begin(), _heap.end(), later);
+				Packet pkg = std::move(_heap.back().pkg);
+				_heap.pop_back();
+
+				if (offline(pkg.to)) {
+					result.lost++;
+					dropPacket(pkg);
+					continue;
+				}
+
+				deliverPacket(pkg);
+				count++;
+			}
+			return count;
+		}
+
+		void advance(const double time_delta) {
+			_now += time_delta;
+
+			// peers drop offline, whatever is in flight to them gets lost
+			const double p = _config.disconnects / 60. * time_delta;
+			for (size_t i = 0; i < _offline_until.size(); i++) {
+				if (!offline(i) && chance(p)) {
+					_offline_until[i] = _now + uniform(_config.offline_min, _config.offline_max);
+					result.disconnects++;
+				}
+			}
+
+			iterate(static_cast<float>(time_delta));
+		}
+};
+
+class Sim {
+	struct Gen {
+		size_t index {0u};
+		std::vector<bool> done; // per peer
+		size_t done_count {0u};
+		std::array<uint8_t, 32> result_hash {};
+		bool mismatched {false};
+	};
+
+	struct Listener : public P2PRNGEventI {
+		Sim& _sim;
+		const size_t _peer;
+		P2PRNGEventProviderI::SubscriptionReference _sr;
+
+		Listener(Sim& sim, const size_t peer, P2PRNGI& p2prng) : _sim(sim), _peer(peer), _sr(p2prng.newSubRef(this)) {
+			_sr
+				.subscribe(P2PRNG_Event::done)
+				.subscribe(P2PRNG_Event::val_error)
+			;
+		}
+
+		bool onEvent(const P2PRNG::Events::Done& e) override {
+			_sim.onDone(_peer, e);
+			return false;
+		}
+
+		bool onEvent(const P2PRNG::Events::ValError&) override {
+			_sim._net.result.val_errors++;
+			return false;
+		}
+	};
+
+	const SimConfig& _config;
+	SimNet _net;
+	std::vector<std::unique_ptr<Listener>> _listeners;
+	std::vector<std::vector<ContactHandle4>> _c_vecs;
+
+	entt::dense_map<ToxP2PRNG::ID, Gen, ToxP2PRNG::IDHash> _gens;
+	std::vector<std::array<uint8_t, 32>> _results; // by start order
+	size_t _running {0u};
+
+	void onDone(const size_t peer, const P2PRNG::Events::Done& e) {
+		if (e.id.size != ToxP2PRNG::ID{}.size()) {
+			return;
+		}
+		ToxP2PRNG::ID gen_id;
+		std::copy(e.id.cbegin(), e.id.cend(), gen_id.begin());
+
+		auto it = _gens.find(gen_id);
+		if (it == _gens.end() || it->second.done[peer]) {
+			return;
+		}
+
+		auto& gen = it->second;
+		std::array<uint8_t, 32> result_hash;
+		crypto_generichash(result_hash.data(), result_hash.size(), e.result.ptr, e.result.size, nullptr, 0);
+		if (gen.done_count == 0u) {
+			gen.result_hash = result_hash;
+		} else if (gen.result_hash != result_hash && !gen.mismatched) {
+			gen.mismatched = true;
+			_net.result.mismatched++;
+			std::cerr << "generation " << gen.index << " has different results on peer " << peer << "\n";
+		}
+
+		gen.done[peer] = true;
+		if (++gen.done_count == _config.peers) {
+			_results[gen.index] = gen.result_hash;
+			if (!gen.mismatched) {
+				_net.result.done++;
+			}
+			_gens.erase(it);
+			_running--;
+		}
+	}
+
+	bool start(void) {
+		// initiators the rng picks, whoever is online
+		const size_t initiator = _net.result.started % _config.peers;
+		if (_net.offline(initiator)) {
+			return false;
+		}
+
+		const uint64_t user_data = _net.result.started;
+		const auto id = _net.peer(initiator).newGernationPeers(
+			_c_vecs[initiator],
+			ByteSpan{reinterpret_cast<const uint8_t*>(&user_data), sizeof(user_data)}
+		);
+		if (id.size() != ToxP2PRNG::ID{}.size()) {
+			return false;
+		}
+
+		ToxP2PRNG::ID gen_id;
+		std::copy(id.cbegin(), id.cend(), gen_id.begin());
+		auto& gen = _gens[gen_id];
+		gen.index = _net.result.started++;
+		gen.done.resize(_config.peers, false);
+		_running++;
+		return true;
+	}
+
+	public:
+		explicit Sim(const SimConfig& config) : _config(config), _net(config) {
+			for (size_t i = 0; i < _net.size(); i++) {
+				_listeners.push_back(std::make_unique<Listener>(*this, i, _net.peer(i)));
+				_c_vecs.push_back(_net.peer(i).groupPeers());
+
+				// keep everything, the sim decides when a generation is lost
+				auto ev_config = _net.peer(i).getEvictionConfig();
+				ev_config.max_sessions = std::max(ev_config.max_sessions, config.concurrent * 2u);
+				ev_config.max_remote_sessions_per_peer = 0u;
+				_net.peer(i).setEvictionConfig(ev_config);
+			}
+			_results.resize(config.gens);
+		}
+
+		void run(void) {
+			const auto& ev_config = _net.peer(0).getEvictionConfig();
+
+			// unfinished generations get evicted after the stall timeout, after that nothing can change
+			double last_start = 0.;
+			while (
+				_net.result.started < _config.gens ||
+				(_running > 0u && _net.now() - last_start < 2. * ev_config.stall_timeout)
+			) {
+				while (_running < _config.concurrent && _net.result.started < _config.gens && start()) {
+					last_start = _net.now();
+				}
+
+				_net.deliver();
+				_net.advance(_config.step);
+			}
+			auto& result = _net.result;
+			result.virtual_seconds = _net.now();
+
+			crypto_generichash_state state;
+			crypto_generichash_init(&state, nullptr, 0, result.digest.size());
+			for (const auto& r : _results) {
+				crypto_generichash_update(&state, r.data(), r.size());
+			}
+			crypto_generichash_final(&state, result.digest.data(), result.digest.size());
+		}
+
+		const SimResult& result(void) const { return _net.result; }
+};
+
+static SimResult runSim(const SimConfig& config) {
+	SeededRandom::reseed(config.seed);
+	Sim sim{config};
+	sim.run();
+	return sim.result();
+}
+
+static void printResult(const SimResult& res) {
+	std::cout
+		<< "  generations  " << res.done << "/" << res.started << " done on every peer"
+		<< ", " << res.mismatched << " mismatched, " << res.val_errors << " val errors\n"
+		<< "  packets      " << res.sent << " sent, " << res.lost << " lost, " << res.duplicated << " duplicated, " << res.refused << " refused offline\n"
+		<< "  disconnects  " << res.disconnects << "\n"
+		<< "  virtual time " << std::fixed << std::setprecision(1) << res.virtual_seconds << "s" << std::defaultfloat << "\n"
+		<< "  digest       "
+	;
+	for (const auto b : res.digest) {
+		std::cout << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(b);
+	}
+	std::cout << std::dec << std::setfill(' ') << "\n";
+}
+
+int main(int argc, char** argv) {
+	SimConfig config;
+	double min_done {1.}; // lost packets only get recovered by retries, but everything should get through in the end
+	bool check_determinism {false};
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg {argv[i]};
+		const bool has_value = i + 1 < argc;
+		if (arg == "--seed" && has_value) {
+			config.seed = std::stoull(argv[++i]);
+		} else if (arg == "--peers" && has_value) {
+			config.peers = std::max<size_t>(std::stoull(argv[++i]), 2u);
+		} else if (arg == "--gens" && has_value) {
+			config.gens = std::stoull(argv[++i]);
+		} else if (arg == "--concurrent" && has_value) {
+			config.concurrent = std::max<size_t>(std::stoull(argv[++i]), 1u);
+		} else if (arg == "--loss" && has_value) {
+			config.loss = std::stod(argv[++i]);
+		} else if (arg == "--dup" && has_value) {
+			config.dup = std::stod(argv[++i]);
+		} else if (arg == "--reorder" && has_value) {
+			config.reorder = std::stod(argv[++i]);
+		} else if (arg == "--latency" && has_value) {
+			const std::string value {argv[++i]};
+			const size_t comma = value.find(',');
+			config.latency_min = std::stod(value.substr(0, comma)) / 1000.;
+			config.latency_max = comma == std::string::npos ? config.latency_min : std::stod(value.substr(comma + 1)) / 1000.;
+		} else if (arg == "--disconnects" && has_value) {
+			config.disconnects = std::stod(argv[++i]);
+		} else if (arg == "--step" && has_value) {
+			config.step = std::stod(argv[++i]) / 1000.;
+		} else if (arg == "--min-done" && has_value) {
+			min_done = std::stod(argv[++i]);
+		} else if (arg == "--check-determinism") {
+			check_determinism = true;
+		} else {
+			std::cerr << "usage: " << argv[0] << " [--seed n] [--peers n] [--gens n] [--concurrent n] [--loss p] [--dup p] [--reorder p]"
+				" [--latency min_ms,max_ms] [--disconnects per_peer_per_minute] [--step ms] [--min-done fraction] [--check-determinism]\n";
+			return 1;
+		}
+	}
+
+	// before sodium_init, which would otherwise pick the system rng
+	randombytes_set_implementation(&SeededRandom::g_impl);
+	if (sodium_init() < 0) {
+		std::cerr << "sodium_init failed\n";
+		return 1;
+	}
+
+	// the id hash key is drawn once per process, draw it before the first run
+	SeededRandom::reseed(config.seed);
+	seededIDHash(nullptr, 0);
+
+	TP2PRNGLog::setLevel(TP2PRNGLog::Level::error);
+
+	std::cout << "seed " << config.seed << ", " << config.peers << " peers, " << config.gens << " generations, " << config.concurrent << " concurrent\n";
+
+	const auto time_start = std::chrono::steady_clock::now();
+	const auto res = runSim(config);
+	printResult(res);
+	std::cout << "  wall time    " << std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count() << "s\n";
+
+	bool ok = true;
+	if (res.mismatched != 0u || res.val_errors != 0u) {
+		std::cout << "FAIL: peers disagree\n";
+		ok = false;
+	}
+	if (res.started < config.gens || res.done < min_done * config.gens) {
+		std::cout << "FAIL: too few generations finished\n";
+		ok = false;
+	}
+
+	if (check_determinism) {
+		const auto res2 = runSim(config);
+		if (res2.digest != res.digest || res2.sent != res.sent || res2.lost != res.lost) {
+			std::cout << "FAIL: second run with the same seed diverged\n";
+			printResult(res2);
+			ok = false;
+		}
+	}
+
+	return ok ? 0 : 1;
+}
+
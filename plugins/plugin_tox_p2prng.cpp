@@ -40,6 +40,7 @@ SOLANA_PLUGIN_EXPORT uint32_t solana_plugin_start(struct SolanaAPI* solana_api)
 		// register types
 		PLUG_PROVIDE_INSTANCE(ToxP2PRNG, plugin_name, g_tox_p2prng.get());
 		PLUG_PROVIDE_INSTANCE(P2PRNGI, plugin_name, g_tox_p2prng.get());
+		PLUG_PROVIDE_INSTANCE(P2PRNGMetricsI, plugin_name, g_tox_p2prng.get());
 	} catch (const ResolveException& e) {
 		std::cerr << "PLUGIN " << plugin_name << " " << e.what << "\n";
 		return 2;
@@ -54,8 +55,12 @@ SOLANA_PLUGIN_EXPORT void solana_plugin_stop(void) {
 	g_tox_p2prng.reset();
 }
 
-SOLANA_PLUGIN_EXPORT float solana_plugin_tick(float) {
-	return std::numeric_limits<float>::max();
+SOLANA_PLUGIN_EXPORT float solana_plugin_tick(float delta) {
+	if (!g_tox_p2prng) {
+		return std::numeric_limits<float>::max();
+	}
+
+	return g_tox_p2prng->iterate(delta);
 }
 
 } // extern C
@@ -0,0 +1,158 @@
+#include "./crypto_workers.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+CryptoWorkers::CryptoWorkers(size_t thread_count) {
+	if (thread_count == 0) {
+		thread_count = 1;
+	}
+
+	_threads.reserve(thread_count);
+	for (size_t i = 0; i < thread_count; i++) {
+		_threads.emplace_back(&CryptoWorkers::workerLoop, this);
+	}
+}
+
+CryptoWorkers::~CryptoWorkers(void) {
+	{
+		std::lock_guard lg{_jobs_mutex};
+		_stop = true;
+	}
+	_jobs_cv.notify_all();
+
+	for (auto& t : _threads) {
+		t.join();
+	}
+
+	for (auto* job : _jobs) {
+		delete job;
+	}
+	_jobs.clear();
+
+	Job* job = _completed.exchange(nullptr, std::memory_order_acquire);
+	while (job != nullptr) {
+		Job* next = job->next;
+		delete job;
+		job = next;
+	}
+}
+
+void CryptoWorkers::workerLoop(void) {
+	while (true) {
+		Job* job {nullptr};
+		{
+			std::unique_lock lk{_jobs_mutex};
+			_jobs_cv.wait(lk, [this]() { return _stop || !_jobs.empty(); });
+			if (_stop) {
+				return;
+			}
+
+			job = _jobs.front();
+			_jobs.pop_front();
+		}
+
+		job->work();
+
+		if (!job->done) {
+			delete job;
+			continue;
+		}
+
+		// push onto the completed stack
+		job->next = _completed.load(std::memory_order_relaxed);
+		while (!_completed.compare_exchange_weak(job->next, job, std::memory_order_release, std::memory_order_relaxed)) {
+		}
+	}
+}
+
+void CryptoWorkers::submit(std::function<void(void)>&& work, std::function<void(void)>&& done) {
+	auto* job = new Job{std::move(work), std::move(done)};
+	_in_flight++;
+
+	{
+		std::lock_guard lg{_jobs_mutex};
+		_jobs.push_back(job);
+	}
+	_jobs_cv.notify_one();
+}
+
+void CryptoWorkers::parallelFor(const size_t count, const std::function<void(size_t, size_t)>& fn) {
+	if (count == 0) {
+		return;
+	}
+
+	// a few chunks per thread, so a slow or busy worker does not hold up the rest
+	const size_t chunk_count = std::min(count, (_threads.size()+1) * 4);
+	const size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+
+	struct Shared {
+		std::atomic<size_t> next_chunk {0u};
+		size_t chunks_done {0u};
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+	// helpers might only get to run after we returned
+	auto shared = std::make_shared<Shared>();
+
+	const auto run_chunks = [shared, chunk_count, chunk_size, count, &fn]() {
+		while (true) {
+			const size_t chunk = shared->next_chunk.fetch_add(1, std::memory_order_relaxed);
+			if (chunk >= chunk_count) {
+				return; // fn is only touched while chunks are left, so it is still alive
+			}
+
+			const size_t begin = chunk * chunk_size;
+			fn(begin, std::min(begin + chunk_size, count));
+
+			{
+				std::lock_guard lg{shared->mutex};
+				shared->chunks_done++;
+			}
+			shared->cv.notify_one();
+		}
+	};
+
+	{
+		std::lock_guard lg{_jobs_mutex};
+		for (size_t i = 0; i < _threads.size() && i+1 < chunk_count; i++) {
+			_jobs.push_back(new Job{run_chunks, {}});
+		}
+	}
+	_jobs_cv.notify_all();
+
+	run_chunks();
+
+	std::unique_lock lk{shared->mutex};
+	shared->cv.wait(lk, [&shared, chunk_count]() { return shared->chunks_done == chunk_count; });
+}
+
+size_t CryptoWorkers::drain(void) {
+	// take everything at once, the stack is newest first
+	Job* job = _completed.exchange(nullptr, std::memory_order_acquire);
+
+	Job* ordered {nullptr};
+	while (job != nullptr) {
+		Job* next = job->next;
+		job->next = ordered;
+		ordered = job;
+		job = next;
+	}
+
+	size_t count {0u};
+	while (ordered != nullptr) {
+		Job* next = ordered->next;
+		_in_flight--;
+		count++;
+
+		// might submit new jobs, they land in the next drain
+		ordered->done();
+		delete ordered;
+
+		ordered = next;
+	}
+
+	return count;
+}
+
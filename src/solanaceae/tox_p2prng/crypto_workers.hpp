@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// small thread pool, keeps crypto of large generations off the tox thread
+// work runs on a worker, done runs on whichever thread calls drain()
+// finished jobs are handed back through a lock free stack (treiber),
+// so workers never wait on the owning thread
+class CryptoWorkers {
+	struct Job {
+		std::function<void(void)> work;
+		std::function<void(void)> done; // empty for parallelFor() helpers, they dont complete through drain()
+		Job* next {nullptr};
+	};
+
+	std::vector<std::thread> _threads;
+
+	std::mutex _jobs_mutex;
+	std::condition_variable _jobs_cv;
+	std::deque<Job*> _jobs;
+	bool _stop {false};
+
+	std::atomic<Job*> _completed {nullptr};
+	size_t _in_flight {0u}; // only touched by the owning thread
+
+	void workerLoop(void);
+
+	public:
+		explicit CryptoWorkers(size_t thread_count);
+		CryptoWorkers(const CryptoWorkers&) = delete;
+		// joins, jobs that did not run or complete yet are dropped without calling done
+		~CryptoWorkers(void);
+
+		// work should only touch what it captured by value
+		void submit(std::function<void(void)>&& work, std::function<void(void)>&& done);
+
+		// splits [0, count) into chunks and runs fn(begin, end) on them, blocks until all are done
+		// the calling thread works on chunks too, so this makes progress even if all workers are busy
+		// fn has to be safe to call concurrently for disjoint ranges
+		void parallelFor(const size_t count, const std::function<void(size_t, size_t)>& fn);
+
+		// calls done of every finished job, in the order they finished
+		// returns the number of completions
+		size_t drain(void);
+
+		// submitted, but not drained yet
+		size_t inFlight(void) const { return _in_flight; }
+		size_t threadCount(void) const { return _threads.size(); }
+};
+
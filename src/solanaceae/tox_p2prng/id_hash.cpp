@@ -0,0 +1,29 @@
+#include "./id_hash.hpp"
+
+#include <sodium.h>
+
+#include <cstring>
+
+namespace {
+
+struct HashKey {
+	unsigned char key[crypto_shorthash_KEYBYTES];
+
+	HashKey(void) {
+		randombytes_buf(key, sizeof(key));
+	}
+};
+
+} // namespace
+
+uint64_t seededIDHash(const uint8_t* data, const size_t size) {
+	static const HashKey hash_key; // thread safe init
+
+	unsigned char out[crypto_shorthash_BYTES];
+	crypto_shorthash(out, data, size, hash_key.key);
+
+	uint64_t h {0u};
+	std::memcpy(&h, out, sizeof(h));
+	return h;
+}
+
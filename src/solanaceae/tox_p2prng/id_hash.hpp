@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// ids and keys arrive off the wire, so whoever sends them picks them
+// they are hashed with siphash under a random per process key,
+// so nobody can aim a set of ids at the same bucket
+uint64_t seededIDHash(const uint8_t* data, const size_t size);
+
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "./id_hash.hpp"
+
+#include <solanaceae/util/span.hpp>
+
+#include <array>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+
+// flat open addressing map, keyed by uniformly random 32 byte ids
+// values are stored densely (swap removed), the probe table only holds indices
+// ids are random only if the sender is honest, so they get the seeded hash (id_hash.hpp)
+// lookups can go straight from a ByteSpan, without building an ID first
+// like entt::dense_map, inserting and erasing can move values
+template<typename Value>
+class IDMap {
+	public:
+		using ID = std::array<uint8_t, 32>;
+		using value_type = std::pair<ID, Value>;
+		using iterator = typename std::vector<value_type>::iterator;
+		using const_iterator = typename std::vector<value_type>::const_iterator;
+
+	private:
+		std::vector<value_type> _dense;
+		std::vector<uint32_t> _slots; // dense index + 1, 0 is empty
+		size_t _mask {0u};
+
+		static size_t hash(const uint8_t* id) {
+			return static_cast<size_t>(seededIDHash(id, ID{}.size()));
+		}
+
+		// slot holding id, or the empty slot it would go into
+		size_t findSlot(const uint8_t* id) const {
+			size_t slot = hash(id) & _mask;
+			while (_slots[slot] != 0u && std::memcmp(_dense[_slots[slot]-1].first.data(), id, ID{}.size()) != 0) {
+				slot = (slot + 1) & _mask;
+			}
+			return slot;
+		}
+
+		// keep load at or below 1/2
+		void reserveSlots(const size_t count) {
+			if (count*2 <= _slots.size()) {
+				return;
+			}
+
+			size_t new_size = _slots.empty() ? 16u : _slots.size();
+			while (count*2 > new_size) {
+				new_size *= 2;
+			}
+
+			_slots.assign(new_size, 0u);
+			_mask = new_size - 1;
+			for (size_t i = 0; i < _dense.size(); i++) {
+				_slots[findSlot(_dense[i].first.data())] = static_cast<uint32_t>(i + 1);
+			}
+		}
+
+		iterator eraseSlot(size_t slot) {
+			const size_t index = _slots[slot] - 1;
+
+			// backward shift, so probe chains stay intact without tombstones
+			size_t hole = slot;
+			for (size_t next = (hole + 1) & _mask; _slots[next] != 0u; next = (next + 1) & _mask) {
+				const size_t ideal = hash(_dense[_slots[next]-1].first.data()) & _mask;
+				// can move if the hole is between its ideal slot and where it is now
+				if (((next - ideal) & _mask) >= ((next - hole) & _mask)) {
+					_slots[hole] = _slots[next];
+					hole = next;
+				}
+			}
+			_slots[hole] = 0u;
+
+			// swap remove from dense, repoint the slot of the moved value
+			const size_t last = _dense.size() - 1;
+			if (index != last) {
+				_slots[findSlot(_dense[last].first.data())] = static_cast<uint32_t>(index + 1);
+				_dense[index] = std::move(_dense[last]);
+			}
+			_dense.pop_back();
+
+			return _dense.begin() + index;
+		}
+
+	public:
+		iterator begin(void) { return _dense.begin(); }
+		iterator end(void) { return _dense.end(); }
+		const_iterator begin(void) const { return _dense.cbegin(); }
+		const_iterator end(void) const { return _dense.cend(); }
+		const_iterator cbegin(void) const { return _dense.cbegin(); }
+		const_iterator cend(void) const { return _dense.cend(); }
+
+		size_t size(void) const { return _dense.size(); }
+		bool empty(void) const { return _dense.empty(); }
+
+		void clear(void) {
+			_dense.clear();
+			_slots.clear();
+			_mask = 0u;
+		}
+
+		iterator find(const ByteSpan id) {
+			if (id.size != ID{}.size() || _dense.empty()) {
+				return end();
+			}
+
+			const size_t slot = findSlot(id.ptr);
+			if (_slots[slot] == 0u) {
+				return end();
+			}
+			return _dense.begin() + (_slots[slot] - 1);
+		}
+		const_iterator find(const ByteSpan id) const {
+			return const_cast<IDMap*>(this)->find(id);
+		}
+		iterator find(const ID& id) { return find(ByteSpan{id}); }
+		const_iterator find(const ID& id) const { return find(ByteSpan{id}); }
+
+		bool contains(const ByteSpan id) const { return find(id) != end(); }
+		bool contains(const ID& id) const { return find(id) != end(); }
+
+		// throws std::out_of_range if missing, prefer find()
+		Value& at(const ID& id) {
+			auto it = find(id);
+			if (it == end()) {
+				throw std::out_of_range("IDMap::at: id not found");
+			}
+			return it->second;
+		}
+		const Value& at(const ID& id) const {
+			return const_cast<IDMap*>(this)->at(id);
+		}
+
+		// inserts default constructed if missing
+		Value& operator[](const ID& id) {
+			reserveSlots(_dense.size() + 1);
+
+			const size_t slot = findSlot(id.data());
+			if (_slots[slot] == 0u) {
+				_dense.emplace_back(id, Value{});
+				_slots[slot] = static_cast<uint32_t>(_dense.size());
+			}
+			return _dense[_slots[slot]-1].second;
+		}
+
+		// returns iterator to the element that took its place
+		iterator erase(const_iterator it) {
+			return eraseSlot(findSlot(it->first.data()));
+		}
+
+		size_t erase(const ID& id) {
+			if (_dense.empty()) {
+				return 0u;
+			}
+
+			const size_t slot = findSlot(id.data());
+			if (_slots[slot] == 0u) {
+				return 0u;
+			}
+
+			eraseSlot(slot);
+			return 1u;
+		}
+};
+
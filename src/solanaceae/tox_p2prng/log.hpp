@@ -0,0 +1,165 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// leveled logging with per category filters
+// TOX_P2PRNG_LOG_LEVEL is the lowest level compiled in at all (0 trace .. 5 off),
+// above that the runtime level of the category decides
+// arguments are only evaluated and formatted if the message passes both
+namespace TP2PRNGLog {
+
+enum class Level : uint8_t {
+	trace,
+	debug,
+	info,
+	warn,
+	error,
+	off,
+};
+
+enum class Cat : uint8_t {
+	proto, // incoming packets
+	send, // outgoing packets
+	session, // lifetime, eviction, retries
+	crypto,
+
+	count
+};
+
+#ifndef TOX_P2PRNG_LOG_LEVEL
+	#define TOX_P2PRNG_LOG_LEVEL 0
+#endif
+inline constexpr Level compiled_level {static_cast<Level>(TOX_P2PRNG_LOG_LEVEL)};
+
+// runtime levels per category, default keeps the per packet chatter quiet
+inline std::array<std::atomic<Level>, static_cast<size_t>(Cat::count)> g_levels {
+	Level::info,
+	Level::info,
+	Level::info,
+	Level::info,
+};
+
+inline void setLevel(const Cat cat, const Level level) {
+	g_levels[static_cast<size_t>(cat)].store(level, std::memory_order_relaxed);
+}
+
+inline void setLevel(const Level level) {
+	for (auto& l : g_levels) {
+		l.store(level, std::memory_order_relaxed);
+	}
+}
+
+inline bool enabled(const Level level, const Cat cat) {
+	return level != Level::off && level >= g_levels[static_cast<size_t>(cat)].load(std::memory_order_relaxed);
+}
+
+inline std::ostream& stream(const Level level) {
+	return level >= Level::warn ? std::cerr : std::cout;
+}
+
+} // TP2PRNGLog
+
+#define TP2PRNG_LOG(level, cat, ...) \
+	do { \
+		if constexpr (TP2PRNGLog::Level::level >= TP2PRNGLog::compiled_level) { \
+			if (TP2PRNGLog::enabled(TP2PRNGLog::Level::level, TP2PRNGLog::Cat::cat)) { \
+				TP2PRNGLog::stream(TP2PRNGLog::Level::level) << __VA_ARGS__; \
+			} \
+		} \
+	} while (false)
+
+// the last protocol messages, for post mortem debugging
+// fixed size, the oldest get overwritten
+// pushing never locks, snapshot() skips entries that are being written concurrently
+class ProtoEventRing {
+	public:
+		struct Event {
+			double time {0.0};
+			uint32_t contact {0u}; // entity
+			uint8_t pkg_type {0u};
+			bool outgoing {false};
+			std::array<uint8_t, 8> id_prefix {};
+		};
+
+		static constexpr size_t capacity {256u};
+
+	private:
+		// events are stored as atomic words, so readers never see torn values
+		static constexpr size_t _words {3u};
+		struct Slot {
+			std::atomic<uint64_t> seq {0u}; // odd while being written
+			std::array<std::atomic<uint64_t>, _words> data {};
+		};
+
+		std::array<Slot, capacity> _slots;
+		std::atomic<uint64_t> _head {0u};
+
+		static std::array<uint64_t, _words> pack(const Event& e) {
+			std::array<uint64_t, _words> w {};
+			std::memcpy(&w[0], &e.time, sizeof(e.time));
+			w[1] = uint64_t(e.contact) | (uint64_t(e.pkg_type) << 32) | (uint64_t(e.outgoing ? 1u : 0u) << 40);
+			std::memcpy(&w[2], e.id_prefix.data(), e.id_prefix.size());
+			return w;
+		}
+
+		static Event unpack(const std::array<uint64_t, _words>& w) {
+			Event e;
+			std::memcpy(&e.time, &w[0], sizeof(e.time));
+			e.contact = static_cast<uint32_t>(w[1]);
+			e.pkg_type = static_cast<uint8_t>(w[1] >> 32);
+			e.outgoing = ((w[1] >> 40) & 1u) != 0u;
+			std::memcpy(e.id_prefix.data(), &w[2], e.id_prefix.size());
+			return e;
+		}
+
+	public:
+		void push(const Event& e) {
+			const uint64_t n = _head.fetch_add(1, std::memory_order_relaxed);
+			auto& slot = _slots[n % capacity];
+
+			const auto w = pack(e);
+			slot.seq.store(2*n + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			for (size_t i = 0; i < _words; i++) {
+				slot.data[i].store(w[i], std::memory_order_relaxed);
+			}
+			slot.seq.store(2*n + 2, std::memory_order_release);
+		}
+
+		// oldest first
+		std::vector<Event> snapshot(void) const {
+			const uint64_t head = _head.load(std::memory_order_acquire);
+			const uint64_t begin = head > capacity ? head - capacity : 0u;
+
+			std::vector<Event> events;
+			events.reserve(head - begin);
+			for (uint64_t n = begin; n < head; n++) {
+				const auto& slot = _slots[n % capacity];
+
+				const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+				if (seq != 2*n + 2) {
+					continue; // being written or already overwritten
+				}
+
+				std::array<uint64_t, _words> w {};
+				for (size_t i = 0; i < _words; i++) {
+					w[i] = slot.data[i].load(std::memory_order_relaxed);
+				}
+
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot.seq.load(std::memory_order_relaxed) != seq) {
+					continue;
+				}
+
+				events.push_back(unpack(w));
+			}
+
+			return events;
+		}
+};
+
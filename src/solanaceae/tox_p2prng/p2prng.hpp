@@ -49,6 +49,12 @@
 //
 //
 // Contributing looks almost the same, the inital state is different though
+//
+// ## Pipelined:
+//
+// Every secret also carries a hmac committing to the next round.
+// A generation chained onto it already has all hmacs, so it starts
+// with the secret phase and is done after a single round trip.
 
 namespace P2PRNG {
 	enum State : uint8_t {
@@ -102,6 +108,15 @@ namespace P2PRNG::Events {
 		// TODO: more info?
 	};
 
+	// a chained generation got dropped, it can not finish
+	// either prev got chained a second time (by another peer at the same time),
+	// or it stalled. the commitments of prev are used up either way
+	struct ChainConflict {
+		const ByteSpan id; // the dropped one
+		const ByteSpan prev_id;
+		const ByteSpan fallback_id; // fresh generation started in its place, empty if it was not ours
+	};
+
 	// TODO: what about other peers never receiving all secrets (or hmacs)
 
 } // P2PRNG::Events
@@ -114,6 +129,8 @@ enum class P2PRNG_Event : uint16_t {
 
 	val_error,
 
+	chain_conflict,
+
 	MAX
 };
 
@@ -127,18 +144,42 @@ struct P2PRNGEventI {
 	virtual bool onEvent(const P2PRNG::Events::Secret&) { return false; }
 	virtual bool onEvent(const P2PRNG::Events::Done&) { return false; }
 	virtual bool onEvent(const P2PRNG::Events::ValError&) { return false; }
+	virtual bool onEvent(const P2PRNG::Events::ChainConflict&) { return false; }
 };
 using P2PRNGEventProviderI = EventProviderI<P2PRNGEventI>;
 
 // general p2prng interface
 struct P2PRNGI : public P2PRNGEventProviderI {
-	static constexpr const char* version {"1"};
+	static constexpr const char* version {"4"};
 
 	// returns unique id, you can then use when listen to events
 	// chooses peers depending on C, if C is a group it (tries?) to use everyone?
 	virtual std::vector<uint8_t> newGernation(ContactHandle4 c, const ByteSpan initial_state_user_data) = 0;
 	// manually tell it which peers to use
 	virtual std::vector<uint8_t> newGernationPeers(const std::vector<ContactHandle4>& c_vec, const ByteSpan initial_state_user_data) = 0;
+	// k independent generations with the same peers, returns the ids in the same order (or empty on failure)
+	// implementations can share the protocol exchange, the default just starts them one by one
+	virtual std::vector<std::vector<uint8_t>> newGenerationBatch(const std::vector<ContactHandle4>& c_vec, const std::vector<ByteSpan>& initial_states) {
+		std::vector<std::vector<uint8_t>> ids;
+		for (const auto& is : initial_states) {
+			ids.push_back(newGernationPeers(c_vec, is));
+		}
+		return ids;
+	}
+	// like newGernationPeers, but every secret also commits to the next round
+	// the default does not pipeline
+	virtual std::vector<uint8_t> newGenerationPipelined(const std::vector<ContactHandle4>& c_vec, const ByteSpan initial_state_user_data) {
+		return newGernationPeers(c_vec, initial_state_user_data);
+	}
+	// new generation with the same peers, using the commitments made in prev (which needs to be pipelined)
+	// skips the hmac phase, each prev can only be chained once
+	// if a peer chains the same prev at the same time, neither finishes and ours gets started fresh (see Events::ChainConflict)
+	// returns empty if not possible (yet), eg not all next hmacs arrived
+	virtual std::vector<uint8_t> newGenerationChained(const ByteSpan prev_id, const ByteSpan initial_state_user_data) {
+		(void)prev_id;
+		(void)initial_state_user_data;
+		return {};
+	}
 
 
 	// TODO: do we really need this, or are event enough??
@@ -0,0 +1,128 @@
+#include "./p2prng_metrics.hpp"
+
+#include <entt/entity/registry.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+void LatencyHistogram::record(const double seconds) {
+	size_t i = 0;
+	while (i < P2PRNGMetricsI::latency_bounds.size() && seconds > P2PRNGMetricsI::latency_bounds[i]) {
+		i++;
+	}
+
+	_buckets[i].fetch_add(1, std::memory_order_relaxed);
+	_count.fetch_add(1, std::memory_order_relaxed);
+	_sum_us.fetch_add(static_cast<uint64_t>(std::max(seconds, 0.0) * 1'000'000.0), std::memory_order_relaxed);
+}
+
+P2PRNGMetricsI::Histogram LatencyHistogram::get(void) const {
+	P2PRNGMetricsI::Histogram h;
+	for (size_t i = 0; i < _buckets.size(); i++) {
+		h.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+	}
+	h.count = _count.load(std::memory_order_relaxed);
+	h.sum = static_cast<double>(_sum_us.load(std::memory_order_relaxed)) / 1'000'000.0;
+	return h;
+}
+
+static void histogramToText(std::ostringstream& out, const char* name, const P2PRNGMetricsI::Histogram& h) {
+	// cumulative, like prometheus
+	uint64_t cumulative {0u};
+	for (size_t i = 0; i < P2PRNGMetricsI::latency_bounds.size(); i++) {
+		cumulative += h.buckets[i];
+		out << name << "_bucket{le=\"" << P2PRNGMetricsI::latency_bounds[i] << "\"} " << cumulative << "\n";
+	}
+	out << name << "_bucket{le=\"+Inf\"} " << h.count << "\n";
+	out << name << "_sum " << h.sum << "\n";
+	out << name << "_count " << h.count << "\n";
+}
+
+std::string metricsToText(const P2PRNGMetricsI::Snapshot& snapshot) {
+	std::ostringstream out;
+
+	histogramToText(out, "p2prng_init_to_all_hmacs_seconds", snapshot.init_to_all_hmacs);
+	histogramToText(out, "p2prng_all_hmacs_to_done_seconds", snapshot.all_hmacs_to_done);
+
+	for (const auto& p : snapshot.pkgs) {
+		const int type = p.type;
+		out << "p2prng_pkgs_sent{type=\"" << type << "\"} " << p.sent << "\n";
+		out << "p2prng_bytes_sent{type=\"" << type << "\"} " << p.sent_bytes << "\n";
+		out << "p2prng_pkgs_received{type=\"" << type << "\"} " << p.received << "\n";
+		out << "p2prng_bytes_received{type=\"" << type << "\"} " << p.received_bytes << "\n";
+	}
+
+	out << "p2prng_send_failures " << snapshot.send_failures << "\n";
+	out << "p2prng_val_errors " << snapshot.val_errors << "\n";
+
+	static constexpr const char* state_names[] {"unknown", "init", "hmac", "secret", "done"};
+	for (size_t i = 0; i < snapshot.sessions_by_state.size(); i++) {
+		out << "p2prng_sessions{state=\"" << state_names[i] << "\"} " << snapshot.sessions_by_state[i] << "\n";
+	}
+
+	for (const auto& p : snapshot.peers) {
+		const auto c = entt::to_integral(p.c);
+		out << "p2prng_peer_responses{contact=\"" << c << "\"} " << p.responses << "\n";
+		out << "p2prng_peer_response_seconds_sum{contact=\"" << c << "\"} " << p.sum << "\n";
+		out << "p2prng_peer_response_seconds_max{contact=\"" << c << "\"} " << p.max << "\n";
+	}
+
+	return out.str();
+}
+
+static void appendU64(std::vector<uint8_t>& out, const uint64_t value) {
+	for (size_t i = 0; i < sizeof(value); i++) {
+		out.push_back((value>>(i*8)) & 0xff);
+	}
+}
+
+static void appendF64(std::vector<uint8_t>& out, const double value) {
+	uint64_t bits {0u};
+	std::memcpy(&bits, &value, sizeof(bits));
+	appendU64(out, bits);
+}
+
+static void histogramToBinary(std::vector<uint8_t>& out, const P2PRNGMetricsI::Histogram& h) {
+	for (const auto b : h.buckets) {
+		appendU64(out, b);
+	}
+	appendU64(out, h.count);
+	appendF64(out, h.sum);
+}
+
+std::vector<uint8_t> metricsToBinary(const P2PRNGMetricsI::Snapshot& snapshot) {
+	std::vector<uint8_t> out {'P', '2', 'P', 'M', 1u};
+
+	out.push_back(static_cast<uint8_t>(P2PRNGMetricsI::latency_bounds.size()+1));
+	histogramToBinary(out, snapshot.init_to_all_hmacs);
+	histogramToBinary(out, snapshot.all_hmacs_to_done);
+
+	out.push_back(static_cast<uint8_t>(snapshot.pkgs.size()));
+	for (const auto& p : snapshot.pkgs) {
+		out.push_back(p.type);
+		appendU64(out, p.sent);
+		appendU64(out, p.sent_bytes);
+		appendU64(out, p.received);
+		appendU64(out, p.received_bytes);
+	}
+
+	appendU64(out, snapshot.send_failures);
+	appendU64(out, snapshot.val_errors);
+
+	out.push_back(static_cast<uint8_t>(snapshot.sessions_by_state.size()));
+	for (const auto s : snapshot.sessions_by_state) {
+		appendU64(out, s);
+	}
+
+	appendU64(out, snapshot.peers.size());
+	for (const auto& p : snapshot.peers) {
+		appendU64(out, entt::to_integral(p.c));
+		appendU64(out, p.responses);
+		appendF64(out, p.sum);
+		appendF64(out, p.max);
+	}
+
+	return out;
+}
+
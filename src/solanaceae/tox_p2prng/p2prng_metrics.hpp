@@ -0,0 +1,77 @@
+#pragma once
+
+#include <solanaceae/contact/fwd.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// protocol health and latency, provided next to P2PRNGI
+struct P2PRNGMetricsI {
+	static constexpr const char* version {"1"};
+
+	// upper bounds in seconds, the last bucket catches everything above
+	static constexpr std::array<float, 12> latency_bounds {
+		0.01f, 0.025f, 0.05f, 0.1f, 0.25f, 0.5f,
+		1.f, 2.5f, 5.f, 10.f, 30.f, 60.f,
+	};
+
+	struct Histogram {
+		std::array<uint64_t, latency_bounds.size()+1> buckets {};
+		uint64_t count {0u};
+		double sum {0.0}; // seconds
+	};
+
+	// per packet type, type is implementation defined
+	struct PkgStats {
+		uint8_t type {0u};
+		uint64_t sent {0u};
+		uint64_t sent_bytes {0u};
+		uint64_t received {0u};
+		uint64_t received_bytes {0u};
+	};
+
+	// how long a peer took to answer with its hmac, counted from the start of the generation
+	struct PeerStats {
+		Contact4 c;
+		uint64_t responses {0u};
+		double sum {0.0}; // seconds
+		double max {0.0};
+	};
+
+	struct Snapshot {
+		Histogram init_to_all_hmacs;
+		Histogram all_hmacs_to_done;
+
+		std::vector<PkgStats> pkgs; // only types seen
+		uint64_t send_failures {0u}; // dropped for errors or queue overflow
+		uint64_t val_errors {0u};
+
+		std::array<uint64_t, 5> sessions_by_state {}; // indexed by P2PRNG::State
+		std::vector<PeerStats> peers;
+	};
+
+	virtual ~P2PRNGMetricsI(void) {}
+
+	virtual Snapshot getMetricsSnapshot(void) const = 0;
+};
+
+// lock free histogram, record() can be called from any thread
+class LatencyHistogram {
+	std::array<std::atomic<uint64_t>, P2PRNGMetricsI::latency_bounds.size()+1> _buckets {};
+	std::atomic<uint64_t> _count {0u};
+	std::atomic<uint64_t> _sum_us {0u};
+
+	public:
+		void record(const double seconds);
+		P2PRNGMetricsI::Histogram get(void) const;
+};
+
+// "name{labels} value" lines, prometheus like
+std::string metricsToText(const P2PRNGMetricsI::Snapshot& snapshot);
+
+// compact little endian encoding, starts with "P2PM" and a version byte
+std::vector<uint8_t> metricsToBinary(const P2PRNGMetricsI::Snapshot& snapshot);
+
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <solanaceae/util/span.hpp>
+
+#include <p2prng.h>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// the building blocks of every packet layout
+// decoding hands out views into the packet, encoding writes into a buffer
+// that was sized exactly up front, so neither side copies byte by byte
+namespace PkgCodec {
+
+// field sizes, everything is little endian
+inline constexpr size_t header_size {1u+1u}; // recipient kind + packet type
+inline constexpr size_t id_size {32u};
+inline constexpr size_t key_size {32u};
+inline constexpr size_t flags_size {1u};
+inline constexpr size_t hmac_size {P2PRNG_MAC_LEN};
+inline constexpr size_t secret_size {P2PRNG_LEN + P2PRNG_MAC_KEY_LEN}; // msg+k
+inline constexpr size_t keys_hash_size {16u}; // over the full keys behind a compact peer list
+
+constexpr size_t peerListSize(const size_t count) {
+	return sizeof(uint16_t) + count*key_size;
+}
+
+constexpr size_t compactPeerListSize(const size_t count, const size_t prefix_len) {
+	return sizeof(uint16_t) + 1u + count*prefix_len + keys_hash_size;
+}
+
+// count + full keys, in fusion order
+struct PeerList {
+	uint16_t count {0u};
+	ByteSpan keys; // count * key_size
+
+	const uint8_t* key(const size_t i) const { return keys.ptr + i*key_size; }
+};
+
+// count + key prefixes of group peers + hash of the full keys
+struct CompactPeerList {
+	uint16_t count {0u};
+	uint8_t prefix_len {0u};
+	ByteSpan prefixes; // count * prefix_len
+	ByteSpan keys_hash; // keys_hash_size
+
+	// prefix_len needs to be validated (<= 8) before
+	uint64_t prefix(const size_t i) const {
+		uint64_t value {0u};
+		std::memcpy(&value, prefixes.ptr + i*prefix_len, prefix_len);
+		return value;
+	}
+};
+
+// bounds checked cursor, a failed read does not advance
+class Reader {
+	ByteSpan _data;
+	size_t _curser {0u};
+
+	public:
+		explicit Reader(const ByteSpan data) : _data(data) {}
+
+		size_t remaining(void) const { return _data.size - _curser; }
+
+		bool u8(uint8_t& value) {
+			if (remaining() < 1u) {
+				return false;
+			}
+			value = _data.ptr[_curser++];
+			return true;
+		}
+
+		bool u16(uint16_t& value) {
+			if (remaining() < sizeof(value)) {
+				return false;
+			}
+			const uint8_t* p = _data.ptr + _curser;
+			value = uint16_t(p[0]) | uint16_t(p[1]) << 8;
+			_curser += sizeof(value);
+			return true;
+		}
+
+		bool u32(uint32_t& value) {
+			if (remaining() < sizeof(value)) {
+				return false;
+			}
+			const uint8_t* p = _data.ptr + _curser;
+			value = uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+			_curser += sizeof(value);
+			return true;
+		}
+
+		// view of the next size bytes
+		bool span(const size_t size, ByteSpan& out) {
+			if (remaining() < size) {
+				return false;
+			}
+			out = ByteSpan{_data.ptr + _curser, size};
+			_curser += size;
+			return true;
+		}
+
+		// for fixed size fields that outlive the packet, eg digests
+		template<size_t N>
+		bool array(std::array<uint8_t, N>& out) {
+			if (remaining() < N) {
+				return false;
+			}
+			std::memcpy(out.data(), _data.ptr + _curser, N);
+			_curser += N;
+			return true;
+		}
+
+		// everything that is left, might be empty
+		ByteSpan rest(void) {
+			const ByteSpan out {_data.ptr + _curser, remaining()};
+			_curser = _data.size;
+			return out;
+		}
+
+		bool peerList(PeerList& out) {
+			const size_t start = _curser;
+			if (!u16(out.count) || !span(size_t(out.count)*key_size, out.keys)) {
+				_curser = start;
+				return false;
+			}
+			return true;
+		}
+
+		bool compactPeerList(CompactPeerList& out) {
+			const size_t start = _curser;
+			if (
+				!u16(out.count) || !u8(out.prefix_len) ||
+				!span(size_t(out.count)*out.prefix_len, out.prefixes) ||
+				!span(keys_hash_size, out.keys_hash)
+			) {
+				_curser = start;
+				return false;
+			}
+			return true;
+		}
+};
+
+// fills buf from offset to its end, buf has to be resized to the exact packet size before
+// writes that would not fit are dropped and make full() fail
+class Writer {
+	uint8_t* _ptr {nullptr};
+	size_t _size {0u};
+	size_t _curser {0u};
+	bool _overflow {false};
+
+	public:
+		Writer(std::vector<uint8_t>& buf, const size_t offset) : _ptr(buf.data()), _size(buf.size()), _curser(offset) {}
+
+		void bytes(const uint8_t* data, const size_t size) {
+			if (_overflow || _size - _curser < size) {
+				_overflow = true;
+				return;
+			}
+			if (size > 0u) {
+				std::memcpy(_ptr + _curser, data, size);
+			}
+			_curser += size;
+		}
+
+		void bytes(const ByteSpan data) { bytes(data.ptr, data.size); }
+
+		template<size_t N>
+		void bytes(const std::array<uint8_t, N>& data) { bytes(data.data(), N); }
+
+		void u8(const uint8_t value) { bytes(&value, 1u); }
+
+		void u16(const uint16_t value) {
+			const uint8_t le[sizeof(value)] {
+				static_cast<uint8_t>(value & 0xff),
+				static_cast<uint8_t>((value >> 8) & 0xff),
+			};
+			bytes(le, sizeof(le));
+		}
+
+		void u32(const uint32_t value) {
+			const uint8_t le[sizeof(value)] {
+				static_cast<uint8_t>(value & 0xff),
+				static_cast<uint8_t>((value >> 8) & 0xff),
+				static_cast<uint8_t>((value >> 16) & 0xff),
+				static_cast<uint8_t>((value >> 24) & 0xff),
+			};
+			bytes(le, sizeof(le));
+		}
+
+		// everything written and nothing dropped
+		bool full(void) const { return !_overflow && _curser == _size; }
+};
+
+} // PkgCodec
+
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+// recycles outgoing packet buffers
+// released buffers keep their capacity, so once warmed up the packet bytes themselves
+// are not allocated anymore (see test/pkg_pool_test.cpp)
+// the containers around them still can, eg the per peer send queue deque and
+// the vector of fragments from buildInitDigestPkgs()
+// not thread safe, only used from the tox thread
+class PkgPool {
+	public:
+		struct Stats {
+			uint64_t acquired {0u};
+			uint64_t allocated {0u}; // acquires that had to grow or create a buffer
+		};
+
+		// move only handle, gives the buffer back on destruction
+		class Buffer {
+			PkgPool* _pool {nullptr};
+			std::vector<uint8_t> _data;
+
+			public:
+				Buffer(void) = default;
+				Buffer(PkgPool& pool, std::vector<uint8_t>&& data) : _pool(&pool), _data(std::move(data)) {}
+				Buffer(const Buffer&) = delete;
+				Buffer(Buffer&& other) noexcept : _pool(other._pool), _data(std::move(other._data)) {
+					other._pool = nullptr;
+				}
+				Buffer& operator=(const Buffer&) = delete;
+				Buffer& operator=(Buffer&& other) noexcept {
+					if (this != &other) {
+						reset();
+						_pool = other._pool;
+						_data = std::move(other._data);
+						other._pool = nullptr;
+					}
+					return *this;
+				}
+				~Buffer(void) { reset(); }
+
+				void reset(void) {
+					if (_pool != nullptr) {
+						_pool->release(std::move(_data));
+						_pool = nullptr;
+					}
+					_data = {};
+				}
+
+				std::vector<uint8_t>& operator*(void) { return _data; }
+				const std::vector<uint8_t>& operator*(void) const { return _data; }
+				std::vector<uint8_t>* operator->(void) { return &_data; }
+				const std::vector<uint8_t>* operator->(void) const { return &_data; }
+		};
+
+	private:
+		std::vector<std::vector<uint8_t>> _free;
+		Stats _stats;
+
+		// bounds what an idle pool holds on to
+		static constexpr size_t _max_free {256u};
+		static constexpr size_t _max_capacity {64u*1024u};
+
+		void release(std::vector<uint8_t>&& data) {
+			if (_free.size() >= _max_free || data.capacity() == 0u || data.capacity() > _max_capacity) {
+				return; // let it go
+			}
+			data.clear();
+			_free.push_back(std::move(data));
+		}
+
+	public:
+		PkgPool(void) = default;
+		PkgPool(const PkgPool&) = delete;
+
+		// empty buffer with at least size capacity
+		Buffer acquire(const size_t size) {
+			_stats.acquired++;
+
+			std::vector<uint8_t> data;
+			if (!_free.empty()) {
+				data = std::move(_free.back());
+				_free.pop_back();
+			}
+
+			if (data.capacity() < size) {
+				_stats.allocated++;
+				data.reserve(size);
+			}
+
+			return Buffer{*this, std::move(data)};
+		}
+
+		// copy of data in a pooled buffer
+		Buffer copy(const std::vector<uint8_t>& data) {
+			auto buf = acquire(data.size());
+			buf->assign(data.cbegin(), data.cend());
+			return buf;
+		}
+
+		const Stats& getStats(void) const { return _stats; }
+};
+
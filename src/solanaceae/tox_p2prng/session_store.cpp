@@ -0,0 +1,261 @@
+#include "./session_store.hpp"
+#include "./log.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+#ifdef _WIN32
+	#include <io.h>
+#else
+	#include <unistd.h>
+#endif
+
+// log:
+//   - magic + version
+//   - records
+//
+// record:
+//   - type
+//   - body size (u32)
+//   - id
+//   - body
+//   - checksum over all of the above (u32)
+
+static constexpr uint8_t g_magic[] {'T', 'P', '2', 'S', 1u};
+static constexpr size_t g_record_overhead {1u + sizeof(uint32_t) + std::tuple_size_v<SessionStore::ID> + sizeof(uint32_t)};
+
+// fnv-1a, only needs to catch torn writes
+static uint32_t checksum(const uint8_t* data, const size_t size) {
+	uint32_t h {2166136261u};
+	for (size_t i = 0; i < size; i++) {
+		h ^= data[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t readU32(const uint8_t* p) {
+	return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+static void appendU32(std::vector<uint8_t>& out, const uint32_t value) {
+	for (size_t i = 0; i < sizeof(value); i++) {
+		out.push_back((value>>(i*8)) & 0xff);
+	}
+}
+
+static bool syncFile(FILE* file) {
+	if (std::fflush(file) != 0) {
+		return false;
+	}
+
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+SessionStore::~SessionStore(void) {
+	close();
+}
+
+bool SessionStore::open(const std::string& path, std::vector<uint8_t>& loaded, std::vector<Record>& records) {
+	close();
+	loaded.clear();
+	records.clear();
+
+	// one sequential read of everything
+	if (FILE* file = std::fopen(path.c_str(), "rb"); file != nullptr) {
+		std::fseek(file, 0, SEEK_END);
+		const long file_size = std::ftell(file);
+		std::fseek(file, 0, SEEK_SET);
+
+		if (file_size > 0) {
+			loaded.resize(file_size);
+			loaded.resize(std::fread(loaded.data(), 1, loaded.size(), file));
+		}
+		std::fclose(file);
+	}
+
+	if (!loaded.empty() && (loaded.size() < sizeof(g_magic) || std::memcmp(loaded.data(), g_magic, sizeof(g_magic)) != 0)) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: " << path << " is not a session store, not touching it\n");
+		loaded.clear();
+		return false;
+	}
+
+	// records are used in place
+	size_t valid_end = loaded.empty() ? 0u : sizeof(g_magic);
+	while (loaded.size() - valid_end >= g_record_overhead) {
+		const uint8_t* p = loaded.data() + valid_end;
+		const size_t body_size = readU32(p + 1);
+		if (body_size > loaded.size() - valid_end - g_record_overhead) {
+			break; // torn
+		}
+
+		const size_t checked_size = g_record_overhead - sizeof(uint32_t) + body_size;
+		if (checksum(p, checked_size) != readU32(p + checked_size)) {
+			break; // torn
+		}
+
+		Record& record = records.emplace_back();
+		record.type = static_cast<RecordType>(p[0]);
+		std::memcpy(record.id.data(), p + 1 + sizeof(uint32_t), record.id.size());
+		record.body = ByteSpan{p + 1 + sizeof(uint32_t) + record.id.size(), body_size};
+		record.raw = ByteSpan{p, g_record_overhead + body_size};
+
+		valid_end += g_record_overhead + body_size;
+	}
+
+	if (valid_end < loaded.size()) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: session store has a damaged tail of " << loaded.size() - valid_end << " bytes, dropping it\n");
+		std::error_code err;
+		std::filesystem::resize_file(path, valid_end, err);
+		if (err) {
+			TP2PRNG_LOG(error, session, "TP2PRNG error: failed to truncate session store: " << err.message() << "\n");
+			records.clear();
+			loaded.clear();
+			return false;
+		}
+	}
+
+	_file = std::fopen(path.c_str(), "ab");
+	if (_file == nullptr) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: failed to open session store " << path << "\n");
+		records.clear();
+		loaded.clear();
+		return false;
+	}
+	_path = path;
+	_size = valid_end;
+
+	if (valid_end == 0u) {
+		_buffer.insert(_buffer.cend(), std::cbegin(g_magic), std::cend(g_magic));
+		_size += sizeof(g_magic);
+		_sync_pending = true;
+		sync();
+	}
+
+	return true;
+}
+
+void SessionStore::close(void) {
+	if (_file == nullptr) {
+		return;
+	}
+
+	sync();
+	std::fclose(_file);
+	_file = nullptr;
+	_buffer.clear();
+	_sync_pending = false;
+	_size = 0u;
+}
+
+void SessionStore::encode(std::vector<uint8_t>& out, RecordType type, const ID& id, const ByteSpan body) {
+	const size_t start = out.size();
+	out.reserve(start + g_record_overhead + body.size);
+
+	out.push_back(static_cast<uint8_t>(type));
+	appendU32(out, body.size);
+	out.insert(out.cend(), id.cbegin(), id.cend());
+	out.insert(out.cend(), body.cbegin(), body.cend());
+	appendU32(out, checksum(out.data() + start, out.size() - start));
+}
+
+void SessionStore::append(RecordType type, const ID& id, const ByteSpan body, const bool durable) {
+	if (_file == nullptr) {
+		return;
+	}
+
+	const size_t prev_size = _buffer.size();
+	encode(_buffer, type, id, body);
+	_size += _buffer.size() - prev_size;
+	_sync_pending = _sync_pending || durable;
+}
+
+bool SessionStore::writeBuffer(void) {
+	if (_buffer.empty()) {
+		return true;
+	}
+
+	// only drop what made it out, the rest gets retried with the next write
+	const size_t written = std::fwrite(_buffer.data(), 1, _buffer.size(), _file);
+	_buffer.erase(_buffer.cbegin(), _buffer.cbegin() + written);
+	if (!_buffer.empty()) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: failed to write session store, " << _buffer.size() << " bytes pending\n");
+		std::clearerr(_file);
+		return false;
+	}
+	return true;
+}
+
+bool SessionStore::sync(void) {
+	if (_file == nullptr) {
+		return false;
+	}
+
+	if (!writeBuffer()) {
+		return false; // still pending
+	}
+
+	if (_sync_pending) {
+		if (!syncFile(_file)) {
+			TP2PRNG_LOG(error, session, "TP2PRNG error: failed to sync session store\n");
+			return false; // still pending
+		}
+		_sync_pending = false;
+	}
+	return true;
+}
+
+bool SessionStore::flush(void) {
+	if (_file == nullptr) {
+		return false;
+	}
+
+	return writeBuffer() && std::fflush(_file) == 0;
+}
+
+bool SessionStore::rewrite(const ByteSpan records) {
+	if (_file == nullptr) {
+		return false;
+	}
+
+	const std::string tmp_path = _path + ".tmp";
+	FILE* tmp = std::fopen(tmp_path.c_str(), "wb");
+	if (tmp == nullptr) {
+		return false;
+	}
+
+	bool ok = std::fwrite(g_magic, 1, sizeof(g_magic), tmp) == sizeof(g_magic);
+	ok = ok && std::fwrite(records.ptr, 1, records.size, tmp) == records.size;
+	ok = syncFile(tmp) && ok;
+	std::fclose(tmp);
+
+	std::error_code err;
+	if (ok) {
+		std::filesystem::rename(tmp_path, _path, err);
+	}
+	if (!ok || err) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: failed to rewrite session store\n");
+		std::filesystem::remove(tmp_path, err);
+		return false;
+	}
+
+	// everything pending is part of the new log
+	std::fclose(_file);
+	_buffer.clear();
+	_sync_pending = false;
+	_size = sizeof(g_magic) + records.size;
+
+	_file = std::fopen(_path.c_str(), "ab");
+	if (_file == nullptr) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: failed to reopen session store " << _path << "\n");
+		return false;
+	}
+
+	return true;
+}
+
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <solanaceae/util/span.hpp>
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// crash safe persistence of in flight generations, as an append only log
+// records are never touched again once written, a torn write at the end
+// is detected by its checksum and cut off when loading
+// not thread safe, only used from the tox thread
+class SessionStore {
+	public:
+		using ID = std::array<uint8_t, 32>;
+
+		enum class RecordType : uint8_t {
+			INVALID = 0u,
+
+			SESSION, // everything known at creation: flags, participants, own hmac and secret, is
+			HMAC, // round (0 this, 1 next) + participant index + hmac
+			SECRET, // participant index + verified secret
+			NEXT, // own commitment for the next round (pipelined), next secret + next hmac
+			CHAINED, // the next round commitments got used by the generation id in the body
+			END, // evicted, everything about this id is dead
+		};
+
+		// views into the loaded log
+		struct Record {
+			RecordType type {RecordType::INVALID};
+			ID id {};
+			ByteSpan body;
+			ByteSpan raw; // the whole record, as it is in the log
+		};
+
+	private:
+		std::string _path;
+		FILE* _file {nullptr};
+
+		std::vector<uint8_t> _buffer; // appended, but not written yet
+		bool _sync_pending {false}; // a durable record was appended, but not synced
+		uint64_t _size {0u}; // bytes in the log, including the buffer
+
+		bool writeBuffer(void);
+
+	public:
+		SessionStore(void) = default;
+		SessionStore(const SessionStore&) = delete;
+		~SessionStore(void);
+
+		// opens or creates the log
+		// the whole file is read in one go into loaded, records point into it,
+		// a damaged tail is truncated
+		bool open(const std::string& path, std::vector<uint8_t>& loaded, std::vector<Record>& records);
+		void close(void);
+		bool isOpen(void) const { return _file != nullptr; }
+
+		// buffered, durable ones get synced by the next sync()
+		// eg our own secret, which needs to be on disk before the hmac committing to it leaves
+		void append(RecordType type, const ID& id, const ByteSpan body, const bool durable = false);
+
+		// writes the buffer, and fsyncs if a durable record is pending
+		// on failure nothing is dropped and the sync stays pending
+		bool sync(void);
+		bool syncPending(void) const { return _sync_pending; }
+
+		// writes the buffer, without waiting for the disk
+		bool flush(void);
+
+		// replaces the log with the given records (made with encode()), atomically (rename)
+		bool rewrite(const ByteSpan records);
+
+		uint64_t size(void) const { return _size; }
+
+		static void encode(std::vector<uint8_t>& out, RecordType type, const ID& id, const ByteSpan body);
+};
+
@@ -0,0 +1,178 @@
+#include "./tox_key_index.hpp"
+
+#include <solanaceae/tox_contacts/components.hpp>
+
+#include <entt/entity/registry.hpp>
+#include <entt/entity/handle.hpp>
+
+ToxKeyIndex::~ToxKeyIndex(void) {
+	unbind();
+}
+
+void ToxKeyIndex::bind(ContactRegistry4& reg) {
+	if (boundTo(reg)) {
+		return;
+	}
+
+	unbind();
+	_reg = &reg;
+	_generation++;
+
+	_reg->on_construct<Contact::Components::ToxFriendPersistent>().connect<&ToxKeyIndex::onFriendSet>(this);
+	_reg->on_update<Contact::Components::ToxFriendPersistent>().connect<&ToxKeyIndex::onFriendSet>(this);
+	_reg->on_destroy<Contact::Components::ToxFriendPersistent>().connect<&ToxKeyIndex::onFriendDestroy>(this);
+
+	_reg->on_construct<Contact::Components::ToxGroupPeerPersistent>().connect<&ToxKeyIndex::onGroupPeerSet>(this);
+	_reg->on_update<Contact::Components::ToxGroupPeerPersistent>().connect<&ToxKeyIndex::onGroupPeerSet>(this);
+	_reg->on_destroy<Contact::Components::ToxGroupPeerPersistent>().connect<&ToxKeyIndex::onGroupPeerDestroy>(this);
+
+	// catch up on everything that exists already
+	for (const auto& [c, tfp] : _reg->view<Contact::Components::ToxFriendPersistent>().each()) {
+		_friends[tfp.key] = c;
+		_friends_rev[c] = tfp.key;
+	}
+
+	for (const auto c : _reg->view<Contact::Components::ToxGroupPeerPersistent>()) {
+		onGroupPeerSet(*_reg, c);
+	}
+}
+
+void ToxKeyIndex::unbind(void) {
+	if (_reg == nullptr) {
+		return;
+	}
+
+	_reg->on_construct<Contact::Components::ToxFriendPersistent>().disconnect<&ToxKeyIndex::onFriendSet>(this);
+	_reg->on_update<Contact::Components::ToxFriendPersistent>().disconnect<&ToxKeyIndex::onFriendSet>(this);
+	_reg->on_destroy<Contact::Components::ToxFriendPersistent>().disconnect<&ToxKeyIndex::onFriendDestroy>(this);
+
+	_reg->on_construct<Contact::Components::ToxGroupPeerPersistent>().disconnect<&ToxKeyIndex::onGroupPeerSet>(this);
+	_reg->on_update<Contact::Components::ToxGroupPeerPersistent>().disconnect<&ToxKeyIndex::onGroupPeerSet>(this);
+	_reg->on_destroy<Contact::Components::ToxGroupPeerPersistent>().disconnect<&ToxKeyIndex::onGroupPeerDestroy>(this);
+
+	_reg = nullptr;
+
+	_friends.clear();
+	_friends_rev.clear();
+	_group_peers.clear();
+	_group_peers_rev.clear();
+	_groups.clear();
+}
+
+ContactHandle4 ToxKeyIndex::findFriend(const ToxKey& key) const {
+	if (_reg == nullptr) {
+		return {};
+	}
+
+	const auto it = _friends.find(key);
+	if (it == _friends.cend()) {
+		return {};
+	}
+
+	return ContactHandle4{*_reg, it->second};
+}
+
+ContactHandle4 ToxKeyIndex::findGroupPeer(const ToxKey& chat_id, const ToxKey& peer_key) const {
+	if (_reg == nullptr) {
+		return {};
+	}
+
+	const auto it = _group_peers.find(GroupPeerKey{chat_id, peer_key});
+	if (it == _group_peers.cend()) {
+		return {};
+	}
+
+	return ContactHandle4{*_reg, it->second};
+}
+
+std::vector<ContactHandle4> ToxKeyIndex::getGroupPeers(const ToxKey& chat_id) const {
+	if (_reg == nullptr) {
+		return {};
+	}
+
+	const auto it = _groups.find(chat_id);
+	if (it == _groups.cend()) {
+		return {};
+	}
+
+	std::vector<ContactHandle4> peers;
+	peers.reserve(it->second.size());
+	for (const auto c : it->second) {
+		peers.push_back(ContactHandle4{*_reg, c});
+	}
+
+	return peers;
+}
+
+void ToxKeyIndex::onFriendSet(ContactRegistry4& reg, Contact4 c) {
+	// the key might have changed, drop the old one first
+	dropFriend(c);
+
+	const auto& key = reg.get<Contact::Components::ToxFriendPersistent>(c).key;
+	_friends[key] = c;
+	_friends_rev[c] = key;
+	_generation++;
+}
+
+void ToxKeyIndex::onFriendDestroy(ContactRegistry4&, Contact4 c) {
+	dropFriend(c);
+	if (_on_destroy) {
+		_on_destroy(c);
+	}
+}
+
+void ToxKeyIndex::dropFriend(Contact4 c) {
+	const auto rev_it = _friends_rev.find(c);
+	if (rev_it == _friends_rev.cend()) {
+		return;
+	}
+
+	// only erase if it still points to us
+	if (const auto it = _friends.find(rev_it->second); it != _friends.cend() && it->second == c) {
+		_friends.erase(it);
+	}
+	_friends_rev.erase(rev_it);
+}
+
+void ToxKeyIndex::onGroupPeerSet(ContactRegistry4& reg, Contact4 c) {
+	dropGroupPeer(c);
+
+	const auto& tgpp = reg.get<Contact::Components::ToxGroupPeerPersistent>(c);
+	const GroupPeerKey gpk{tgpp.chat_id, tgpp.peer_key};
+	auto& group = _groups[gpk.chat_id];
+	if (const auto [it, inserted] = _group_peers.try_emplace(gpk, c); !inserted) {
+		// same key on another contact, the newer one wins
+		group.erase(it->second);
+		it->second = c;
+	}
+	group.emplace(c);
+	_group_peers_rev[c] = gpk;
+	_generation++;
+}
+
+void ToxKeyIndex::onGroupPeerDestroy(ContactRegistry4&, Contact4 c) {
+	dropGroupPeer(c);
+	if (_on_destroy) {
+		_on_destroy(c);
+	}
+}
+
+void ToxKeyIndex::dropGroupPeer(Contact4 c) {
+	const auto rev_it = _group_peers_rev.find(c);
+	if (rev_it == _group_peers_rev.cend()) {
+		return;
+	}
+
+	if (const auto it = _group_peers.find(rev_it->second); it != _group_peers.cend() && it->second == c) {
+		_group_peers.erase(it);
+
+		if (const auto group_it = _groups.find(rev_it->second.chat_id); group_it != _groups.cend()) {
+			group_it->second.erase(c);
+			if (group_it->second.empty()) {
+				_groups.erase(group_it);
+			}
+		}
+	}
+	_group_peers_rev.erase(rev_it);
+}
+
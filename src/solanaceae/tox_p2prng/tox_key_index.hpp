@@ -0,0 +1,94 @@
+#pragma once
+
+#include "./id_hash.hpp"
+
+#include <solanaceae/contact/fwd.hpp>
+#include <solanaceae/toxcore/tox_key.hpp>
+
+#include <entt/container/dense_map.hpp>
+#include <entt/container/dense_set.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+// persistent ToxKey -> Contact4 lookup
+// kept current through the registry construct/update/destroy signals,
+// so resolving a peer list does not need to walk the whole registry
+// friends are keyed by their key, group peers by chat_id + peer_key
+class ToxKeyIndex {
+	public:
+		struct KeyHash {
+			size_t operator()(const ToxKey& a) const {
+				// keys are chosen by their owners, so not trusted to be well distributed
+				return static_cast<size_t>(seededIDHash(a.data.data(), a.data.size()));
+			}
+		};
+
+		struct GroupPeerKey {
+			ToxKey chat_id;
+			ToxKey peer_key;
+
+			bool operator==(const GroupPeerKey& other) const {
+				return chat_id == other.chat_id && peer_key == other.peer_key;
+			}
+		};
+		struct GroupPeerKeyHash {
+			size_t operator()(const GroupPeerKey& a) const {
+				return KeyHash{}(a.peer_key) ^ (KeyHash{}(a.chat_id) << 1);
+			}
+		};
+
+	private:
+		ContactRegistry4* _reg {nullptr};
+
+		entt::dense_map<ToxKey, Contact4, KeyHash> _friends;
+		entt::dense_map<GroupPeerKey, Contact4, GroupPeerKeyHash> _group_peers;
+		// chat_id -> the contacts _group_peers currently maps to
+		entt::dense_map<ToxKey, entt::dense_set<Contact4>, KeyHash> _groups;
+
+		// reverse lookup, so updates and destroys can drop the old key
+		entt::dense_map<Contact4, ToxKey> _friends_rev;
+		entt::dense_map<Contact4, GroupPeerKey> _group_peers_rev;
+
+		uint64_t _generation {0u};
+
+		std::function<void(Contact4)> _on_destroy;
+
+	public:
+		ToxKeyIndex(void) = default;
+		ToxKeyIndex(const ToxKeyIndex&) = delete;
+		~ToxKeyIndex(void);
+
+		// connects to the registry signals and indexes all existing contacts
+		// rebinding to another registry drops the old index
+		void bind(ContactRegistry4& reg);
+		void unbind(void);
+		bool boundTo(const ContactRegistry4& reg) const { return _reg == &reg; }
+		ContactRegistry4* registry(void) const { return _reg; }
+
+		// bumped whenever a key gets (re)indexed, so callers can tell if retrying a lookup is worth it
+		uint64_t generation(void) const { return _generation; }
+
+		// called when an indexed friend or group peer gets destroyed (or loses its key),
+		// so per contact state elsewhere can be dropped along with it
+		void setOnDestroy(std::function<void(Contact4)>&& fn) { _on_destroy = std::move(fn); }
+
+		// returns an invalid handle if not known
+		ContactHandle4 findFriend(const ToxKey& key) const;
+		ContactHandle4 findGroupPeer(const ToxKey& chat_id, const ToxKey& peer_key) const;
+
+		// all known peers of a group, including self
+		std::vector<ContactHandle4> getGroupPeers(const ToxKey& chat_id) const;
+
+	private:
+		void dropFriend(Contact4 c);
+		void dropGroupPeer(Contact4 c);
+
+		void onFriendSet(ContactRegistry4& reg, Contact4 c);
+		void onFriendDestroy(ContactRegistry4& reg, Contact4 c);
+		void onGroupPeerSet(ContactRegistry4& reg, Contact4 c);
+		void onGroupPeerDestroy(ContactRegistry4& reg, Contact4 c);
+};
+
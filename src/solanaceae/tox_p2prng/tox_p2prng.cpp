@@ -1,4 +1,6 @@
 #include "./tox_p2prng.hpp"
+#include "./log.hpp"
+#include "./pkg_codec.hpp"
 
 #include <solanaceae/contact/components.hpp>
 #include <solanaceae/tox_contacts/components.hpp>
@@ -10,7 +12,13 @@
 
 #include <sodium.h>
 
-#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
 #include <vector>
 #include <utility>
 
@@ -37,99 +45,547 @@
 //
 // secret_request
 //   - id
+//
+// init_with_hmac_bundle
+//   - bundle id (generation ids are derived as H(bundle id, index))
+//   - peerlist
+//   - count
+//   - per generation: sender hmac, is size, is
+//
+// hmac_bundle
+//   - bundle id
+//   - count
+//   - per generation: hmac
+//
+// secret_bundle
+//   - bundle id
+//   - count
+//   - per generation: secret (msg+k)
+//
+// init_with_hmac_pipelined
+//   - same as init_with_hmac
+//
+// secret_with_next_hmac
+//   - id
+//   - secret (msg+k)
+//   - hmac for the next round
+//
+// init_chained
+//   - id
+//   - prev id (peerlist and hmacs are taken from there)
+//   - sender secret (msg+k)
+//   - sender hmac for the next round
+//   - is
+//
+// init_with_hmac_digest
+//   - id
+//   - flags (bit 0: pipelined)
+//   - blob size (u32, the blob is peerlist+is, same encoding as in init_with_hmac)
+//   - blob digest (blake2b)
+//   - sender hmac
+//
+// init_fragment
+//   - id
+//   - offset into the blob (u32, multiple of the fragment size)
+//   - blob bytes
+//
+// init_with_hmac_compact (group only)
+//   - id
+//   - flags (bit 0: pipelined)
+//   - peer count (u16)
+//   - prefix length
+//   - peer key prefixes (in peerlist order)
+//   - hash over the full peer keys (in peerlist order)
+//   - sender hmac
+//   - is
 
 #define TOX_PKG_ID_FRIEND 0xB1
 #define TOX_PKG_ID_GROUP 0xa6
 
-ContactHandle4 ToxP2PRNG::RngState::getSelf(void) const {
-	for (auto c : contacts) {
-		if (c.all_of<Contact::Components::TagSelfStrong>()) {
-			return c;
-		}
+// retransmission backoff, in seconds
+static constexpr float g_retry_interval_min {2.f};
+static constexpr float g_retry_interval_max {32.f};
+
+// digest inits, fragment size leaves room for header, id and offset
+static constexpr size_t g_max_pkg_size {1372u};
+static constexpr size_t g_init_fragment_size {1280u};
+static constexpr size_t g_init_blob_max {32u*1024u}; // needs to fit into the send queue
+static constexpr size_t g_pending_inits_max {64u};
+static constexpr size_t g_pending_inits_per_peer_max {4u};
+
+// below this, spreading early secret verification over the workers costs more than it saves
+static constexpr size_t g_parallel_verify_min {16u};
+// beyond this many outstanding worker jobs, secrets get verified right away on the tox thread
+static constexpr size_t g_verify_in_flight_max {1024u};
+// nothing wakes the tox thread when a worker job finishes, so iterate() polls, backing off up to max
+static constexpr double g_crypto_poll_min {0.01};
+static constexpr double g_crypto_poll_max {0.2};
+
+// compact peer lists, in bytes of key prefix
+static constexpr uint8_t g_compact_prefix_min {4u};
+static constexpr uint8_t g_compact_prefix_max {8u};
+
+// session store log gets rewritten from the live generations beyond this (or twice its last size)
+static constexpr uint64_t g_store_compact_min {8u*1024u*1024u};
+
+// session record flags
+static constexpr uint8_t g_store_flag_self_initiated {1u<<0};
+static constexpr uint8_t g_store_flag_pipelined {1u<<1};
+static constexpr uint8_t g_store_flag_digest {1u<<2};
+static constexpr uint8_t g_store_flag_compact_init {1u<<3};
+static constexpr uint8_t g_store_flag_chained {1u<<4};
+
+// the first byte depends on the recipient (friend or group) and gets patched in per send,
+// everything after is the same for every recipient
+// the buffer is sized exactly to body_size, so it never grows (pooled),
+// fill the body with bodyWriter()
+static PkgPool::Buffer prepSendPkgWithID(PkgPool& pool, ToxP2PRNG::PKG pkg_type, ByteSpan id, size_t body_size = 0u) {
+	const size_t pkg_size = PkgCodec::header_size+id.size+body_size;
+	auto pkg = pool.acquire(pkg_size);
+	pkg->resize(pkg_size);
+
+	(*pkg)[0] = 0u; // patched
+	(*pkg)[1] = static_cast<uint8_t>(pkg_type);
+
+	// pack packet
+	//   - id
+	std::memcpy(pkg->data()+PkgCodec::header_size, id.ptr, id.size);
+
+	return pkg;
+}
+
+static PkgCodec::Writer bodyWriter(std::vector<uint8_t>& pkg) {
+	return PkgCodec::Writer{pkg, PkgCodec::header_size+PkgCodec::id_size};
+}
+
+static bool patchPkgHeader(ContactHandle4 c, std::vector<uint8_t>& pkg) {
+	if (pkg.empty()) {
+		return false;
+	}
+
+	// determine friend or group (meh)
+	if (c.all_of<Contact::Components::ToxFriendEphemeral>()) {
+		pkg[0] = TOX_PKG_ID_FRIEND;
+	} else if (c.any_of<Contact::Components::ToxGroupPeerEphemeral, Contact::Components::ToxGroupEphemeral>()) {
+		pkg[0] = TOX_PKG_ID_GROUP;
+	} else {
+		return false;
 	}
 
-	return {};
+	return true;
 }
 
-void ToxP2PRNG::RngState::fillInitalStatePreamble(const ByteSpan id) {
-	// id
-	// res = id
-	initial_state_preamble = static_cast<std::vector<uint8_t>>(id);
+static_assert(sizeof(ToxKey::data) == PkgCodec::key_size);
 
-	for (const auto c : contacts) {
-		if (!c.any_of<Contact::Components::ToxFriendPersistent, Contact::Components::ToxGroupPeerPersistent>()) {
-			initial_state_preamble.clear();
-			return;
-		}
+static bool writePeerList(PkgCodec::Writer& w, const std::vector<ContactHandle4>& peers) {
+	// first numer of peers
+	w.u16(peers.size());
 
-		if (const auto* tfp = c.try_get<Contact::Components::ToxFriendPersistent>(); tfp != nullptr) {
-			initial_state_preamble.insert(initial_state_preamble.cend(), tfp->key.data.cbegin(), tfp->key.data.cend());
+	// second the peers
+	for (const auto peer : peers) {
+		if (const auto* tfp = peer.try_get<Contact::Components::ToxFriendPersistent>(); tfp != nullptr) {
+			w.bytes(tfp->key.data);
 			continue;
 		}
 
-		if (const auto* tgpp = c.try_get<Contact::Components::ToxGroupPeerPersistent>(); tgpp != nullptr) {
-			initial_state_preamble.insert(initial_state_preamble.cend(), tgpp->peer_key.data.cbegin(), tgpp->peer_key.data.cend());
+		if (const auto* tgpp = peer.try_get<Contact::Components::ToxGroupPeerPersistent>(); tgpp != nullptr) {
+			w.bytes(tgpp->peer_key.data);
 			continue;
 		}
+
+		// peer without key
+		return false;
+	}
+
+	return true;
+}
+
+static bool readPeerList(PkgCodec::Reader& r, std::vector<ToxKey>& peers) {
+	PkgCodec::PeerList peer_list;
+	if (!r.peerList(peer_list)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing peers\n");
+		return false;
+	}
+
+	// copied, keys outlive the packet
+	peers.resize(peer_list.count);
+	for (size_t i = 0; i < peers.size(); i++) {
+		std::memcpy(peers[i].data.data(), peer_list.key(i), PkgCodec::key_size);
+	}
+
+	return true;
+}
+
+static uint64_t keyPrefix(const ToxKey& key, const uint8_t prefix_len) {
+	uint64_t prefix {0u};
+	std::memcpy(&prefix, key.data.data(), prefix_len);
+	return prefix;
+}
+
+// prefixes alone can be ground to collide, this pins the exact list
+static void peerKeysHash(const std::vector<ContactHandle4>& peers, uint8_t (&out)[PkgCodec::keys_hash_size]) {
+	crypto_generichash_state state;
+	crypto_generichash_init(&state, nullptr, 0, sizeof(out));
+	for (const auto peer : peers) {
+		const auto& key = peer.get<Contact::Components::ToxGroupPeerPersistent>().peer_key;
+		crypto_generichash_update(&state, key.data.data(), key.data.size());
+	}
+	crypto_generichash_final(&state, out, sizeof(out));
+}
+
+static bool readCompactPeerList(PkgCodec::Reader& r, uint8_t& prefix_len, std::vector<uint64_t>& prefixes, ByteSpan& keys_hash) {
+	PkgCodec::CompactPeerList peer_list;
+	if (!r.compactPeerList(peer_list)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing peers\n");
+		return false;
+	}
+
+	prefix_len = peer_list.prefix_len;
+	if (prefix_len < g_compact_prefix_min || prefix_len > g_compact_prefix_max) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: invalid prefix length\n");
+		return false;
+	}
+
+	prefixes.resize(peer_list.count);
+	for (size_t i = 0; i < prefixes.size(); i++) {
+		prefixes[i] = peer_list.prefix(i);
+	}
+	keys_hash = peer_list.keys_hash;
+
+	return true;
+}
+
+// peerlist+is, for digest inits
+static bool buildInitBlob(std::vector<uint8_t>& blob, const std::vector<ContactHandle4>& peers, const ByteSpan initial_state) {
+	blob.resize(PkgCodec::peerListSize(peers.size()) + initial_state.size);
+	PkgCodec::Writer w{blob, 0u};
+
+	if (!writePeerList(w, peers)) {
+		return false;
+	}
+
+	w.bytes(initial_state);
+
+	return w.full();
+}
+
+// what can come in as a public group packet, the rest is only ever sent privately
+static bool isGroupBroadcastPkg(const ToxP2PRNG::PKG pkg_type) {
+	using PKG = ToxP2PRNG::PKG;
+	switch (pkg_type) {
+		case PKG::INIT_WITH_HMAC:
+		case PKG::INIT_WITH_HMAC_PIPELINED:
+		case PKG::INIT_WITH_HMAC_COMPACT:
+		case PKG::INIT_WITH_HMAC_DIGEST:
+		case PKG::INIT_FRAGMENT:
+		case PKG::INIT_WITH_HMAC_BUNDLE:
+		case PKG::HMAC:
+		case PKG::HMAC_BUNDLE:
+		// only if the whole group is participating
+		case PKG::SECRET:
+		case PKG::SECRET_WITH_NEXT_HMAC:
+		case PKG::SECRET_BUNDLE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// generation ids of a bundle are not sent, but derived from the bundle id
+static ToxP2PRNG::ID bundleGenID(const ByteSpan bundle_id, const uint16_t index) {
+	ToxP2PRNG::ID id{};
+
+	const uint8_t index_bytes[sizeof(index)] {
+		static_cast<uint8_t>(index & 0xff),
+		static_cast<uint8_t>((index >> 8) & 0xff),
+	};
+
+	crypto_generichash_state state;
+	crypto_generichash_init(&state, nullptr, 0, id.size());
+	crypto_generichash_update(&state, bundle_id.ptr, bundle_id.size);
+	crypto_generichash_update(&state, index_bytes, sizeof(index_bytes));
+	crypto_generichash_final(&state, id.data(), id.size());
+
+	return id;
+}
+
+static PkgPool::Buffer buildInitWithHMACPkg(
+	PkgPool& pool,
+	const ByteSpan id,
+	const std::vector<ContactHandle4>& peers,
+	const ByteSpan initial_state,
+	const ByteSpan hmac,
+	const bool pipelined = false
+) {
+	auto pkg_buf = prepSendPkgWithID(
+		pool,
+		pipelined ? ToxP2PRNG::PKG::INIT_WITH_HMAC_PIPELINED : ToxP2PRNG::PKG::INIT_WITH_HMAC,
+		id,
+		PkgCodec::peerListSize(peers.size()) + hmac.size + initial_state.size
+	);
+	auto w = bodyWriter(*pkg_buf);
+
+	//   - peerlist (includes sender, determines fusion order)
+	if (!writePeerList(w, peers)) {
+		return {};
+	}
+
+	//   - sender hmac
+	w.bytes(hmac);
+
+	//   - is
+	w.bytes(initial_state);
+
+	if (!w.full()) {
+		return {};
+	}
+
+	return pkg_buf;
+}
+
+static PkgPool::Buffer buildInitWithHMACCompactPkg(
+	PkgPool& pool,
+	const ByteSpan id,
+	const ByteSpan compact_peer_list,
+	const ByteSpan initial_state,
+	const ByteSpan hmac,
+	const bool pipelined
+) {
+	auto pkg_buf = prepSendPkgWithID(
+		pool,
+		ToxP2PRNG::PKG::INIT_WITH_HMAC_COMPACT,
+		id,
+		PkgCodec::flags_size + compact_peer_list.size + hmac.size + initial_state.size
+	);
+	auto w = bodyWriter(*pkg_buf);
+
+	//   - flags
+	w.u8(pipelined ? 0x01 : 0x00);
+
+	//   - peer count, prefix length, prefixes
+	w.bytes(compact_peer_list);
+
+	//   - sender hmac
+	w.bytes(hmac);
+
+	//   - is
+	w.bytes(initial_state);
+
+	if (!w.full()) {
+		return {};
+	}
+
+	return pkg_buf;
+}
+
+// session record:
+//   - flags (see g_store_flag_*)
+//   - [is digest]
+//   - [prev id, if chained]
+//   - contact count (u16)
+//   - per contact: kind (0 friend, 1 group peer), key or chat id + peer key
+//   - own secret (msg+k)
+//   - hmac count (u16)
+//   - per hmac: contact index (u16), hmac
+//   - is (app given)
+//
+// hmac record:
+//   - round (0 this, 1 next)
+//   - contact index (u16)
+//   - hmac
+//
+// secret record:
+//   - contact index (u16)
+//   - secret (msg+k)
+//
+// next record:
+//   - own next secret (msg+k)
+//   - own next hmac
+//
+// chained record:
+//   - id of the generation that used the next round commitments
+
+static SessionStore::ID toStoreID(const ByteSpan id) {
+	SessionStore::ID store_id{};
+	std::memcpy(store_id.data(), id.ptr, std::min<size_t>(id.size, store_id.size()));
+	return store_id;
+}
+
+static std::array<uint8_t, 1u+sizeof(uint16_t)+PkgCodec::hmac_size> hmacRecordBody(const bool next_round, const size_t c_idx, const uint8_t* hmac) {
+	std::array<uint8_t, 1u+sizeof(uint16_t)+PkgCodec::hmac_size> body;
+	body[0] = next_round ? 1u : 0u;
+	body[1] = c_idx & 0xff;
+	body[2] = (c_idx >> 8) & 0xff;
+	std::memcpy(body.data()+3, hmac, PkgCodec::hmac_size);
+	return body;
+}
+
+static std::array<uint8_t, sizeof(uint16_t)+PkgCodec::secret_size> secretRecordBody(const size_t c_idx, const uint8_t* secret) {
+	std::array<uint8_t, sizeof(uint16_t)+PkgCodec::secret_size> body;
+	body[0] = c_idx & 0xff;
+	body[1] = (c_idx >> 8) & 0xff;
+	std::memcpy(body.data()+2, secret, PkgCodec::secret_size);
+	return body;
+}
+
+static std::array<uint8_t, PkgCodec::secret_size+PkgCodec::hmac_size> nextRecordBody(const uint8_t* next_secret, const uint8_t* next_hmac) {
+	std::array<uint8_t, PkgCodec::secret_size+PkgCodec::hmac_size> body;
+	std::memcpy(body.data(), next_secret, PkgCodec::secret_size);
+	std::memcpy(body.data()+PkgCodec::secret_size, next_hmac, PkgCodec::hmac_size);
+	return body;
+}
+
+bool ToxP2PRNG::RngState::setContacts(std::vector<ContactHandle4>&& new_contacts) {
+	if (new_contacts.empty() || new_contacts.size() > std::numeric_limits<uint16_t>::max()) {
+		return false;
+	}
+
+	contacts = std::move(new_contacts);
+
+	bool have_self {false};
+	contact_index.clear();
+	contact_index.reserve(contacts.size());
+	for (size_t i = 0; i < contacts.size(); i++) {
+		if (!contact_index.emplace(contacts[i].entity(), static_cast<uint16_t>(i)).second) {
+			return false; // dup
+		}
+
+		if (contacts[i].all_of<Contact::Components::TagSelfStrong>()) {
+			self_idx = static_cast<uint16_t>(i);
+			have_self = true;
+		}
 	}
+
+	hmacs.resize(contacts.size());
+	secrets.resize(contacts.size());
+	secrets_verifying.assign(contacts.size(), false);
+	next_hmacs.resize(contacts.size());
+
+	return have_self;
+}
+
+bool ToxP2PRNG::RngState::indexOf(Contact4 c, size_t& idx) const {
+	const auto it = contact_index.find(c);
+	if (it == contact_index.cend()) {
+		return false;
+	}
+
+	idx = it->second;
+	return true;
+}
+
+bool ToxP2PRNG::RngState::fillInitialState(const ByteSpan id, const ByteSpan initial_state, const std::vector<ToxKey>* peer_keys) {
+	if (peer_keys != nullptr && peer_keys->size() != contacts.size()) {
+		return false;
+	}
+
+	const size_t preamble_size = id.size + (is_digest.has_value() ? is_digest->size() : contacts.size()*ToxKey{}.size());
+
+	is_buffer.clear();
+	is_buffer.reserve(preamble_size + initial_state.size);
+
+	// id
+	// res = id
+	is_buffer.insert(is_buffer.cend(), id.cbegin(), id.cend());
+
+	if (is_digest.has_value()) {
+		// peer keys are covered by the digest
+		is_buffer.insert(is_buffer.cend(), is_digest->cbegin(), is_digest->cend());
+	} else if (peer_keys != nullptr) {
+		for (const auto& key : *peer_keys) {
+			is_buffer.insert(is_buffer.cend(), key.data.cbegin(), key.data.cend());
+		}
+	} else {
+		for (const auto c : contacts) {
+			if (const auto* tfp = c.try_get<Contact::Components::ToxFriendPersistent>(); tfp != nullptr) {
+				is_buffer.insert(is_buffer.cend(), tfp->key.data.cbegin(), tfp->key.data.cend());
+			} else if (const auto* tgpp = c.try_get<Contact::Components::ToxGroupPeerPersistent>(); tgpp != nullptr) {
+				is_buffer.insert(is_buffer.cend(), tgpp->peer_key.data.cbegin(), tgpp->peer_key.data.cend());
+			} else {
+				is_buffer.clear();
+				is_offset = 0u;
+				return false;
+			}
+		}
+	}
+
+	is_offset = is_buffer.size();
+	assert(is_offset == preamble_size);
+
+	is_buffer.insert(is_buffer.cend(), initial_state.cbegin(), initial_state.cend());
+
+	return true;
 }
 
+void ToxP2PRNG::RngState::advanceCombine(void) {
+	// secrets are only verified once all hmacs are in
+	if (combine_error || !hmacs.complete()) {
+		return;
+	}
+
+	while (combine_next < contacts.size() && secrets.has(combine_next)) {
+		const auto& s = secrets.at(combine_next);
+
+		int ret {0};
+		if (combine_next == 0) {
+			ret = p2prng_combine_init(combine_state.data(), s.data(), s.size());
+		} else {
+			ret = p2prng_combine_update(combine_state.data(), combine_state.data(), s.data(), s.size());
+		}
+
+		if (ret != 0) {
+			combine_error = true;
+			return;
+		}
+
+		combine_next++;
+	}
+}
 
 void ToxP2PRNG::RngState::genFinalResult(void) {
 	if (contacts.size() < 2) {
 		return;
 	}
 
-	if (hmacs.size() < contacts.size()) {
+	if (!hmacs.complete()) {
 		return;
 	}
 
-	if (secrets.size() < contacts.size()) {
+	if (!secrets.complete()) {
 		return;
 	}
 
 	// val
 
-	if (initial_state.empty()) {
+	if (getInitialState().empty()) {
 		return;
 	}
 
-	if (initial_state_preamble.empty()) {
+	// usually only the last secret is left
+	advanceCombine();
+	if (combine_error || combine_next != contacts.size()) {
 		return;
 	}
 
 	final_result.resize(P2PRNG_COMBINE_LEN);
 
-	{ // fist secret
-		const auto& fs = secrets.at(contacts.front());
-		if (p2prng_combine_init(final_result.data(), fs.data(), fs.size()) != 0) {
-			final_result.clear();
-			return;
-		}
-	}
-
-	for (size_t i = 1; i < contacts.size(); i++) {
-		const auto& s = secrets.at(contacts.at(i));
-		if (p2prng_combine_update(final_result.data(), final_result.data(), s.data(), s.size()) != 0) {
-			final_result.clear();
-			return;
-		}
-	}
-
 	// finally, add in is
-	// hmmm copy, meh, we could do preamble and app is in seperate updates, which changes the algo, but should be fine
 	{
-		std::vector<uint8_t> full_is = initial_state_preamble;
-		full_is.insert(full_is.cend(), initial_state.cbegin(), initial_state.cend());
+		const auto full_is = getFullInitialState();
 
-		if (p2prng_combine_update(final_result.data(), final_result.data(), full_is.data(), full_is.size()) != 0) {
+		if (p2prng_combine_update(final_result.data(), combine_state.data(), full_is.ptr, full_is.size) != 0) {
 			final_result.clear();
 			return;
 		}
 	}
 	// we done
+	// (not logged, its the rng output)
+}
 
-	std::cout << "TP2PRNG: final rng: " << bin2hex(final_result) << "\n";
+void ToxP2PRNG::RngState::touch(double time) {
+	last_activity = time;
+	retry_interval = g_retry_interval_min;
+	retry_next = time + retry_interval;
 }
 
 P2PRNG::State ToxP2PRNG::RngState::getState(void) const {
@@ -139,115 +595,306 @@ P2PRNG::State ToxP2PRNG::RngState::getState(void) const {
 	}
 
 	//SECRET, // got a secret (phase start will be denoted by own, secrets received before we have all hmacs get queued up)
-	if (hmacs.size() == contacts.size()) {
+	if (hmacs.complete()) {
 		return P2PRNG::SECRET;
 	}
 
 	//HMAC, // got a hmac (phase start will be denoted by the initiators hmac)
-	if (!hmacs.empty()) {
+	if (hmacs.count != 0) {
 		return P2PRNG::HMAC;
 	}
 
 	//INIT, // initial params (incoming or outgoing?)
-	if (!initial_state.empty() && !initial_state_preamble.empty()) {
+	if (!getInitialState().empty()) {
 		return P2PRNG::INIT;
 	}
 
 	return P2PRNG::UNKNOWN;
 }
 
-void ToxP2PRNG::checkHaveAllHMACs(RngState* rng_state, const ByteSpan id) {
-	if (rng_state == nullptr) {
-		return;
-	}
-
-	if (rng_state->hmacs.size() != rng_state->contacts.size()) {
-		// dont have all hmacs yet
-		return;
+ContactHandle4 ToxP2PRNG::findBroadcastGroup(const std::vector<ContactHandle4>& contacts) {
+	if (!_group_broadcast) {
+		return {};
 	}
-	// have all hmacs !
 
-	// now we send out our secret and collect secrets
-	// we should also validate any secret that already is in storage
+	std::optional<uint32_t> group_number;
+	size_t other_count {0u};
+	for (const auto c : contacts) {
+		if (c.all_of<Contact::Components::TagSelfStrong>()) {
+			continue;
+		}
 
-	// validate existing (self should be good)
-	std::vector<Contact4> bad_secrets;
-	for (const auto& [pre_c, secret] : rng_state->secrets) {
-		const auto& pre_hmac = rng_state->hmacs.at(pre_c);
-		if (p2prng_auth_verify(secret.data()+P2PRNG_LEN, pre_hmac.data(), secret.data(), P2PRNG_LEN) != 0) {
-			// bad secret
-			std::cerr
-				<< "########################################\n"
-				<< "TP2PRNG error: bad secret, validation failed!\n"
-				<< "########################################\n"
-			;
-			bad_secrets.push_back(pre_c);
+		const auto* tgpe = c.try_get<Contact::Components::ToxGroupPeerEphemeral>();
+		if (tgpe == nullptr) {
+			return {};
+		}
 
-			dispatch(
-				P2PRNG_Event::val_error,
-				P2PRNG::Events::ValError{
-					id,
-					pre_c,
-				}
-			);
+		if (!group_number.has_value()) {
+			group_number = tgpe->group_number;
+		} else if (group_number.value() != tgpe->group_number) {
+			return {};
 		}
-	}
-	for (const auto bad_c : bad_secrets) {
-		rng_state->secrets.erase(bad_c);
+
+		other_count++;
 	}
 
-	// find self contact
-	ContactHandle4 self = rng_state->getSelf();
-	if (!static_cast<bool>(self)) {
-		std::cerr << "TP2PRNG error: failed to look up self\n";
-		return;
+	if (other_count < 2) {
+		return {}; // no gain
 	}
 
-	auto self_secret_it = rng_state->secrets.find(self);
-	if (self_secret_it == rng_state->secrets.cend()) {
-		// hmmmmmmmmmm this bad
-		std::cerr << "hmmmmmmmmmm this bad\n";
-		return;
+	return getContactGroup(group_number.value());
+}
+
+bool ToxP2PRNG::isWholeGroup(ContactHandle4 group, const RngState& rng_state) const {
+	const auto* parent_of = group.try_get<Contact::Components::ParentOf>();
+	if (parent_of == nullptr) {
+		return false;
 	}
 
-	// fire update event
-	dispatch(
-		P2PRNG_Event::secret,
-		P2PRNG::Events::Secret{
-			id,
-			static_cast<uint16_t>(rng_state->secrets.size()),
-			static_cast<uint16_t>(rng_state->contacts.size()),
+	// members that left are still listed, so this errs on the private side
+	for (const auto sub : parent_of->subs) {
+		size_t idx {0u};
+		if (!rng_state.indexOf(sub, idx) && !group.registry()->all_of<Contact::Components::TagSelfStrong>(sub)) {
+			return false;
 		}
-	);
+	}
+
+	return true;
+}
+
+void ToxP2PRNG::setBroadcast(RngState& rng_state) {
+	rng_state.broadcast_group = findBroadcastGroup(rng_state.contacts);
+	rng_state.broadcast_init = static_cast<bool>(rng_state.broadcast_group) && isWholeGroup(rng_state.broadcast_group, rng_state);
+}
 
-	// TODO: queue these instead
-	for (const auto peer : rng_state->contacts) {
+void ToxP2PRNG::sendToParticipants(const RngState& rng_state, std::vector<uint8_t>& pkg) {
+	for (const auto peer : rng_state.contacts) {
 		if (peer.all_of<Contact::Components::TagSelfStrong>()) {
 			continue; // skip self
 		}
-		// TODO: record send success
-		send_secret(peer, id, ByteSpan{self_secret_it->second});
+		send_pkg(peer, pkg);
 	}
 }
 
-void ToxP2PRNG::checkHaveAllSecrets(RngState* rng_state, const ByteSpan id) {
+void ToxP2PRNG::checkHaveAllHMACs(RngState* rng_state, const ByteSpan id) {
 	if (rng_state == nullptr) {
 		return;
 	}
 
-	if (rng_state->secrets.size() != rng_state->contacts.size()) {
-		// dont have all secrets yet
+	if (!rng_state->hmacs.complete()) {
+		// dont have all hmacs yet
 		return;
 	}
-	// have also all secrets o.O
+	// have all hmacs !
+
+	// later calls only see secrets that were verified and stored already
+	const bool first_complete = !rng_state->time_all_hmacs.has_value();
+	if (first_complete) {
+		rng_state->time_all_hmacs = _time;
+		_metrics.init_to_all_hmacs.record(_time - rng_state->time_start);
+	}
+
+	// now we send out our secret and collect secrets
+	// we should also validate any secret that already is in storage
+
+	// validate existing (self should be good)
+	std::vector<uint16_t> early;
+	early.reserve(rng_state->secrets.count);
+	for (size_t i = 0; i < rng_state->contacts.size(); i++) {
+		if (rng_state->secrets.has(i)) {
+			early.push_back(static_cast<uint16_t>(i));
+		}
+	}
+
+	// only reads, results are applied below in contact order, same as inline
+	std::vector<uint8_t> bad(early.size(), 0u);
+	const auto verify = [rng_state, &early, &bad](size_t begin, size_t end) {
+		for (size_t k = begin; k < end; k++) {
+			const auto& secret = rng_state->secrets.at(early[k]);
+			const auto& pre_hmac = rng_state->hmacs.at(early[k]);
+			bad[k] = p2prng_auth_verify(secret.data()+P2PRNG_LEN, pre_hmac.data(), secret.data(), P2PRNG_LEN) != 0;
+		}
+	};
+	if (_crypto_workers && early.size() >= g_parallel_verify_min) {
+		_crypto_workers->parallelFor(early.size(), verify);
+	} else {
+		verify(0, early.size());
+	}
+
+	for (size_t k = 0; k < early.size(); k++) {
+		const size_t i = early[k];
+		if (bad[k]) {
+			assert(i >= rng_state->combine_next); // not folded in yet
+			rng_state->secrets.erase(i);
+			rng_state->next_hmacs.erase(i); // came with the secret
+
+			reportBadSecret(id, rng_state->contacts.at(i));
+		} else if (first_complete && i != rng_state->self_idx) {
+			storeSecret(id, i, rng_state->secrets.at(i).data());
+		}
+	}
+
+	// everything verified so far
+	rng_state->advanceCombine();
+
+	if (!rng_state->secrets.has(rng_state->self_idx)) {
+		// hmmmmmmmmmm this bad
+		TP2PRNG_LOG(error, session, "hmmmmmmmmmm this bad\n");
+		return;
+	}
+
+	// fire update event
+	dispatch(
+		P2PRNG_Event::secret,
+		P2PRNG::Events::Secret{
+			id,
+			rng_state->secrets.count,
+			static_cast<uint16_t>(rng_state->contacts.size()),
+		}
+	);
+
+	if (rng_state->bundle_id.has_value()) {
+		// sent together with the rest of the bundle
+		checkBundleHaveAllHMACs(rng_state->bundle_id.value(), rng_state->bundle_size);
+		return;
+	}
+
+	sendOwnSecret(*rng_state, id);
+}
+
+bool ToxP2PRNG::ensureNextCommitment(RngState& rng_state, const ByteSpan id) {
+	if (rng_state.have_next_secret) {
+		return true;
+	}
+
+	// the is only gets mixed in when combining, any input is fine for the commitment
+	const auto full_is = rng_state.getFullInitialState();
+	std::array<uint8_t, P2PRNG_MAC_LEN> next_hmac;
+	if (p2prng_gen_and_auth(rng_state.next_secret.data(), rng_state.next_secret.data()+P2PRNG_LEN, next_hmac.data(), full_is.ptr, full_is.size) != 0) {
+		TP2PRNG_LOG(error, crypto, "TP2PRNG error: failed to generate and hmac next secret\n");
+		return false;
+	}
+
+	rng_state.next_hmacs.set(rng_state.self_idx, next_hmac);
+	rng_state.have_next_secret = true;
+
+	if (_store) {
+		// durable, same as our secret the commitment may not leave before it
+		const auto body = nextRecordBody(rng_state.next_secret.data(), next_hmac.data());
+		_store->append(SessionStore::RecordType::NEXT, toStoreID(id), ByteSpan{body}, true);
+	}
+
+	return true;
+}
+
+void ToxP2PRNG::sendOwnSecret(RngState& rng_state, const ByteSpan id) {
+	if (rng_state.secret_sent) {
+		return;
+	}
+
+	if (!rng_state.secrets.has(rng_state.self_idx)) {
+		return;
+	}
+	const auto& self_secret = rng_state.secrets.at(rng_state.self_idx);
+
+	if (rng_state.pipelined && !ensureNextCommitment(rng_state, id)) {
+		return;
+	}
+
+	const auto send_fn = [&](ContactHandle4 c) {
+		if (rng_state.pipelined) {
+			send_secret_with_next_hmac(c, id, ByteSpan{self_secret}, ByteSpan{rng_state.next_hmacs.at(rng_state.self_idx)});
+		} else {
+			send_secret(c, id, ByteSpan{self_secret});
+		}
+	};
+
+	// any group member could compute the result from it,
+	// so only as a group packet if everyone in the group is (still) participating
+	if (rng_state.broadcast_init && isWholeGroup(rng_state.broadcast_group, rng_state)) {
+		send_fn(rng_state.broadcast_group);
+	} else {
+		for (const auto peer : rng_state.contacts) {
+			if (peer.all_of<Contact::Components::TagSelfStrong>()) {
+				continue; // skip self
+			}
+			send_fn(peer);
+		}
+	}
+	rng_state.secret_sent = true;
+}
+
+void ToxP2PRNG::checkBundleHaveAllHMACs(const ID& bundle_id, const uint16_t bundle_size) {
+	std::vector<RngState*> bundle_states;
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		auto it = _global_map.find(bundleGenID(ByteSpan{bundle_id}, i));
+		if (it == _global_map.end()) {
+			// partially evicted, peers can still request secrets one by one
+			return;
+		}
+
+		auto& rng_state = it->second;
+		if (rng_state.secret_sent || !rng_state.hmacs.complete()) {
+			return;
+		}
+
+		bundle_states.push_back(&rng_state);
+	}
+
+	if (bundle_states.empty()) {
+		return;
+	}
+
+	auto pkg_buf = prepSendPkgWithID(_pkg_pool, PKG::SECRET_BUNDLE, ByteSpan{bundle_id}, sizeof(uint16_t) + bundle_states.size() * PkgCodec::secret_size);
+	auto& pkg = *pkg_buf;
+	auto w = bodyWriter(pkg);
+	w.u16(bundle_states.size());
+	for (auto* rng_state : bundle_states) {
+		w.bytes(rng_state->secrets.at(rng_state->self_idx));
+		rng_state->secret_sent = true;
+	}
+
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending SECRET_BUNDLE s:" << pkg.size() << "\n");
+
+	// same peers for every generation in the bundle
+	const auto& first = *bundle_states.front();
+	if (first.broadcast_init && isWholeGroup(first.broadcast_group, first)) {
+		send_pkg(first.broadcast_group, pkg);
+	} else {
+		sendToParticipants(first, pkg);
+	}
+}
+
+void ToxP2PRNG::checkHaveAllSecrets(RngState* rng_state, const ByteSpan id) {
+	if (rng_state == nullptr) {
+		return;
+	}
+
+	if (!rng_state->secrets.complete()) {
+		// dont have all secrets yet
+		return;
+	}
+	// have also all secrets o.O
+
+	if (!rng_state->hmacs.complete()) {
+		// a lost hmac, the early secrets get combined once it arrived
+		return;
+	}
+
+	const bool was_done = !rng_state->final_result.empty();
 
 	rng_state->genFinalResult();
 
 	if (rng_state->final_result.empty()) {
-		std::cerr << "oh no, oh god\n";
+		TP2PRNG_LOG(error, session, "oh no, oh god\n");
 		return;
 	}
 
+	if (!was_done) {
+		// chained generations start with all hmacs
+		_metrics.all_hmacs_to_done.record(_time - rng_state->time_all_hmacs.value_or(rng_state->time_start));
+	}
+
 	// fire done event
 	dispatch(
 		P2PRNG_Event::done,
@@ -258,380 +905,2679 @@ void ToxP2PRNG::checkHaveAllSecrets(RngState* rng_state, const ByteSpan id) {
 	);
 }
 
+bool ToxP2PRNG::enforceSessionCap(const size_t count) {
+	if (_eviction_config.max_sessions == 0u) {
+		return true; // unlimited
+	}
+
+	if (count > _eviction_config.max_sessions) {
+		return false;
+	}
+
+	while (!_global_map.empty() && _global_map.size() + count > _eviction_config.max_sessions) {
+		if (_lru_heap.empty()) {
+			// cant happen, every session gets pushed on creation
+			for (const auto& [id, rng_state] : _global_map) {
+				lruPush(id, rng_state.last_activity);
+			}
+		}
+
+		// least recently active first
+		std::pop_heap(_lru_heap.begin(), _lru_heap.end(), std::greater<>{});
+		const auto [time_pushed, id] = _lru_heap.back();
+		_lru_heap.pop_back();
+
+		const auto it = _global_map.find(id);
+		if (it == _global_map.end()) {
+			continue; // already gone
+		}
+		if (it->second.last_activity > time_pushed) {
+			lruPush(id, it->second.last_activity); // active since, back in line
+			continue;
+		}
+
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: session cap reached, evicting least recently active\n");
+		storeEnd(id);
+		eraseSession(id);
+		addTombstone(id);
+		_eviction_stats.cap++;
+	}
+
+	return true;
+}
+
+void ToxP2PRNG::lruPush(const ID& id, const double last_activity) {
+	_lru_heap.emplace_back(last_activity, id);
+	std::push_heap(_lru_heap.begin(), _lru_heap.end(), std::greater<>{});
+}
+
+bool ToxP2PRNG::eraseSession(const ID& id) {
+	const auto it = _global_map.find(id);
+	if (it == _global_map.end()) {
+		return false;
+	}
+
+	if (it->second.remote_initiator != entt::null) {
+		if (const auto count_it = _remote_sessions.find(it->second.remote_initiator); count_it != _remote_sessions.end()) {
+			if (--count_it->second == 0u) {
+				_remote_sessions.erase(count_it);
+			}
+		}
+	}
+
+	_global_map.erase(it);
+	return true;
+}
+
+void ToxP2PRNG::addTombstone(const ID& id) {
+	_evicted[id] = _time;
+	_evicted_order.emplace_back(_time, id);
+
+	// oldest go first, the ttl would get them eventually anyway
+	while (_evicted.size() > _eviction_config.max_tombstones && !_evicted_order.empty()) {
+		const auto [time_evicted, old_id] = _evicted_order.front();
+		_evicted_order.pop_front();
+		if (const auto it = _evicted.find(old_id); it != _evicted.end() && it->second == time_evicted) {
+			_evicted.erase(it);
+		}
+	}
+}
+
+bool ToxP2PRNG::remoteQuotaAllows(Contact4 c, const size_t count) {
+	if (_eviction_config.max_remote_sessions_per_peer == 0u) {
+		return true; // unlimited
+	}
+
+	const auto it = _remote_sessions.find(c);
+	const size_t running = it == _remote_sessions.cend() ? 0u : it->second;
+	if (running + count > _eviction_config.max_remote_sessions_per_peer) {
+		_eviction_stats.remote_quota++;
+		return false;
+	}
+
+	return true;
+}
+
+void ToxP2PRNG::countRemoteSession(RngState& rng_state, Contact4 c) {
+	rng_state.remote_initiator = c;
+	_remote_sessions[c]++;
+}
+
+void ToxP2PRNG::evictSessions(void) {
+	std::vector<ID> to_evict;
+	std::vector<ID> to_abandon;
+	for (const auto& [id, rng_state] : _global_map) {
+		const double idle = _time - rng_state.last_activity;
+		if (rng_state.getState() == P2PRNG::DONE) {
+			if (idle >= _eviction_config.done_ttl) {
+				to_evict.push_back(id);
+				_eviction_stats.done_ttl++;
+			}
+		} else if (idle >= _eviction_config.stall_timeout) {
+			TP2PRNG_LOG(warn, session, "TP2PRNG warning: evicting stalled generation " << bin2hex(ByteSpan{id}) << "\n");
+			if (rng_state.self_initiated && rng_state.chained_from.has_value()) {
+				// started over without the chain
+				to_abandon.push_back(id);
+			} else {
+				to_evict.push_back(id);
+			}
+			_eviction_stats.stalled++;
+		}
+	}
+
+	for (const auto& id : to_evict) {
+		storeEnd(id);
+		eraseSession(id);
+		addTombstone(id);
+	}
+
+	for (const auto& id : to_abandon) {
+		abandonChained(id);
+	}
+
+	// fragments that never completed
+	std::vector<ID> stalled_inits;
+	for (const auto& [id, pending] : _pending_inits) {
+		if (_time - pending.time >= _eviction_config.stall_timeout) {
+			stalled_inits.push_back(id);
+		}
+	}
+	for (const auto& id : stalled_inits) {
+		_pending_inits.erase(id);
+	}
+
+	// forget old tombstones, they are in eviction order
+	while (!_evicted_order.empty() && _time - _evicted_order.front().first >= _eviction_config.tombstone_ttl) {
+		const auto [time_evicted, id] = _evicted_order.front();
+		_evicted_order.pop_front();
+		if (const auto it = _evicted.find(id); it != _evicted.end() && it->second == time_evicted) {
+			_evicted.erase(it);
+		}
+	}
+
+	// entries of sessions that are gone pile up, compact once they dominate
+	if (_lru_heap.size() > 2*_global_map.size() + 64u) {
+		_lru_heap.clear();
+		for (const auto& [id, rng_state] : _global_map) {
+			lruPush(id, rng_state.last_activity);
+		}
+	}
+}
+
+void ToxP2PRNG::retrySessions(void) {
+	for (auto& [id, rng_state] : _global_map) {
+		if (rng_state.retry_next > _time) {
+			continue;
+		}
+
+		if (rng_state.getState() == P2PRNG::DONE) {
+			continue;
+		}
+
+		retrySession(rng_state, ByteSpan{id});
+
+		rng_state.retry_interval = std::min(rng_state.retry_interval * 2.f, g_retry_interval_max);
+		rng_state.retry_next = _time + rng_state.retry_interval;
+	}
+}
+
+void ToxP2PRNG::retrySession(RngState& rng_state, const ByteSpan id) {
+	const auto current_state = rng_state.getState();
+
+	if (rng_state.self_initiated && rng_state.chained_from.has_value()) {
+		if (current_state == P2PRNG::DONE) {
+			return;
+		}
+
+		// the INIT_CHAINED carries our secret, so it also answers everything else
+		for (size_t i = 0; i < rng_state.contacts.size(); i++) {
+			if (rng_state.secrets.has(i)) {
+				continue;
+			}
+
+			send_init_chained(rng_state.contacts[i], id, rng_state);
+		}
+	} else if (current_state == P2PRNG::INIT || current_state == P2PRNG::HMAC) {
+		if (!rng_state.hmacs.has(rng_state.self_idx)) {
+			return;
+		}
+		const auto& self_hmac = rng_state.hmacs.at(rng_state.self_idx);
+
+		for (size_t i = 0; i < rng_state.contacts.size(); i++) {
+			if (rng_state.hmacs.has(i)) {
+				continue;
+			}
+			const auto peer = rng_state.contacts[i];
+
+			if (rng_state.self_initiated && rng_state.is_digest.has_value()) {
+				send_init_with_hmac_digest(peer, id, rng_state);
+			} else if (rng_state.self_initiated && rng_state.compact_init && !fitsFullInit(rng_state)) {
+				// the full list does not fit, so there is no fallback
+				auto compact_peer_list = _pkg_pool.acquire(PkgCodec::compactPeerListSize(rng_state.contacts.size(), g_compact_prefix_max));
+				if (appendCompactPeerList(*compact_peer_list, rng_state.contacts)) {
+					auto pkg = buildInitWithHMACCompactPkg(_pkg_pool, id, ByteSpan{*compact_peer_list}, rng_state.getInitialState(), ByteSpan{self_hmac}, rng_state.pipelined);
+					send_pkg(peer, *pkg);
+				}
+			} else if (rng_state.self_initiated) {
+				// the INIT might have been lost, repeating it doubles as a request
+				// this also is the fallback, if the compact peer list could not be resolved
+				send_init_with_hmac(peer, id, rng_state.contacts, rng_state.getInitialState(), ByteSpan{self_hmac}, rng_state.pipelined);
+			} else {
+				send_hmac_request(peer, id);
+			}
+		}
+	} else if (current_state == P2PRNG::SECRET) {
+		for (size_t i = 0; i < rng_state.contacts.size(); i++) {
+			if (rng_state.secrets.has(i)) {
+				continue;
+			}
+
+			send_secret_request(rng_state.contacts[i], id);
+		}
+	}
+}
+
+static size_t fullInitSize(const size_t peer_count, const size_t initial_state_size) {
+	return PkgCodec::header_size+PkgCodec::id_size+PkgCodec::peerListSize(peer_count)+PkgCodec::hmac_size+initial_state_size;
+}
+
+bool ToxP2PRNG::fitsFullInit(const RngState& rng_state) {
+	return fullInitSize(rng_state.contacts.size(), rng_state.getInitialState().size) <= g_max_pkg_size;
+}
+
+bool ToxP2PRNG::isEvicted(const ByteSpan id_bytes) const {
+	if (id_bytes.size != ID{}.size()) {
+		return false;
+	}
+
+	ID r_id{};
+	std::memcpy(r_id.data(), id_bytes.ptr, r_id.size());
+
+	return _evicted.contains(r_id);
+}
+
 ToxP2PRNG::ToxP2PRNG(
 	ToxI& t,
 	ToxEventProviderI& tep,
 	ToxContactModel2& tcm
-) : _t(t), _tep_sr(tep.newSubRef(this)), _tcm(tcm) {
+) : ToxP2PRNG(t, tep) {
+	_tcm = &tcm;
+}
+
+ToxP2PRNG::ToxP2PRNG(
+	ToxI& t,
+	ToxEventProviderI& tep
+) : _t(t), _tep_sr(tep.newSubRef(this)) {
 	_tep_sr
 		.subscribe(Tox_Event_Type::TOX_EVENT_FRIEND_LOSSLESS_PACKET)
 		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_CUSTOM_PACKET)
 		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_CUSTOM_PRIVATE_PACKET)
+
+		// flush send queues on (re)connect
+		.subscribe(Tox_Event_Type::TOX_EVENT_FRIEND_CONNECTION_STATUS)
+		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_PEER_JOIN)
+
+		// online peers for newGernation()
+		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_PEER_EXIT)
+		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_SELF_JOIN)
 	;
+
+	// per peer metrics would otherwise outlive their contacts
+	_key_index.setOnDestroy([this](Contact4 c) {
+		_metrics.peers.erase(c);
+	});
+}
+
+ToxP2PRNG::~ToxP2PRNG(void) {
+	// join before anything the completions could touch goes away
+	_crypto_workers.reset();
+}
+
+void ToxP2PRNG::setProtoEventRing(bool enabled) {
+	if (!enabled) {
+		_proto_event_ring.reset();
+	} else if (!_proto_event_ring) {
+		_proto_event_ring = std::make_unique<ProtoEventRing>();
+	}
+}
+
+std::vector<ProtoEventRing::Event> ToxP2PRNG::getRecentProtoEvents(void) const {
+	if (!_proto_event_ring) {
+		return {};
+	}
+	return _proto_event_ring->snapshot();
+}
+
+void ToxP2PRNG::recordProtoEvent(ContactHandle4 c, const PKG pkg_type, const ByteSpan id, const bool outgoing) {
+	if (!_proto_event_ring) {
+		return;
+	}
+
+	ProtoEventRing::Event e;
+	e.time = _time;
+	e.contact = entt::to_integral(c.entity());
+	e.pkg_type = static_cast<uint8_t>(pkg_type);
+	e.outgoing = outgoing;
+	std::copy(id.cbegin(), id.cbegin() + std::min<size_t>(id.size, e.id_prefix.size()), e.id_prefix.begin());
+	_proto_event_ring->push(e);
+}
+
+void ToxP2PRNG::setCryptoWorkers(size_t thread_count) {
+	if (_crypto_workers) {
+		// dont lose verified secrets
+		_crypto_workers->drain();
+	}
+	_crypto_workers.reset();
+
+	if (thread_count > 0) {
+		_crypto_workers = std::make_unique<CryptoWorkers>(thread_count);
+	}
+}
+
+bool ToxP2PRNG::encodeSession(std::vector<uint8_t>& body, const RngState& rng_state) {
+	if (!rng_state.secrets.has(rng_state.self_idx)) {
+		return false;
+	}
+
+	size_t body_size = PkgCodec::flags_size;
+	if (rng_state.is_digest.has_value()) {
+		body_size += PkgCodec::id_size;
+	}
+	if (rng_state.chained_from.has_value()) {
+		body_size += PkgCodec::id_size;
+	}
+	body_size += sizeof(uint16_t);
+	for (const auto c : rng_state.contacts) {
+		if (c.all_of<Contact::Components::ToxGroupPeerPersistent>()) {
+			body_size += 1u + 2*PkgCodec::key_size;
+		} else if (c.all_of<Contact::Components::ToxFriendPersistent>()) {
+			body_size += 1u + PkgCodec::key_size;
+		} else {
+			return false;
+		}
+	}
+	body_size += PkgCodec::secret_size;
+	body_size += sizeof(uint16_t) + rng_state.hmacs.count*(sizeof(uint16_t)+PkgCodec::hmac_size);
+	body_size += rng_state.getInitialState().size;
+
+	body.resize(body_size);
+	PkgCodec::Writer w{body, 0u};
+
+	uint8_t flags {0u};
+	flags |= rng_state.self_initiated ? g_store_flag_self_initiated : 0u;
+	flags |= rng_state.pipelined ? g_store_flag_pipelined : 0u;
+	flags |= rng_state.is_digest.has_value() ? g_store_flag_digest : 0u;
+	flags |= rng_state.compact_init ? g_store_flag_compact_init : 0u;
+	flags |= rng_state.chained_from.has_value() ? g_store_flag_chained : 0u;
+	w.u8(flags);
+
+	if (rng_state.is_digest.has_value()) {
+		w.bytes(rng_state.is_digest.value());
+	}
+	if (rng_state.chained_from.has_value()) {
+		w.bytes(rng_state.chained_from.value());
+	}
+
+	w.u16(rng_state.contacts.size());
+	for (const auto c : rng_state.contacts) {
+		if (const auto* tgpp = c.try_get<Contact::Components::ToxGroupPeerPersistent>(); tgpp != nullptr) {
+			w.u8(1u);
+			w.bytes(tgpp->chat_id.data);
+			w.bytes(tgpp->peer_key.data);
+		} else {
+			w.u8(0u);
+			w.bytes(c.get<Contact::Components::ToxFriendPersistent>().key.data);
+		}
+	}
+
+	w.bytes(rng_state.secrets.at(rng_state.self_idx));
+
+	w.u16(rng_state.hmacs.count);
+	for (size_t i = 0; i < rng_state.contacts.size(); i++) {
+		if (rng_state.hmacs.has(i)) {
+			w.u16(i);
+			w.bytes(rng_state.hmacs.at(i));
+		}
+	}
+
+	w.bytes(rng_state.getInitialState());
+
+	return w.full();
+}
+
+void ToxP2PRNG::storeSession(const ID& id, const RngState& rng_state) {
+	if (!_store) {
+		return;
+	}
+
+	std::vector<uint8_t> body;
+	if (!encodeSession(body, rng_state)) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: failed to store generation " << bin2hex(ByteSpan{id}) << "\n");
+		return;
+	}
+	_store->append(SessionStore::RecordType::SESSION, id, ByteSpan{body}, true);
+
+	if (rng_state.chained_from.has_value()) {
+		// the commitments of prev are used up, also after a restart
+		_store->append(SessionStore::RecordType::CHAINED, rng_state.chained_from.value(), ByteSpan{id}, true);
+	}
+}
+
+void ToxP2PRNG::storeHMAC(const ByteSpan id, const bool next_round, const size_t c_idx, const uint8_t* hmac) {
+	if (!_store) {
+		return;
+	}
+
+	const auto body = hmacRecordBody(next_round, c_idx, hmac);
+	_store->append(SessionStore::RecordType::HMAC, toStoreID(id), ByteSpan{body});
+}
+
+void ToxP2PRNG::storeSecret(const ByteSpan id, const size_t c_idx, const uint8_t* secret) {
+	if (!_store) {
+		return;
+	}
+
+	const auto body = secretRecordBody(c_idx, secret);
+	_store->append(SessionStore::RecordType::SECRET, toStoreID(id), ByteSpan{body});
+}
+
+void ToxP2PRNG::storeEnd(const ID& id) {
+	if (!_store) {
+		return;
+	}
+
+	_store->append(SessionStore::RecordType::END, id, ByteSpan{});
+}
+
+void ToxP2PRNG::compactSessionStore(void) {
+	if (!_store) {
+		return;
+	}
+
+	std::vector<uint8_t> records;
+	std::vector<uint8_t> body;
+	for (const auto& [id, rng_state] : _global_map) {
+		if (!encodeSession(body, rng_state)) {
+			continue;
+		}
+		SessionStore::encode(records, SessionStore::RecordType::SESSION, id, ByteSpan{body});
+
+		// before that, secrets might not be verified yet, they get requested again
+		if (rng_state.hmacs.complete()) {
+			for (size_t i = 0; i < rng_state.contacts.size(); i++) {
+				if (i == rng_state.self_idx || !rng_state.secrets.has(i)) {
+					continue;
+				}
+
+				const auto secret_body = secretRecordBody(i, rng_state.secrets.at(i).data());
+				SessionStore::encode(records, SessionStore::RecordType::SECRET, id, ByteSpan{secret_body});
+
+				if (rng_state.next_hmacs.has(i)) {
+					const auto hmac_body = hmacRecordBody(true, i, rng_state.next_hmacs.at(i).data());
+					SessionStore::encode(records, SessionStore::RecordType::HMAC, id, ByteSpan{hmac_body});
+				}
+			}
+		}
+
+		if (rng_state.have_next_secret) {
+			const auto next_body = nextRecordBody(rng_state.next_secret.data(), rng_state.next_hmacs.at(rng_state.self_idx).data());
+			SessionStore::encode(records, SessionStore::RecordType::NEXT, id, ByteSpan{next_body});
+		}
+
+		if (rng_state.next_id.has_value()) {
+			SessionStore::encode(records, SessionStore::RecordType::CHAINED, id, ByteSpan{rng_state.next_id.value()});
+		}
+	}
+
+	// not resolved yet, kept as they are
+	for (const auto& [id, pending_records] : _store_pending) {
+		for (const auto& record : pending_records) {
+			records.insert(records.cend(), record.raw.cbegin(), record.raw.cend());
+		}
+	}
+
+	if (_store->rewrite(ByteSpan{records})) {
+		_store_compacted_size = _store->size();
+	}
+}
+
+bool ToxP2PRNG::setSessionStore(const std::string& path) {
+	_store.reset(); // syncs
+	_store_pending.clear();
+	_store_loaded.clear();
+	_store_compacted_size = 0u;
+
+	if (path.empty()) {
+		return true;
+	}
+
+	auto store = std::make_unique<SessionStore>();
+	std::vector<SessionStore::Record> records;
+	if (!store->open(path, _store_loaded, records)) {
+		return false;
+	}
+
+	entt::dense_set<ID, IDHash> ended;
+	for (const auto& record : records) {
+		if (record.type == SessionStore::RecordType::END) {
+			ended.emplace(record.id);
+		}
+	}
+
+	for (const auto& record : records) {
+		if (ended.contains(record.id) || _global_map.contains(record.id)) {
+			continue;
+		}
+		_store_pending[record.id].push_back(record);
+	}
+
+	_store = std::move(store);
+	_store_pending_since = _time;
+	_store_restore_tried = false;
+
+	TP2PRNG_LOG(info, session, "TP2PRNG: session store has " << _store_pending.size() << " unfinished generations\n");
+
+	// drops what ended, and adds what is running already
+	compactSessionStore();
+
+	if (auto* reg = _key_index.registry(); reg != nullptr) {
+		restoreSessions(*reg);
+	}
+
+	return true;
+}
+
+void ToxP2PRNG::abortStoreFailed(void) {
+	if (_store_failed.empty()) {
+		return;
+	}
+
+	// packet ids are generation ids, or bundle ids for bundles
+	std::vector<ID> to_abort;
+	for (const auto& [id, rng_state] : _global_map) {
+		if (_store_failed.contains(id) || (rng_state.bundle_id.has_value() && _store_failed.contains(rng_state.bundle_id.value()))) {
+			to_abort.push_back(id);
+		}
+	}
+	_store_failed.clear();
+
+	for (const auto& id : to_abort) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: aborting generation " << bin2hex(ByteSpan{id}) << ", its records could not be stored\n");
+		storeEnd(id);
+		eraseSession(id);
+		addTombstone(id);
+		_eviction_stats.store_failed++;
+	}
+}
+
+void ToxP2PRNG::restoreSessions(ContactRegistry4& reg) {
+	if (_store_pending.empty()) {
+		return;
+	}
+
+	_key_index.bind(reg); // noop if already bound
+
+	if (_store_restore_tried && _store_restore_generation == _key_index.generation()) {
+		return; // no new contacts since the last try
+	}
+	_store_restore_tried = true;
+	_store_restore_generation = _key_index.generation();
+
+	// restoring fires events
+	std::vector<ID> ids;
+	ids.reserve(_store_pending.size());
+	for (const auto& [id, records] : _store_pending) {
+		ids.push_back(id);
+	}
+
+	for (const auto& id : ids) {
+		const auto it = _store_pending.find(id);
+		if (it == _store_pending.cend()) {
+			continue;
+		}
+
+		if (restoreSession(id, it->second)) {
+			_store_pending.erase(id);
+		}
+	}
+
+	if (_store_pending.empty()) {
+		_store_loaded.clear();
+		_store_loaded.shrink_to_fit();
+	}
+}
+
+bool ToxP2PRNG::restoreSession(const ID& id, const std::vector<SessionStore::Record>& records) {
+	const auto session_it = std::find_if(records.cbegin(), records.cend(), [](const auto& record) { return record.type == SessionStore::RecordType::SESSION; });
+	if (session_it == records.cend()) {
+		return true; // eg the chain marker of a generation that ended
+	}
+
+	if (_global_map.contains(id) || isEvicted(ByteSpan{id})) {
+		return true;
+	}
+
+	PkgCodec::Reader r{session_it->body};
+
+	uint8_t flags {0u};
+	std::optional<ID> is_digest;
+	std::optional<ID> chained_from;
+	uint16_t contact_count {0u};
+	bool ok = r.u8(flags);
+	if (ok && (flags & g_store_flag_digest) != 0) {
+		ok = r.array(is_digest.emplace());
+	}
+	if (ok && (flags & g_store_flag_chained) != 0) {
+		ok = r.array(chained_from.emplace());
+	}
+	ok = ok && r.u16(contact_count);
+
+	std::vector<ContactHandle4> contacts;
+	std::vector<ToxKey> keys;
+	bool missing {false};
+	for (size_t i = 0; ok && i < contact_count; i++) {
+		uint8_t kind {0u};
+		ToxKey key;
+		ContactHandle4 c;
+		if (!r.u8(kind)) {
+			ok = false;
+		} else if (kind == 0u) {
+			ok = r.array(key.data);
+			c = _key_index.findFriend(key);
+		} else if (kind == 1u) {
+			ToxKey chat_id;
+			ok = r.array(chat_id.data) && r.array(key.data);
+			c = _key_index.findGroupPeer(chat_id, key);
+		} else {
+			ok = false;
+		}
+
+		missing = missing || !static_cast<bool>(c);
+		contacts.push_back(c);
+		keys.push_back(key);
+	}
+
+	ByteSpan own_secret;
+	uint16_t hmac_count {0u};
+	ok = ok && r.span(PkgCodec::secret_size, own_secret) && r.u16(hmac_count);
+
+	std::vector<std::pair<uint16_t, ByteSpan>> hmacs;
+	for (size_t i = 0; ok && i < hmac_count; i++) {
+		auto& [c_idx, hmac] = hmacs.emplace_back();
+		ok = r.u16(c_idx) && r.span(PkgCodec::hmac_size, hmac);
+	}
+
+	const ByteSpan initial_state = r.rest();
+	if (!ok || initial_state.empty()) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: damaged session record for " << bin2hex(ByteSpan{id}) << ", dropping it\n");
+		return true;
+	}
+
+	if (missing) {
+		// contacts might not be loaded yet
+		return false;
+	}
+
+	enforceSessionCap();
+
+	RngState& rng_state = _global_map[id];
+	lruPush(id, _time);
+	if (!rng_state.setContacts(std::move(contacts))) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: failed to find self in stored gen\n");
+		eraseSession(id);
+		return true;
+	}
+	setBroadcast(rng_state);
+	rng_state.is_digest = is_digest;
+	if (!rng_state.fillInitialState(ByteSpan{id}, initial_state, &keys)) {
+		eraseSession(id);
+		return true;
+	}
+
+	rng_state.touch(_time);
+	rng_state.time_start = _time;
+	rng_state.self_initiated = (flags & g_store_flag_self_initiated) != 0;
+	rng_state.pipelined = (flags & g_store_flag_pipelined) != 0;
+	rng_state.compact_init = (flags & g_store_flag_compact_init) != 0;
+	rng_state.chained_from = chained_from;
+
+	rng_state.secrets.set(rng_state.self_idx, own_secret.ptr);
+	for (const auto& [c_idx, hmac] : hmacs) {
+		if (c_idx < rng_state.contacts.size()) {
+			rng_state.hmacs.set(c_idx, hmac.ptr);
+		}
+	}
+
+	if (!rng_state.hmacs.has(rng_state.self_idx)) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: stored gen without own hmac\n");
+		eraseSession(id);
+		return true;
+	}
+
+	// everything that happened after
+	std::vector<std::pair<uint16_t, ByteSpan>> next_hmacs;
+	for (const auto& record : records) {
+		PkgCodec::Reader rr{record.body};
+		uint16_t c_idx {0u};
+		switch (record.type) {
+			case SessionStore::RecordType::HMAC: {
+				uint8_t round {0u};
+				ByteSpan hmac;
+				if (!rr.u8(round) || !rr.u16(c_idx) || !rr.span(PkgCodec::hmac_size, hmac) || c_idx >= rng_state.contacts.size()) {
+					break;
+				}
+				if (round == 0u) {
+					rng_state.hmacs.set(c_idx, hmac.ptr);
+				} else {
+					next_hmacs.emplace_back(c_idx, hmac);
+				}
+				break;
+			}
+			case SessionStore::RecordType::SECRET: {
+				ByteSpan secret;
+				if (!rr.u16(c_idx) || !rr.span(PkgCodec::secret_size, secret) || c_idx >= rng_state.contacts.size() || c_idx == rng_state.self_idx) {
+					break;
+				}
+				rng_state.secrets.set(c_idx, secret.ptr);
+				break;
+			}
+			case SessionStore::RecordType::NEXT: {
+				ByteSpan next_secret;
+				ByteSpan next_hmac;
+				if (!rr.span(PkgCodec::secret_size, next_secret) || !rr.span(PkgCodec::hmac_size, next_hmac)) {
+					break;
+				}
+				std::memcpy(rng_state.next_secret.data(), next_secret.ptr, next_secret.size);
+				rng_state.next_hmacs.set(rng_state.self_idx, next_hmac.ptr);
+				rng_state.have_next_secret = true;
+				break;
+			}
+			case SessionStore::RecordType::CHAINED: {
+				ID next_id;
+				if (rr.array(next_id)) {
+					rng_state.next_id = next_id;
+				}
+				break;
+			}
+			default:
+				break;
+		}
+	}
+
+	// only came with a verified secret
+	for (const auto& [c_idx, next_hmac] : next_hmacs) {
+		if (c_idx != rng_state.self_idx && rng_state.secrets.has(c_idx)) {
+			rng_state.next_hmacs.set(c_idx, next_hmac.ptr);
+		}
+	}
+
+	TP2PRNG_LOG(info, session, "TP2PRNG: resuming generation " << bin2hex(ByteSpan{id}) << "\n");
+
+	dispatch(
+		P2PRNG_Event::init,
+		P2PRNG::Events::Init{
+			ByteSpan{id},
+			rng_state.self_initiated,
+			rng_state.getInitialState(),
+		}
+	);
+
+	// (events might have added or evicted generations)
+	const auto restored_it = _global_map.find(id);
+	if (restored_it == _global_map.end()) {
+		return true;
+	}
+	auto* restored = &restored_it->second;
+
+	dispatch(
+		P2PRNG_Event::hmac,
+		P2PRNG::Events::HMAC{
+			ByteSpan{id},
+			restored->hmacs.count,
+			static_cast<uint16_t>(restored->contacts.size()),
+		}
+	);
+
+	// stored secrets get verified again, and ours sent out again if we got that far
+	checkHaveAllHMACs(restored, ByteSpan{id});
+	checkHaveAllSecrets(restored, ByteSpan{id});
+
+	return true;
+}
+
+float ToxP2PRNG::iterate(float time_delta) {
+	_time += time_delta;
+
+	if (_crypto_workers && _crypto_workers->drain() > 0) {
+		_crypto_progress_time = _time;
+	}
+
+	evictSessions();
+
+	if (_store) {
+		abortStoreFailed();
+
+		if (!_store_pending.empty()) {
+			if (auto* reg = _key_index.registry(); reg != nullptr) {
+				restoreSessions(*reg);
+			}
+
+			if (!_store_pending.empty() && _time - _store_pending_since >= _eviction_config.stall_timeout) {
+				TP2PRNG_LOG(warn, session, "TP2PRNG warning: giving up on " << _store_pending.size() << " stored generations with unknown contacts\n");
+				for (const auto& [id, records] : _store_pending) {
+					storeEnd(id);
+				}
+				_store_pending.clear();
+				_store_loaded.clear();
+				_store_loaded.shrink_to_fit();
+			}
+		}
+
+		// durable records got synced before sending, the rest only needs to reach the os
+		if (_store->size() > std::max(g_store_compact_min, 2*_store_compacted_size)) {
+			compactSessionStore();
+		} else {
+			_store->flush();
+		}
+	}
+
+	retrySessions();
+	flushSendQueues();
+
+	// sleep until the next retransmission, session or tombstone expires
+	double next = std::numeric_limits<float>::max();
+	for (const auto& [id, rng_state] : _global_map) {
+		if (rng_state.getState() == P2PRNG::DONE) {
+			next = std::min(next, rng_state.last_activity + _eviction_config.done_ttl - _time);
+		} else {
+			next = std::min(next, rng_state.last_activity + _eviction_config.stall_timeout - _time);
+			next = std::min(next, rng_state.retry_next - _time);
+		}
+	}
+	if (!_evicted_order.empty()) {
+		next = std::min(next, _evicted_order.front().first + _eviction_config.tombstone_ttl - _time);
+	}
+	for (const auto& [id, pending] : _pending_inits) {
+		next = std::min(next, pending.time + _eviction_config.stall_timeout - _time);
+	}
+	if (!_store_pending.empty()) {
+		// contacts might show up any time
+		next = std::min(next, 1.0);
+	}
+
+	if (!_send_queues.empty()) {
+		// still packets waiting for sendq space or budget
+		next = std::min(next, 0.2);
+	}
+
+	if (getCryptoJobsInFlight() > 0) {
+		// right after progress more completions are likely, the longer nothing finished the longer we wait
+		next = std::min(next, std::clamp(_time - _crypto_progress_time, g_crypto_poll_min, g_crypto_poll_max));
+	}
+
+	return std::max(static_cast<float>(next), 0.01f);
+}
+
+std::vector<ContactHandle4> ToxP2PRNG::resolvePeers(ContactHandle4 c, const std::vector<ToxKey>& peers) {
+	_key_index.bind(*c.registry()); // noop if already bound
+
+	std::vector<ContactHandle4> peer_contacts;
+	if (c.all_of<Contact::Components::ToxFriendEphemeral>()) {
+		// a 1to1 can only have 2 peers
+		if (peers.size() != 2) {
+			TP2PRNG_LOG(error, proto, "TP2PRNG error: friend peer list with " << peers.size() << " peers\n");
+			return {};
+		}
+		for (const auto& peer_key : peers) {
+			if (auto find_c = _key_index.findFriend(peer_key); static_cast<bool>(find_c)) {
+				peer_contacts.push_back(find_c);
+			}
+		}
+	} else if (c.all_of<Contact::Components::ToxGroupPeerEphemeral>()) {
+		const auto* sender_tgpp = c.try_get<Contact::Components::ToxGroupPeerPersistent>();
+		if (sender_tgpp == nullptr) {
+			TP2PRNG_LOG(error, proto, "TP2PRNG error: group peer without persistent key\n");
+			return {};
+		}
+
+		// only peers from the same group
+		for (const auto& peer_key : peers) {
+			if (auto find_c = _key_index.findGroupPeer(sender_tgpp->chat_id, peer_key); static_cast<bool>(find_c)) {
+				peer_contacts.push_back(find_c);
+			}
+		}
+	} else {
+		// yooo how did we get here
+		assert(false);
+		return {};
+	}
+
+	if (peer_contacts.size() != peers.size()) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: not all peers in peer list could be resolved to contacts\n");
+		return {};
+	}
+
+	return peer_contacts;
+}
+
+bool ToxP2PRNG::appendCompactPeerList(std::vector<uint8_t>& pkg, const std::vector<ContactHandle4>& peers) {
+	if (peers.size() < 2 || peers.size() > std::numeric_limits<uint16_t>::max()) {
+		return false;
+	}
+
+	const auto* first_tgpp = peers.front().try_get<Contact::Components::ToxGroupPeerPersistent>();
+	if (first_tgpp == nullptr) {
+		return false;
+	}
+
+	for (const auto peer : peers) {
+		const auto* tgpp = peer.try_get<Contact::Components::ToxGroupPeerPersistent>();
+		if (tgpp == nullptr || !(tgpp->chat_id == first_tgpp->chat_id)) {
+			return false;
+		}
+	}
+
+	_key_index.bind(*peers.front().registry()); // noop if already bound
+	const auto members = _key_index.getGroupPeers(first_tgpp->chat_id);
+
+	// receivers might know members we dont, they fall back to asking for the full list (retry)
+	std::vector<uint64_t> member_prefixes;
+	member_prefixes.reserve(members.size());
+	for (uint8_t prefix_len = g_compact_prefix_min; prefix_len <= g_compact_prefix_max; prefix_len++) {
+		member_prefixes.clear();
+		for (const auto member : members) {
+			member_prefixes.push_back(keyPrefix(member.get<Contact::Components::ToxGroupPeerPersistent>().peer_key, prefix_len));
+		}
+		std::sort(member_prefixes.begin(), member_prefixes.end());
+		if (std::adjacent_find(member_prefixes.cbegin(), member_prefixes.cend()) != member_prefixes.cend()) {
+			continue; // collision, try longer
+		}
+
+		const size_t offset = pkg.size();
+		pkg.resize(offset + PkgCodec::compactPeerListSize(peers.size(), prefix_len));
+		PkgCodec::Writer w{pkg, offset};
+
+		w.u16(peers.size());
+		w.u8(prefix_len);
+		for (const auto peer : peers) {
+			const auto& key = peer.get<Contact::Components::ToxGroupPeerPersistent>().peer_key;
+			w.bytes(key.data.data(), prefix_len);
+		}
+
+		uint8_t keys_hash[PkgCodec::keys_hash_size];
+		peerKeysHash(peers, keys_hash);
+		w.bytes(keys_hash, sizeof(keys_hash));
+
+		return w.full();
+	}
+
+	return false;
+}
+
+std::vector<ContactHandle4> ToxP2PRNG::resolveCompactPeers(ContactHandle4 c, const uint8_t prefix_len, const std::vector<uint64_t>& prefixes, const ByteSpan keys_hash) {
+	const auto* sender_tgpp = c.try_get<Contact::Components::ToxGroupPeerPersistent>();
+	if (sender_tgpp == nullptr) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: compact peer list not from a group peer\n");
+		return {};
+	}
+
+	_key_index.bind(*c.registry()); // noop if already bound
+
+	// prefix -> member, null if ambiguous
+	entt::dense_map<uint64_t, Contact4> members;
+	for (const auto member : _key_index.getGroupPeers(sender_tgpp->chat_id)) {
+		const auto prefix = keyPrefix(member.get<Contact::Components::ToxGroupPeerPersistent>().peer_key, prefix_len);
+		if (const auto [it, inserted] = members.emplace(prefix, member.entity()); !inserted) {
+			it->second = entt::null;
+		}
+	}
+
+	std::vector<ContactHandle4> peer_contacts;
+	peer_contacts.reserve(prefixes.size());
+	for (const auto prefix : prefixes) {
+		const auto it = members.find(prefix);
+		if (it == members.cend() || it->second == entt::null) {
+			TP2PRNG_LOG(warn, proto, "TP2PRNG warning: compact peer list has unknown or ambiguous peers, waiting for full list\n");
+			return {};
+		}
+		peer_contacts.push_back(ContactHandle4{*c.registry(), it->second});
+	}
+
+	// unique prefixes on our side do not mean we resolved the same keys the sender meant
+	uint8_t resolved_hash[PkgCodec::keys_hash_size];
+	peerKeysHash(peer_contacts, resolved_hash);
+	if (keys_hash.size != sizeof(resolved_hash) || sodium_memcmp(resolved_hash, keys_hash.ptr, sizeof(resolved_hash)) != 0) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: compact peer list resolved to different keys, waiting for full list\n");
+		return {};
+	}
+
+	return peer_contacts;
+}
+
+ToxP2PRNG::RngState* ToxP2PRNG::createRngState(
+	const ID& id,
+	std::vector<ContactHandle4>&& contacts,
+	const ByteSpan initial_state,
+	const std::optional<ID>& is_digest,
+	const std::vector<ToxKey>* peer_keys,
+	const bool make_room
+) {
+	if (make_room) {
+		enforceSessionCap();
+	}
+
+	RngState& new_rng_state = _global_map[id];
+	lruPush(id, _time);
+	new_rng_state.touch(_time);
+	new_rng_state.time_start = _time;
+	if (!new_rng_state.setContacts(std::move(contacts))) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: failed to find self in new gen\n");
+		eraseSession(id);
+		return nullptr;
+	}
+	setBroadcast(new_rng_state);
+	new_rng_state.is_digest = is_digest;
+	if (!new_rng_state.fillInitialState(ByteSpan{id}, initial_state, peer_keys)) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: contact without public key in new gen\n");
+		eraseSession(id);
+		return nullptr;
+	}
+
+	const auto full_is = new_rng_state.getFullInitialState();
+
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac;
+	std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret;
+	if (p2prng_gen_and_auth(secret.data(), secret.data()+P2PRNG_LEN, hmac.data(), full_is.ptr, full_is.size) != 0) {
+		TP2PRNG_LOG(error, crypto, "TP2PRNG error: failed to generate and hmac from is\n");
+		eraseSession(id);
+		return nullptr;
+	}
+
+	new_rng_state.hmacs.set(new_rng_state.self_idx, hmac);
+	new_rng_state.secrets.set(new_rng_state.self_idx, secret);
+
+	return &new_rng_state;
+}
+
+ToxP2PRNG::RngState* ToxP2PRNG::createChainedRngState(const ID& id, const ID& prev_id, const ByteSpan initial_state) {
+	std::vector<ContactHandle4> contacts;
+	PeerSlots<P2PRNG_MAC_LEN> hmacs;
+	std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret;
+
+	{ // copy out, inserting below can move prev
+		const auto prev_it = _global_map.find(prev_id);
+		if (prev_it == _global_map.cend()) {
+			return nullptr;
+		}
+		const auto& prev = prev_it->second;
+
+		if (!prev.pipelined || !prev.have_next_secret) {
+			TP2PRNG_LOG(error, session, "TP2PRNG error: prev generation has no commitments to chain on\n");
+			return nullptr;
+		}
+
+		if (prev.next_id.has_value()) {
+			// reusing the commitments would reuse the secrets
+			TP2PRNG_LOG(error, session, "TP2PRNG error: prev generation was already chained\n");
+			return nullptr;
+		}
+
+		contacts = prev.contacts;
+		hmacs = prev.next_hmacs;
+		secret = prev.next_secret;
+	}
+
+	enforceSessionCap();
+
+	RngState& new_rng_state = _global_map[id];
+	lruPush(id, _time);
+	new_rng_state.touch(_time);
+	new_rng_state.time_start = _time;
+	new_rng_state.setContacts(std::move(contacts)); // same as prev, cant fail
+	setBroadcast(new_rng_state);
+	new_rng_state.fillInitialState(ByteSpan{id}, initial_state); // same as prev, cant fail
+	new_rng_state.pipelined = true;
+	new_rng_state.chained_from = prev_id;
+	new_rng_state.hmacs = std::move(hmacs); // might still miss some, they can arrive late with the prev secrets
+	new_rng_state.secrets.set(new_rng_state.self_idx, secret);
+
+	// prev might have been evicted by the cap
+	if (auto prev_it = _global_map.find(prev_id); prev_it != _global_map.end()) {
+		prev_it->second.next_id = id;
+	}
+
+	return &new_rng_state;
+}
+
+const entt::dense_set<Contact4>& ToxP2PRNG::getGroupOnlinePeers(ContactHandle4 group) {
+	if (const auto it = _group_online_peers.find(group); it != _group_online_peers.cend()) {
+		return it->second;
+	}
+
+	// first use, only walks the peers of this group
+	auto& online_peers = _group_online_peers[group];
+	if (const auto* parent_of = group.try_get<Contact::Components::ParentOf>(); parent_of != nullptr) {
+		for (const auto sub : parent_of->subs) {
+			const ContactHandle4 peer{*group.registry(), sub};
+			if (!static_cast<bool>(peer) || peer.all_of<Contact::Components::TagSelfStrong>()) {
+				continue;
+			}
+
+			const auto* cs = peer.try_get<Contact::Components::ConnectionState>();
+			if (cs == nullptr || cs->state == Contact::Components::ConnectionState::disconnected) {
+				continue;
+			}
+
+			online_peers.emplace(sub);
+		}
+	}
+
+	return online_peers;
+}
+
+std::vector<uint8_t> ToxP2PRNG::newGernation(ContactHandle4 c, const ByteSpan initial_state_user_data) {
+	if (!static_cast<bool>(c)) {
+		return {};
+	}
+
+	const auto* self = c.try_get<Contact::Components::Self>();
+	if (self == nullptr) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: contact has no self\n");
+		return {};
+	}
+
+	std::vector<ContactHandle4> c_vec;
+	c_vec.push_back(ContactHandle4{*c.registry(), self->self});
+
+	if (c.all_of<Contact::Components::ToxFriendEphemeral>()) {
+		c_vec.push_back(c);
+	} else if (c.all_of<Contact::Components::ToxGroupEphemeral>()) {
+		const auto& online_peers = getGroupOnlinePeers(c);
+		c_vec.reserve(1 + online_peers.size());
+		for (const auto peer : online_peers) {
+			if (c.registry()->valid(peer)) {
+				c_vec.push_back(ContactHandle4{*c.registry(), peer});
+			}
+		}
+	} else {
+		return {};
+	}
+
+	if (c_vec.size() < 2) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: nobody online to generate with\n");
+		return {};
+	}
+
+	return newGernationPeers(c_vec, initial_state_user_data);
+}
+
+std::vector<uint8_t> ToxP2PRNG::newGernationPeers(const std::vector<ContactHandle4>& c_vec, const ByteSpan initial_state_user_data) {
+	return startGeneration(c_vec, initial_state_user_data, false);
+}
+
+std::vector<uint8_t> ToxP2PRNG::newGenerationPipelined(const std::vector<ContactHandle4>& c_vec, const ByteSpan initial_state_user_data) {
+	return startGeneration(c_vec, initial_state_user_data, true);
+}
+
+std::vector<uint8_t> ToxP2PRNG::startGeneration(const std::vector<ContactHandle4>& c_vec, const ByteSpan initial_state_user_data, const bool pipelined) {
+	if (initial_state_user_data.empty()) {
+		return {};
+	}
+
+	ID new_id{};
+
+	if (c_vec.size() > std::numeric_limits<uint16_t>::max()) {
+		return {};
+	}
+
+	// group peers are known to everyone in the group, prefixes are enough
+	auto compact_peer_list_buf = _pkg_pool.acquire(PkgCodec::compactPeerListSize(c_vec.size(), g_compact_prefix_max));
+	auto& compact_peer_list = *compact_peer_list_buf;
+	const bool compact = appendCompactPeerList(compact_peer_list, c_vec);
+
+	// calc size, we are limited by the tox max packet size
+	const size_t peer_list_size = compact ? PkgCodec::flags_size+compact_peer_list.size() : PkgCodec::peerListSize(c_vec.size());
+	// size currently same for friend and group
+	const size_t init_w_h_pkg_size = PkgCodec::header_size+new_id.size()+peer_list_size+PkgCodec::hmac_size+initial_state_user_data.size;
+	//TOX_MAX_CUSTOM_PACKET_SIZE // 1373
+	//TOX_GROUP_MAX_MESSAGE_LENGTH // 1372
+	std::optional<ID> is_digest;
+	if (init_w_h_pkg_size > g_max_pkg_size) {
+		// does not fit, send a digest and the rest in fragments
+		auto blob_buf = _pkg_pool.acquire(PkgCodec::peerListSize(c_vec.size())+initial_state_user_data.size);
+		auto& blob = *blob_buf;
+		if (!buildInitBlob(blob, c_vec, initial_state_user_data)) {
+			return {};
+		}
+
+		if (blob.size() > g_init_blob_max) {
+			TP2PRNG_LOG(error, session, "TP2PRNG error: initial state and peer list exeed max size\n");
+			return {};
+		}
+
+		is_digest = ID{};
+		crypto_generichash(is_digest->data(), is_digest->size(), blob.data(), blob.size(), nullptr, 0);
+	}
+
+	// after size check
+	randombytes(new_id.data(), new_id.size());
+
+	// TODO: sanity check all contacts are either friend or group exclusively
+
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac;
+	{
+		auto* new_rng_state_ptr = createRngState(new_id, std::vector<ContactHandle4>{c_vec}, initial_state_user_data, is_digest);
+		if (new_rng_state_ptr == nullptr) {
+			return {};
+		}
+		RngState& new_rng_state = *new_rng_state_ptr;
+		new_rng_state.self_initiated = true;
+		new_rng_state.pipelined = pipelined;
+		new_rng_state.compact_init = compact && !is_digest.has_value();
+		storeSession(new_id, new_rng_state);
+
+		// copy, the state can move while dispatching
+		hmac = new_rng_state.hmacs.at(new_rng_state.self_idx);
+	}
+
+	// fire init event?
+	dispatch(
+		P2PRNG_Event::init,
+		P2PRNG::Events::Init{
+			ByteSpan{new_id},
+			true,
+			initial_state_user_data,
+		}
+	);
+
+	// (event handlers might have inserted or evicted, only look things up from here on)
+	const auto new_it = _global_map.find(new_id);
+	if (new_it == _global_map.end()) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: generation gone before init was sent\n");
+		return {};
+	}
+	RngState& new_rng_state = new_it->second;
+
+	// same packets for everyone, only the header differs
+	const auto send_init_pkg = [this, &new_rng_state](std::vector<uint8_t>& init_pkg) {
+		if (new_rng_state.broadcast_init) {
+			send_pkg(new_rng_state.broadcast_group, init_pkg);
+		} else {
+			sendToParticipants(new_rng_state, init_pkg);
+		}
+	};
+	if (is_digest.has_value()) {
+		auto init_pkgs = buildInitDigestPkgs(ByteSpan{new_id}, new_rng_state);
+		TP2PRNG_LOG(debug, send, "TP2PRNG: sending INIT_WITH_HMAC_DIGEST + " << init_pkgs.size()-1 << " fragments\n");
+		for (auto& init_pkg : init_pkgs) {
+			send_init_pkg(*init_pkg);
+		}
+	} else if (compact) {
+		auto init_pkg = buildInitWithHMACCompactPkg(_pkg_pool, ByteSpan{new_id}, ByteSpan{compact_peer_list}, initial_state_user_data, ByteSpan{hmac}, pipelined);
+		TP2PRNG_LOG(debug, send, "TP2PRNG: sending INIT_WITH_HMAC_COMPACT s:" << init_pkg->size() << "\n");
+		send_init_pkg(*init_pkg);
+	} else {
+		auto init_pkg = buildInitWithHMACPkg(_pkg_pool, ByteSpan{new_id}, new_rng_state.contacts, initial_state_user_data, ByteSpan{hmac}, pipelined);
+		TP2PRNG_LOG(debug, send, "TP2PRNG: sending INIT_WITH_HMAC s:" << init_pkg->size() << "\n");
+		send_init_pkg(*init_pkg);
+	}
+
+	// fire hmac event
+	dispatch(
+		P2PRNG_Event::hmac,
+		P2PRNG::Events::HMAC{
+			ByteSpan{new_id},
+			new_rng_state.hmacs.count,
+			static_cast<uint16_t>(new_rng_state.contacts.size()),
+		}
+	);
+
+	return std::vector<uint8_t>(new_id.cbegin(), new_id.cend());
+}
+
+std::vector<std::vector<uint8_t>> ToxP2PRNG::newGenerationBatch(const std::vector<ContactHandle4>& c_vec, const std::vector<ByteSpan>& initial_states) {
+	if (initial_states.empty()) {
+		return {};
+	}
+
+	if (initial_states.size() == 1) {
+		return {newGernationPeers(c_vec, initial_states.front())};
+	}
+
+	ID bundle_id{};
+
+	// calc size, everything needs to fit into a single packet
+	size_t init_body_size = PkgCodec::peerListSize(c_vec.size())+sizeof(uint16_t);
+	for (const auto& is : initial_states) {
+		if (is.empty() || is.size > std::numeric_limits<uint16_t>::max()) {
+			return {};
+		}
+		init_body_size += PkgCodec::hmac_size + sizeof(uint16_t) + is.size;
+	}
+	const size_t init_pkg_size = PkgCodec::header_size+PkgCodec::id_size+init_body_size;
+	const size_t secret_pkg_size = PkgCodec::header_size+PkgCodec::id_size+sizeof(uint16_t)+initial_states.size()*PkgCodec::secret_size;
+	if (init_pkg_size > g_max_pkg_size || secret_pkg_size > g_max_pkg_size) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: bundle exeeds max packet size\n");
+		return {};
+	}
+
+	randombytes(bundle_id.data(), bundle_id.size());
+
+	const uint16_t bundle_size = initial_states.size();
+
+	// room for the whole bundle up front, so creating a member cant evict another one
+	if (!enforceSessionCap(bundle_size)) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: bundle larger than the session cap\n");
+		return {};
+	}
+
+	std::vector<ID> gen_ids;
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		const auto& gen_id = gen_ids.emplace_back(bundleGenID(ByteSpan{bundle_id}, i));
+
+		auto* new_rng_state = createRngState(gen_id, std::vector<ContactHandle4>{c_vec}, initial_states.at(i), std::nullopt, nullptr, false);
+		if (new_rng_state == nullptr) {
+			gen_ids.pop_back();
+			for (const auto& created_id : gen_ids) {
+				eraseSession(created_id);
+			}
+			return {};
+		}
+		new_rng_state->self_initiated = true;
+		new_rng_state->bundle_id = bundle_id;
+		new_rng_state->bundle_size = bundle_size;
+	}
+
+	// (pointers might have been invalidated by later inserts)
+	std::vector<RngState*> bundle_states;
+	for (const auto& gen_id : gen_ids) {
+		bundle_states.push_back(&_global_map.at(gen_id));
+	}
+
+	auto pkg_buf = prepSendPkgWithID(_pkg_pool, PKG::INIT_WITH_HMAC_BUNDLE, ByteSpan{bundle_id}, init_body_size);
+	auto& pkg = *pkg_buf;
+	auto w = bodyWriter(pkg);
+	bool pkg_ok = writePeerList(w, c_vec);
+	w.u16(bundle_size);
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		w.bytes(bundle_states.at(i)->hmacs.at(bundle_states.at(i)->self_idx));
+		w.u16(initial_states.at(i).size);
+		w.bytes(initial_states.at(i));
+	}
+	if (!pkg_ok || !w.full()) {
+		for (const auto& gen_id : gen_ids) {
+			eraseSession(gen_id);
+		}
+		return {};
+	}
+
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		storeSession(gen_ids.at(i), *bundle_states.at(i));
+	}
+
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		dispatch(
+			P2PRNG_Event::init,
+			P2PRNG::Events::Init{
+				ByteSpan{gen_ids.at(i)},
+				true,
+				initial_states.at(i),
+			}
+		);
+	}
+
+	// event handlers may have touched the map, pointers are stale from here on
+	bundle_states.clear();
+
+	const auto first_it = _global_map.find(gen_ids.front());
+	if (first_it == _global_map.end()) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: bundle gone before it was sent\n");
+		return {};
+	}
+
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending INIT_WITH_HMAC_BUNDLE s:" << pkg.size() << "\n");
+	const auto& first = first_it->second;
+	if (first.broadcast_init) {
+		send_pkg(first.broadcast_group, pkg);
+	} else {
+		sendToParticipants(first, pkg);
+	}
+
+	std::vector<std::vector<uint8_t>> ids;
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		const auto it = _global_map.find(gen_ids.at(i));
+		if (it == _global_map.end()) {
+			continue;
+		}
+
+		dispatch(
+			P2PRNG_Event::hmac,
+			P2PRNG::Events::HMAC{
+				ByteSpan{gen_ids.at(i)},
+				it->second.hmacs.count,
+				static_cast<uint16_t>(it->second.contacts.size()),
+			}
+		);
+
+		ids.emplace_back(gen_ids.at(i).cbegin(), gen_ids.at(i).cend());
+	}
+
+	return ids;
+}
+
+std::vector<uint8_t> ToxP2PRNG::newGenerationChained(const ByteSpan prev_id_bytes, const ByteSpan initial_state_user_data) {
+	if (initial_state_user_data.empty()) {
+		return {};
+	}
+
+	if (prev_id_bytes.size != ID{}.size()) {
+		return {};
+	}
+
+	ID prev_id{};
+	for (size_t i = 0; i < prev_id.size(); i++) {
+		prev_id[i] = prev_id_bytes[i];
+	}
+
+	{ // we can only reveal, if everyone is committed
+		const auto prev_it = _global_map.find(prev_id);
+		if (prev_it == _global_map.cend()) {
+			return {};
+		}
+
+		if (!prev_it->second.next_hmacs.complete()) {
+			return {};
+		}
+	}
+
+	ID new_id{};
+
+	// no fragments for chained inits, the is has to fit next to the secret and next hmac
+	const size_t init_chained_pkg_size = PkgCodec::header_size+PkgCodec::id_size+PkgCodec::id_size+PkgCodec::secret_size+PkgCodec::hmac_size+initial_state_user_data.size;
+	if (init_chained_pkg_size > g_max_pkg_size) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: initial state exeeds max size\n");
+		return {};
+	}
+
+	randombytes(new_id.data(), new_id.size());
+
+	{
+		auto* new_rng_state_ptr = createChainedRngState(new_id, prev_id, initial_state_user_data);
+		if (new_rng_state_ptr == nullptr) {
+			return {};
+		}
+		RngState& new_rng_state = *new_rng_state_ptr;
+		new_rng_state.self_initiated = true;
+
+		if (!ensureNextCommitment(new_rng_state, ByteSpan{new_id})) {
+			eraseSession(new_id);
+			return {};
+		}
+		storeSession(new_id, new_rng_state);
+	}
+
+	dispatch(
+		P2PRNG_Event::init,
+		P2PRNG::Events::Init{
+			ByteSpan{new_id},
+			true,
+			initial_state_user_data,
+		}
+	);
+
+	// (event handlers might have inserted or evicted, only look things up from here on)
+	auto new_it = _global_map.find(new_id);
+	if (new_it == _global_map.end()) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: generation gone before init was sent\n");
+		return {};
+	}
+
+	dispatch(
+		P2PRNG_Event::hmac,
+		P2PRNG::Events::HMAC{
+			ByteSpan{new_id},
+			new_it->second.hmacs.count,
+			static_cast<uint16_t>(new_it->second.contacts.size()),
+		}
+	);
+
+	new_it = _global_map.find(new_id);
+	if (new_it == _global_map.end()) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: generation gone before init was sent\n");
+		return {};
+	}
+	RngState& new_rng_state = new_it->second;
+
+	// the init already reveals our secret, so never as a group packet
+	for (const auto peer : new_rng_state.contacts) {
+		if (peer.all_of<Contact::Components::TagSelfStrong>()) {
+			continue; // skip self
+		}
+		send_init_chained(peer, ByteSpan{new_id}, new_rng_state);
+	}
+	new_rng_state.secret_sent = true;
+
+	// fires the secret event
+	checkHaveAllHMACs(&new_rng_state, ByteSpan{new_id});
+
+	return std::vector<uint8_t>(new_id.cbegin(), new_id.cend());
+}
+
+P2PRNG::State ToxP2PRNG::getSate(const ByteSpan id_bytes) {
+	const auto find_it = _global_map.find(id_bytes); // checks size
+	if (find_it == _global_map.cend()) {
+		return P2PRNG::State::UNKNOWN;
+	} else {
+		return find_it->second.getState();
+	}
+}
+
+ByteSpan ToxP2PRNG::getResult(const ByteSpan id_bytes) {
+	const auto find_it = _global_map.find(id_bytes); // checks size
+	if (find_it == _global_map.cend()) {
+		return {};
+	} else {
+		return ByteSpan{find_it->second.final_result};
+	}
+}
+
+bool ToxP2PRNG::handlePacket(
+	ContactHandle4 c,
+	PKG pkg_type,
+	ByteSpan data
+) {
+	if (data.size < 1) {
+		return false; // waht
+	}
+
+	{ // header (recipient + type) is not in data anymore
+		auto& counters = _metrics.pkg(static_cast<uint8_t>(pkg_type));
+		counters.received.fetch_add(1, std::memory_order_relaxed);
+		counters.received_bytes.fetch_add(2 + data.size, std::memory_order_relaxed);
+	}
+
+	// rn all are prefixed with ID, so here we go
+	if (data.size < PkgCodec::id_size) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet without id\n");
+		return false;
+	}
+
+	ByteSpan id{data.ptr, PkgCodec::id_size};
+
+	recordProtoEvent(c, pkg_type, id, false);
+
+	if (!_store_pending.empty()) {
+		// might be about a generation from before the restart
+		restoreSessions(*c.registry());
+	}
+
+	// smallest valid body (after the id) per packet type, so handlers dont start on truncated packets
+	struct PkgHandler {
+		PKG type;
+		size_t min_size;
+		bool (ToxP2PRNG::*fn)(ContactHandle4 c, const ByteSpan id, ByteSpan data);
+	};
+	using namespace PkgCodec;
+	static constexpr PkgHandler handlers[] {
+		{PKG::INVALID, 0u, nullptr},
+
+		{PKG::INIT_WITH_HMAC, peerListSize(1u) + hmac_size + 1u, &ToxP2PRNG::handle_init_with_hmac},
+		{PKG::HMAC, hmac_size, &ToxP2PRNG::handle_hmac},
+		{PKG::HMAC_REQUEST, 0u, &ToxP2PRNG::handle_hmac_request},
+		{PKG::SECRET, secret_size, &ToxP2PRNG::handle_secret},
+		{PKG::SECRET_REQUEST, 0u, &ToxP2PRNG::handle_secret_request},
+
+		{PKG::INIT_WITH_HMAC_BUNDLE, peerListSize(1u) + sizeof(uint16_t) + hmac_size + sizeof(uint16_t) + 1u, &ToxP2PRNG::handle_init_with_hmac_bundle},
+		{PKG::HMAC_BUNDLE, sizeof(uint16_t), &ToxP2PRNG::handle_hmac_bundle},
+		{PKG::SECRET_BUNDLE, sizeof(uint16_t), &ToxP2PRNG::handle_secret_bundle},
+
+		{PKG::INIT_WITH_HMAC_PIPELINED, peerListSize(1u) + hmac_size + 1u, &ToxP2PRNG::handle_init_with_hmac_pipelined},
+		{PKG::SECRET_WITH_NEXT_HMAC, secret_size + hmac_size, &ToxP2PRNG::handle_secret_with_next_hmac},
+		{PKG::INIT_CHAINED, id_size + secret_size + hmac_size + 1u, &ToxP2PRNG::handle_init_chained},
+
+		{PKG::INIT_WITH_HMAC_DIGEST, flags_size + sizeof(uint32_t) + id_size + hmac_size, &ToxP2PRNG::handle_init_with_hmac_digest},
+		{PKG::INIT_FRAGMENT, sizeof(uint32_t) + 1u, &ToxP2PRNG::handle_init_fragment},
+
+		{PKG::INIT_WITH_HMAC_COMPACT, flags_size + compactPeerListSize(1u, g_compact_prefix_min) + hmac_size + 1u, &ToxP2PRNG::handle_init_with_hmac_compact},
+	};
+	static_assert(std::size(handlers) == static_cast<size_t>(PKG::INIT_WITH_HMAC_COMPACT)+1);
+
+	const size_t type_index = static_cast<size_t>(pkg_type);
+	if (type_index >= std::size(handlers) || handlers[type_index].fn == nullptr) {
+		return false;
+	}
+	const auto& handler = handlers[type_index];
+	assert(handler.type == pkg_type);
+
+	const ByteSpan body {data.ptr + id.size, data.size - id.size};
+	if (body.size < handler.min_size) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, type " << type_index << " s:" << body.size << "\n");
+		return false;
+	}
+
+	return (this->*handler.fn)(c, id, body);
+}
+
+ContactHandle4 ToxP2PRNG::getContactFriend(const uint32_t friend_number) {
+	if (_tcm == nullptr) {
+		return {};
+	}
+	return _tcm->getContactFriend(friend_number);
+}
+
+ContactHandle4 ToxP2PRNG::getContactGroup(const uint32_t group_number) {
+	if (_tcm == nullptr) {
+		return {};
+	}
+	return _tcm->getContactGroup(group_number);
+}
+
+ContactHandle4 ToxP2PRNG::getContactGroupPeer(const uint32_t group_number, const uint32_t peer_number) {
+	if (_tcm == nullptr) {
+		return {};
+	}
+	return _tcm->getContactGroupPeer(group_number, peer_number);
+}
+
+bool ToxP2PRNG::handleFriendPacket(
+	const uint32_t friend_number,
+	ByteSpan data
+) {
+	// packet id + packet id + id
+	if (data.size < 1+1+32) {
+		return false;
+	}
+
+	if (data[0] != TOX_PKG_ID_FRIEND) {
+		return false;
+	}
+
+	PKG tpr_pkg_type = static_cast<PKG>(data[1]);
+
+	auto c = getContactFriend(friend_number);
+	if (!static_cast<bool>(c)) {
+		return false;
+	}
+
+	return handlePacket(c, tpr_pkg_type, {data.ptr+2, data.size-2});
+}
+
+bool ToxP2PRNG::handleGroupPacket(
+	const uint32_t group_number,
+	const uint32_t peer_number,
+	ByteSpan data,
+	const bool _private
+) {
+	// packet id + packet id + id
+	if (data.size < 1+1+32) {
+		return false;
+	}
+
+	if (data[0] != TOX_PKG_ID_GROUP) {
+		return false;
+	}
+
+	PKG tpr_pkg_type = static_cast<PKG>(data[1]);
+
+	// public packets are group broadcasts of INIT/HMAC/SECRET, same content as the private ones
+	// everything else (requests, chained inits) has to come in privately
+	if (!_private && !isGroupBroadcastPkg(tpr_pkg_type)) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: ignoring public packet of type " << static_cast<int>(data[1]) << "\n");
+		return false;
+	}
+
+	auto c = getContactGroupPeer(group_number, peer_number);
+	if (!static_cast<bool>(c)) {
+		return false;
+	}
+
+	return handlePacket(c, tpr_pkg_type, {data.ptr+2, data.size-2});
+}
+
+bool ToxP2PRNG::handle_init_with_hmac(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet INIT_WITH_HMAC\n");
+	return handleInitWithHMAC(c, id, data, false);
+}
+
+bool ToxP2PRNG::handle_init_with_hmac_pipelined(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet INIT_WITH_HMAC_PIPELINED\n");
+	return handleInitWithHMAC(c, id, data, true);
+}
+
+bool ToxP2PRNG::handleInitWithHMAC(ContactHandle4 c, const ByteSpan id, ByteSpan data, const bool pipelined) {
+	PkgCodec::Reader r{data};
+
+	//   - peerlist (includes sender, determines fusion order)
+	std::vector<ToxKey> peers;
+	if (!readPeerList(r, peers)) {
+		return false;
+	}
+
+	// then the senders hmac
+	ByteSpan sender_hmac;
+	if (!r.span(PkgCodec::hmac_size, sender_hmac)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing hmac and initial_state\n");
+		return false;
+	}
+
+	const ByteSpan initial_state = r.rest();
+	if (initial_state.empty()) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing initial_state\n");
+		return false;
+	}
+
+	// lets check if id already exists (after parse, so they cant cheap out)
+	if (const auto* rng_state = getRngSate(c, id); rng_state != nullptr) {
+		// we already know this maybe we did not send hmac or it got lost
+
+		if (!rng_state->hmacs.has(rng_state->self_idx)) {
+			TP2PRNG_LOG(error, session, "uh wtf, bad bad\n");
+			return true;
+		}
+
+		send_hmac(c, id, ByteSpan{rng_state->hmacs.at(rng_state->self_idx)});
+
+		return true; // mark handled
+	}
+
+	if (isEvicted(id)) {
+		// late or replayed INIT of a generation we already dropped
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: INIT_WITH_HMAC for evicted generation, ignoring\n");
+		return true;
+	}
+
+	// else, its new
+	// first resolve peer keys to contacts
+	return acceptInit(c, id, resolvePeers(c, peers), initial_state, sender_hmac, pipelined, std::nullopt, &peers);
+}
+
+bool ToxP2PRNG::acceptInit(
+	ContactHandle4 c,
+	const ByteSpan id,
+	std::vector<ContactHandle4>&& peer_contacts,
+	const ByteSpan initial_state,
+	const ByteSpan sender_hmac,
+	const bool pipelined,
+	const std::optional<ID>& is_digest,
+	const std::vector<ToxKey>* peer_keys
+) {
+	if (peer_contacts.empty()) {
+		return true;
+	}
+
+	if (std::none_of(peer_contacts.cbegin(), peer_contacts.cend(), [](const auto& pc) { return pc.template all_of<Contact::Components::TagSelfStrong>(); })) {
+		// we are not participating, eg a group broadcast
+		return true;
+	}
+
+	if (!remoteQuotaAllows(c)) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: peer has too many generations running, ignoring INIT\n");
+		return true;
+	}
+
+	ID new_gen_id;
+	for (size_t i = 0; i < new_gen_id.size(); i++) {
+		new_gen_id[i] = id[i];
+	}
+
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac;
+	{
+		auto* new_rng_state_ptr = createRngState(new_gen_id, std::move(peer_contacts), initial_state, is_digest, peer_keys);
+		if (new_rng_state_ptr == nullptr) {
+			return true;
+		}
+		RngState& new_rng_state = *new_rng_state_ptr;
+		new_rng_state.pipelined = pipelined;
+		countRemoteSession(new_rng_state, c);
+
+		{ // sender hmac
+			size_t c_idx = 0;
+			if (!new_rng_state.indexOf(c, c_idx)) {
+				// sender not in its own peer list
+				eraseSession(new_gen_id);
+				return true;
+			}
+			new_rng_state.hmacs.set(c_idx, sender_hmac.ptr);
+		}
+		storeSession(new_gen_id, new_rng_state);
+
+		// copy, the state can move while dispatching
+		hmac = new_rng_state.hmacs.at(new_rng_state.self_idx);
+	}
+
+	// fire init event?
+	dispatch(
+		P2PRNG_Event::init,
+		P2PRNG::Events::Init{
+			id,
+			false,
+			initial_state,
+		}
+	);
+
+	// (event handlers might have inserted or evicted, only look things up from here on)
+	auto new_it = _global_map.find(new_gen_id);
+	if (new_it == _global_map.end()) {
+		return true;
+	}
+
+	if (static_cast<bool>(new_it->second.broadcast_group)) {
+		send_hmac(new_it->second.broadcast_group, id, ByteSpan{hmac});
+	} else {
+		for (const auto peer : new_it->second.contacts) {
+			if (peer.all_of<Contact::Components::TagSelfStrong>()) {
+				continue; // skip self
+			}
+			send_hmac(peer, id, ByteSpan{hmac});
+		}
+	}
+
+	// fire hmac event
+	dispatch(
+		P2PRNG_Event::hmac,
+		P2PRNG::Events::HMAC{
+			id,
+			new_it->second.hmacs.count,
+			static_cast<uint16_t>(new_it->second.contacts.size()),
+		}
+	);
+
+	new_it = _global_map.find(new_gen_id);
+	if (new_it == _global_map.end()) {
+		return true;
+	}
+
+	// fun, this is the case in a 1to1
+	checkHaveAllHMACs(&new_it->second, id);
+
+	// not possible, we hare handling INIT_WITH_HMAC here, not with secret
+	//checkHaveAllSecrets(&new_rng_state, id);
+
+	return true;
+}
+
+bool ToxP2PRNG::handle_hmac(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet HMAC\n");
+
+	PkgCodec::Reader r{data};
+
+	ByteSpan hmac;
+	if (!r.span(PkgCodec::hmac_size, hmac)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: HMAC missing from HMAC\n");
+		return false;
+	}
+
+	if (r.remaining() > 0) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: HMAC pkg has extra data!\n");
+	}
+
+	size_t c_idx = 0;
+	auto* rng_state = getRngSate(c, id, c_idx);
+	if (rng_state == nullptr) {
+		return false;
+	}
+
+	// check if preexisting (do nothing)
+	if (rng_state->hmacs.has(c_idx)) {
+		// preexisting
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: HMAC pkg has HMAC we already had!\n");
+		return false;
+	}
+
+	// add and do events
+	rng_state->hmacs.set(c_idx, hmac.ptr);
+	rng_state->touch(_time);
+	storeHMAC(id, false, c_idx, hmac.ptr);
+
+	{ // response time of that peer
+		_key_index.bind(*c.registry()); // noop if already bound, erases the stats once c is destroyed
+		auto& peer_stats = _metrics.peers[c.entity()];
+		const double response_time = _time - rng_state->time_start;
+		peer_stats.c = c.entity();
+		peer_stats.responses++;
+		peer_stats.sum += response_time;
+		peer_stats.max = std::max(peer_stats.max, response_time);
+	}
+
+	// fire update event
+	dispatch(
+		P2PRNG_Event::hmac,
+		P2PRNG::Events::HMAC{
+			id,
+			rng_state->hmacs.count,
+			static_cast<uint16_t>(rng_state->contacts.size()),
+		}
+	);
+
+	// might be the final one we need
+	checkHaveAllHMACs(rng_state, id);
+
+	// :) now the funky part
+	// what if we also already have all secrets (a single hmac was the hold up)
+	checkHaveAllSecrets(rng_state, id);
+
+	return true;
+}
+
+bool ToxP2PRNG::handle_hmac_request(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet HMAC_REQUEST\n");
+
+	if (!data.empty()) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: HMAC_REQUEST pkg has extra data!\n");
+	}
+
+	const auto* rng_state = getRngSate(c, id);
+	if (rng_state == nullptr) {
+		return false;
+	}
+
+	// no state check necessary
+
+	if (!rng_state->hmacs.has(rng_state->self_idx)) {
+		// hmmmmmmmmmm this bad
+		TP2PRNG_LOG(error, session, "hmmmmmmmmmm this bad\n");
+		return false;
+	}
+
+	send_hmac(c, id, ByteSpan{rng_state->hmacs.at(rng_state->self_idx)});
+	return false;
+}
+
+bool ToxP2PRNG::handle_secret(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet SECRET\n");
+
+	PkgCodec::Reader r{data};
+
+	ByteSpan secret_bytes;
+	if (!r.span(PkgCodec::secret_size, secret_bytes)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: SECRET missing from SECRET\n");
+		return false;
+	}
+
+	if (r.remaining() > 0) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: SECRET pkg has extra data!\n");
+	}
+
+	size_t c_idx = 0;
+	auto* rng_state = getRngSate(c, id, c_idx);
+	if (rng_state == nullptr) {
+		return false;
+	}
+
+	// check if preexisting (do nothing)
+	if (rng_state->secrets.has(c_idx)) {
+		// preexisting
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: SECRET pkg has Secret we already had!\n");
+		return true; // mark handled
+	}
+
+	const auto current_phase = rng_state->getState();
+
+	if (current_phase != P2PRNG::State::SECRET) {
+		// arrived early, gets validated once we have all hmacs
+		rng_state->secrets.set(c_idx, secret_bytes.ptr);
+		rng_state->touch(_time);
+		return true;
+	}
+
+	// hmac is only guarrantied to exist if state is correct
+	const auto& pre_hmac = rng_state->hmacs.at(c_idx);
+
+	if (rng_state->secrets_verifying.at(c_idx)) {
+		// a resend while the first one is still being verified
+		return true; // mark handled
+	}
+
+	// pipelined needs the outcome right away, for the commitment that came with the secret
+	// a full queue also gets verified right away, so it can not grow without bound
+	if (_crypto_workers && !rng_state->pipelined && _crypto_workers->inFlight() < g_verify_in_flight_max) {
+		rng_state->secrets_verifying.at(c_idx) = true;
+
+		if (_crypto_workers->inFlight() == 0) {
+			_crypto_progress_time = _time; // busy again, poll fast
+		}
+
+		std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret;
+		std::memcpy(secret.data(), secret_bytes.ptr, secret.size());
+
+		auto verified = std::make_shared<bool>(false);
+		_crypto_workers->submit(
+			[verified, secret, pre_hmac]() {
+				*verified = p2prng_auth_verify(secret.data()+P2PRNG_LEN, pre_hmac.data(), secret.data(), P2PRNG_LEN) == 0;
+			},
+			[this, verified, secret, c, c_idx, gen_id = static_cast<std::vector<uint8_t>>(id)]() {
+				// might have been evicted or completed while verifying
+				size_t cur_c_idx = 0;
+				auto* cur_rng_state = getRngSate(c, ByteSpan{gen_id}, cur_c_idx);
+				if (cur_rng_state != nullptr && cur_c_idx == c_idx) {
+					cur_rng_state->secrets_verifying.at(c_idx) = false;
+				}
+
+				if (!*verified) {
+					reportBadSecret(ByteSpan{gen_id}, c);
+					return;
+				}
+
+				if (cur_rng_state == nullptr || cur_c_idx != c_idx || cur_rng_state->secrets.has(c_idx)) {
+					return;
+				}
+
+				addVerifiedSecret(*cur_rng_state, ByteSpan{gen_id}, c_idx, secret.data());
+			}
+		);
+
+		return true;
+	}
+
+	if (p2prng_auth_verify(secret_bytes.ptr+P2PRNG_LEN, pre_hmac.data(), secret_bytes.ptr, P2PRNG_LEN) != 0) {
+		reportBadSecret(id, c);
+		return true;
+	}
+
+	addVerifiedSecret(*rng_state, id, c_idx, secret_bytes.ptr);
+
+	return true;
+}
+
+void ToxP2PRNG::addVerifiedSecret(RngState& rng_state, const ByteSpan id, const size_t c_idx, const uint8_t* secret) {
+	rng_state.secrets.set(c_idx, secret);
+	rng_state.touch(_time);
+	storeSecret(id, c_idx, secret);
+
+	rng_state.advanceCombine();
+
+	dispatch(
+		P2PRNG_Event::secret,
+		P2PRNG::Events::Secret{
+			id,
+			rng_state.secrets.count,
+			static_cast<uint16_t>(rng_state.contacts.size()),
+		}
+	);
+
+	// might have been last, we might be done
+	checkHaveAllSecrets(&rng_state, id);
+}
+
+void ToxP2PRNG::reportBadSecret(const ByteSpan id, ContactHandle4 c) {
+	_metrics.val_errors.fetch_add(1, std::memory_order_relaxed);
+
+	TP2PRNG_LOG(error, crypto,
+		"########################################\n"
+		<< "TP2PRNG error: bad secret, validation failed!\n"
+		<< "########################################\n"
+	);
+
+	dispatch(
+		P2PRNG_Event::val_error,
+		P2PRNG::Events::ValError{
+			id,
+			c,
+		}
+	);
+}
+
+bool ToxP2PRNG::handle_secret_request(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet SECRET_REQUEST\n");
+
+	if (!data.empty()) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: SECRET_REQUEST pkg has extra data!\n");
+	}
+
+	auto* rng_state = getRngSate(c, id);
+	if (rng_state == nullptr) {
+		return false;
+	}
+
+	// can only request secret if secret or done state
+	if (const auto current_state = rng_state->getState(); !(current_state == P2PRNG::SECRET || current_state == P2PRNG::DONE)) {
+		return false;
+	}
+
+	if (!rng_state->secrets.has(rng_state->self_idx)) {
+		// hmmmmmmmmmm this bad
+		TP2PRNG_LOG(error, session, "hmmmmmmmmmm this bad\n");
+		return false;
+	}
+	const auto& self_secret = rng_state->secrets.at(rng_state->self_idx);
+
+	// SEND secret to c
+	if (rng_state->pipelined && ensureNextCommitment(*rng_state, id)) {
+		send_secret_with_next_hmac(c, id, ByteSpan{self_secret}, ByteSpan{rng_state->next_hmacs.at(rng_state->self_idx)});
+	} else {
+		send_secret(c, id, ByteSpan{self_secret});
+	}
+
+	return true;
+}
+
+enum class SendResult {
+	OK,
+	RETRY, // transient, eg sendq full or peer offline
+	FAIL,
+};
+
+static SendResult sendToxPacket(
+	ToxI& t,
+	ContactHandle4 c,
+	const std::vector<uint8_t>& pkg
+) {
+	// send to friend, group peer or whole group
+	// resolved on every send, peer numbers can change while queued
+	if (const auto* tfe = c.try_get<Contact::Components::ToxFriendEphemeral>(); tfe != nullptr) {
+		switch (t.toxFriendSendLosslessPacket(tfe->friend_number, pkg)) {
+			case TOX_ERR_FRIEND_CUSTOM_PACKET_OK:
+				return SendResult::OK;
+			case TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_CONNECTED:
+			case TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ:
+				return SendResult::RETRY;
+			default:
+				return SendResult::FAIL;
+		}
+	} else if (const auto* tgpe = c.try_get<Contact::Components::ToxGroupPeerEphemeral>(); tgpe != nullptr) {
+		switch (t.toxGroupSendCustomPrivatePacket(tgpe->group_number, tgpe->peer_number, true, pkg)) {
+			case TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK:
+				return SendResult::OK;
+			case TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_PEER_NOT_FOUND:
+			case TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_FAIL_SEND:
+			case TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_DISCONNECTED:
+				return SendResult::RETRY;
+			default:
+				return SendResult::FAIL;
+		}
+	} else if (const auto* tge = c.try_get<Contact::Components::ToxGroupEphemeral>(); tge != nullptr) {
+		switch (t.toxGroupSendCustomPacket(tge->group_number, true, pkg)) {
+			case TOX_ERR_GROUP_SEND_CUSTOM_PACKET_OK:
+				return SendResult::OK;
+			case TOX_ERR_GROUP_SEND_CUSTOM_PACKET_FAIL_SEND:
+			case TOX_ERR_GROUP_SEND_CUSTOM_PACKET_DISCONNECTED:
+				return SendResult::RETRY;
+			default:
+				return SendResult::FAIL;
+		}
+	} else if (c.any_of<Contact::Components::ToxFriendPersistent, Contact::Components::ToxGroupPeerPersistent, Contact::Components::ToxGroupPersistent>()) {
+		// currently not reachable, but might come back
+		return SendResult::RETRY;
+	}
+
+	return SendResult::FAIL;
+}
+
+void ToxP2PRNG::Metrics::countSent(const std::vector<uint8_t>& pkg) {
+	if (pkg.size() < 2) {
+		return;
+	}
+
+	auto& counters = this->pkg(pkg[1]);
+	counters.sent.fetch_add(1, std::memory_order_relaxed);
+	counters.sent_bytes.fetch_add(pkg.size(), std::memory_order_relaxed);
+}
+
+bool ToxP2PRNG::queueSend(ContactHandle4 c, const std::vector<uint8_t>& pkg) {
+	auto queue_it = _send_queues.find(c);
+
+	// fast path, nothing waiting in front of us
+	if (queue_it == _send_queues.end() || queue_it->second.pkgs.empty()) {
+		if (haveSendBudget(c, pkg.size())) {
+			const auto res = sendToxPacket(_t, c, pkg);
+			if (res == SendResult::OK) {
+				_send_queue_stats.sent++;
+				_metrics.countSent(pkg);
+				spendSendBudget(c, pkg.size());
+				return true;
+			} else if (res == SendResult::FAIL) {
+				_send_queue_stats.dropped_error++;
+				_metrics.send_failures.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+	}
+
+	// queue it
+	auto& queue = _send_queues[c];
+	queue.c = c;
+	queue.bytes += pkg.size();
+	queue.pkgs.push_back(_pkg_pool.copy(pkg)); // the callers buffer might get patched for the next recipient
+	_send_queue_stats.deferred++;
+
+	while (queue.bytes > _send_queue_config.max_queued_bytes && !queue.pkgs.empty()) {
+		queue.bytes -= queue.pkgs.front()->size();
+		queue.pkgs.pop_front();
+		_send_queue_stats.dropped_overflow++;
+		_metrics.send_failures.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	return true;
+}
+
+bool ToxP2PRNG::haveSendBudget(Contact4 c, const size_t size) {
+	const auto it = _send_budgets.find(c);
+	if (it == _send_budgets.end()) {
+		return true; // full
+	}
+
+	auto& budget = it->second;
+	const double burst = static_cast<double>(_send_queue_config.burst_bytes);
+	budget.tokens = std::min(burst, budget.tokens + (_time - budget.time) * _send_queue_config.rate_bytes);
+	budget.time = _time;
+
+	// a full bucket lets anything through, so packets larger than the burst dont get stuck
+	return budget.tokens >= static_cast<double>(size) || budget.tokens >= burst;
+}
+
+void ToxP2PRNG::spendSendBudget(Contact4 c, const size_t size) {
+	const auto [it, inserted] = _send_budgets.try_emplace(c);
+	if (inserted) {
+		it->second.tokens = static_cast<double>(_send_queue_config.burst_bytes);
+		it->second.time = _time;
+	}
+	it->second.tokens -= static_cast<double>(size);
+}
+
+void ToxP2PRNG::flushSendQueue(SendQueue& queue) {
+	while (!queue.pkgs.empty()) {
+		auto& pkg = *queue.pkgs.front();
+		if (!haveSendBudget(queue.c.entity(), pkg.size())) {
+			break; // once it refilled
+		}
+
+		const auto res = sendToxPacket(_t, queue.c, pkg);
+		if (res == SendResult::RETRY) {
+			break; // keep order, try again later
+		}
+
+		if (res == SendResult::OK) {
+			_send_queue_stats.sent++;
+			_metrics.countSent(pkg);
+			spendSendBudget(queue.c.entity(), pkg.size());
+		} else {
+			_send_queue_stats.dropped_error++;
+			_metrics.send_failures.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		queue.bytes -= pkg.size();
+		queue.pkgs.pop_front();
+	}
+}
+
+void ToxP2PRNG::flushSendQueues(void) {
+	auto& to_remove = _send_queues_to_remove; // keeps its capacity
+	to_remove.clear();
+	for (auto& [c, queue] : _send_queues) {
+		if (!static_cast<bool>(queue.c)) {
+			// contact is gone
+			_send_queue_stats.dropped_error += queue.pkgs.size();
+			_metrics.send_failures.fetch_add(queue.pkgs.size(), std::memory_order_relaxed);
+			to_remove.push_back(c);
+			continue;
+		}
+
+		flushSendQueue(queue);
+
+		if (queue.pkgs.empty()) {
+			to_remove.push_back(c);
+		}
+	}
+
+	for (const auto c : to_remove) {
+		_send_queues.erase(c);
+	}
+
+	// refilled buckets are the same as none
+	to_remove.clear();
+	for (const auto& [c, budget] : _send_budgets) {
+		if (budget.tokens + (_time - budget.time) * _send_queue_config.rate_bytes >= _send_queue_config.burst_bytes) {
+			to_remove.push_back(c);
+		}
+	}
+	for (const auto c : to_remove) {
+		_send_budgets.erase(c);
+	}
 }
 
-ToxP2PRNG::~ToxP2PRNG(void) {
+size_t ToxP2PRNG::getSendQueueDepth(void) const {
+	size_t depth {0u};
+	for (const auto& [c, queue] : _send_queues) {
+		depth += queue.pkgs.size();
+	}
+	return depth;
 }
 
-std::vector<uint8_t> ToxP2PRNG::newGernation(ContactHandle4 c, const ByteSpan initial_state_user_data) {
-	(void)c;
-	(void)initial_state_user_data;
-	return {};
+size_t ToxP2PRNG::getSendQueueDepth(Contact4 c) const {
+	const auto it = _send_queues.find(c);
+	if (it == _send_queues.cend()) {
+		return 0u;
+	}
+	return it->second.pkgs.size();
 }
 
-std::vector<uint8_t> ToxP2PRNG::newGernationPeers(const std::vector<ContactHandle4>& c_vec, const ByteSpan initial_state_user_data) {
-	if (initial_state_user_data.empty()) {
-		return {};
-	}
+bool ToxP2PRNG::handle_init_with_hmac_bundle(ContactHandle4 c, const ByteSpan bundle_id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet INIT_WITH_HMAC_BUNDLE\n");
 
-	ID new_id{};
+	PkgCodec::Reader r{data};
 
-	// calc size, we are limited by the tox max packet size
-	const size_t peer_key_size = c_vec.size() * ToxKey{}.size();
-	// size currently same for friend and group
-	const size_t init_w_h_pkg_size = 1+1+new_id.size()+sizeof(uint16_t)+peer_key_size+initial_state_user_data.size;
-	//TOX_MAX_CUSTOM_PACKET_SIZE // 1373
-	//TOX_GROUP_MAX_MESSAGE_LENGTH // 1372
-	if (init_w_h_pkg_size > 1372u) {
-		std::cerr << "TP2PRNG error: failed to generate and hmac from is\n";
-		assert(false && "initial state exeeds max size");
-		return {};
+	//   - peerlist (includes sender, determines fusion order)
+	std::vector<ToxKey> peers;
+	if (!readPeerList(r, peers)) {
+		return false;
 	}
 
-	// after size check
-	randombytes(new_id.data(), new_id.size());
+	//   - count
+	uint16_t bundle_size = 0u;
+	if (!r.u16(bundle_size) || bundle_size == 0) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing bundle count\n");
+		return false;
+	}
 
-	// TODO: sanity check all contacts are either friend or group exclusively
+	//   - per generation: sender hmac, is size, is
+	std::vector<ByteSpan> sender_hmacs(bundle_size);
+	std::vector<ByteSpan> initial_states(bundle_size);
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		if (!r.span(PkgCodec::hmac_size, sender_hmacs[i])) {
+			TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing hmac\n");
+			return false;
+		}
 
-	RngState& new_rng_state = _global_map[new_id];
-	new_rng_state.initial_state = std::vector<uint8_t>(initial_state_user_data.cbegin(), initial_state_user_data.cend());
-	new_rng_state.contacts = c_vec;
-	new_rng_state.fillInitalStatePreamble(ByteSpan{new_id}); // could be faster if we used peer_keys directly
+		uint16_t is_size = 0u;
+		if (!r.u16(is_size) || is_size == 0) {
+			TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing initial_state size\n");
+			return false;
+		}
 
-	auto self = new_rng_state.getSelf();
-	if (!static_cast<bool>(self)) {
-		std::cerr << "TP2PRNG error: failed to find self in new gen\n";
-		_global_map.erase(new_id);
-		return {};
+		if (!r.span(is_size, initial_states[i])) {
+			TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing initial_state\n");
+			return false;
+		}
 	}
 
-	std::vector<uint8_t> gen_initial_state = new_rng_state.initial_state_preamble;
-	gen_initial_state.insert(gen_initial_state.cend(), initial_state_user_data.cbegin(), initial_state_user_data.cend());
+	std::vector<ID> gen_ids;
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		gen_ids.push_back(bundleGenID(bundle_id, i));
+	}
 
-	std::array<uint8_t, P2PRNG_MAC_LEN> hmac;
-	std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret;
-	if (p2prng_gen_and_auth(secret.data(), secret.data()+P2PRNG_LEN, hmac.data(), gen_initial_state.data(), gen_initial_state.size()) != 0) {
-		std::cerr << "TP2PRNG error: failed to generate and hmac from is\n";
-		_global_map.erase(new_id);
-		return {};
+	// lets check if bundle already exists, maybe our hmacs got lost
+	const size_t existing = std::count_if(gen_ids.cbegin(), gen_ids.cend(), [this](const ID& gen_id) { return _global_map.contains(gen_id); });
+	if (existing == bundle_size && getRngSate(c, ByteSpan{gen_ids.front()}) != nullptr) {
+		send_hmac_bundle(c, bundle_id, bundle_size);
+		return true; // mark handled
+	} else if (existing != 0u) {
+		// partially there (or not ours), dont clobber
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: INIT_WITH_HMAC_BUNDLE overlaps " << existing << " existing generations, ignoring\n");
+		return true;
 	}
 
-	new_rng_state.hmacs[self] = hmac;
-	new_rng_state.secrets[self] = secret;
+	if (std::any_of(gen_ids.cbegin(), gen_ids.cend(), [this](const ID& gen_id) { return isEvicted(ByteSpan{gen_id}); })) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: INIT_WITH_HMAC_BUNDLE for evicted bundle, ignoring\n");
+		return true;
+	}
 
-	// fire init event?
-	dispatch(
-		P2PRNG_Event::init,
-		P2PRNG::Events::Init{
-			ByteSpan{new_id},
-			true,
-			initial_state_user_data,
-		}
-	);
+	auto peer_contacts = resolvePeers(c, peers);
+	if (peer_contacts.empty()) {
+		return true;
+	}
 
-	// TODO: queue
-	// TODO: record result
-	for (const auto peer : new_rng_state.contacts) {
-		if (peer.all_of<Contact::Components::TagSelfStrong>()) {
-			continue; // skip self
-		}
-		// TODO: record send success
-		send_init_with_hmac(peer, ByteSpan{new_id}, new_rng_state.contacts, initial_state_user_data, ByteSpan{hmac});
+	if (std::none_of(peer_contacts.cbegin(), peer_contacts.cend(), [](const auto& pc) { return pc.template all_of<Contact::Components::TagSelfStrong>(); })) {
+		// we are not participating, eg a group broadcast
+		return true;
 	}
 
-	// fire hmac event
-	dispatch(
-		P2PRNG_Event::hmac,
-		P2PRNG::Events::HMAC{
-			ByteSpan{new_id},
-			static_cast<uint16_t>(new_rng_state.hmacs.size()),
-			static_cast<uint16_t>(new_rng_state.contacts.size()),
-		}
-	);
+	ID bundle_id_arr;
+	for (size_t i = 0; i < bundle_id_arr.size(); i++) {
+		bundle_id_arr[i] = bundle_id[i];
+	}
 
-	return std::vector<uint8_t>(new_id.cbegin(), new_id.cend());
-}
+	if (!remoteQuotaAllows(c, bundle_size)) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: peer has too many generations running, ignoring INIT_WITH_HMAC_BUNDLE\n");
+		return true;
+	}
 
-P2PRNG::State ToxP2PRNG::getSate(const ByteSpan id_bytes) {
-	if (id_bytes.size != ID{}.size()) {
-		return P2PRNG::State::UNKNOWN;
+	// room for the whole bundle up front, so creating a member cant evict another one
+	if (!enforceSessionCap(bundle_size)) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: INIT_WITH_HMAC_BUNDLE larger than the session cap, ignoring\n");
+		return true;
 	}
 
-	ID r_id{};
-	{ // building the id is very annoying, should have not used array?
-		// TODO: provide custom comperator ?
-		for (size_t i = 0; i < r_id.size(); i++) {
-			r_id[i] = id_bytes[i];
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		auto* new_rng_state = createRngState(gen_ids.at(i), std::vector<ContactHandle4>{peer_contacts}, initial_states.at(i), std::nullopt, &peers, false);
+		if (new_rng_state == nullptr) {
+			for (uint16_t j = 0; j < i; j++) {
+				eraseSession(gen_ids.at(j));
+			}
+			return true;
+		}
+		new_rng_state->bundle_id = bundle_id_arr;
+		new_rng_state->bundle_size = bundle_size;
+		countRemoteSession(*new_rng_state, c);
+
+		// sender hmac
+		size_t c_idx = 0;
+		if (!new_rng_state->indexOf(c, c_idx)) {
+			for (uint16_t j = 0; j <= i; j++) {
+				eraseSession(gen_ids.at(j));
+			}
+			return true;
 		}
+		new_rng_state->hmacs.set(c_idx, sender_hmacs.at(i).ptr);
 	}
 
-	const auto find_it = _global_map.find(r_id);
-	if (find_it == _global_map.cend()) {
-		return P2PRNG::State::UNKNOWN;
-	} else {
-		return find_it->second.getState();
+	for (const auto& gen_id : gen_ids) {
+		storeSession(gen_id, _global_map.at(gen_id));
 	}
-}
 
-ByteSpan ToxP2PRNG::getResult(const ByteSpan id_bytes) {
-	if (id_bytes.size != ID{}.size()) {
-		return {};
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		dispatch(
+			P2PRNG_Event::init,
+			P2PRNG::Events::Init{
+				ByteSpan{gen_ids.at(i)},
+				false,
+				initial_states.at(i),
+			}
+		);
 	}
 
-	ID r_id{};
-	{ // building the id is very annoying, should have not used array?
-		// TODO: provide custom comperator ?
-		for (size_t i = 0; i < r_id.size(); i++) {
-			r_id[i] = id_bytes[i];
-		}
+	// (event handlers might have inserted or evicted, only look things up from here on)
+	const auto first_it = _global_map.find(gen_ids.front());
+	if (first_it == _global_map.end()) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: bundle gone before hmacs were sent\n");
+		return true;
 	}
 
-	const auto find_it = _global_map.find(r_id);
-	if (find_it == _global_map.cend()) {
-		return {};
+	const auto& first = first_it->second;
+	if (static_cast<bool>(first.broadcast_group)) {
+		send_hmac_bundle(first.broadcast_group, bundle_id, bundle_size);
 	} else {
-		return ByteSpan{find_it->second.final_result};
+		for (const auto peer : first.contacts) {
+			if (peer.all_of<Contact::Components::TagSelfStrong>()) {
+				continue; // skip self
+			}
+			send_hmac_bundle(peer, bundle_id, bundle_size);
+		}
 	}
-}
 
-bool ToxP2PRNG::handlePacket(
-	ContactHandle4 c,
-	PKG pkg_type,
-	ByteSpan data
-) {
-	if (data.size < 1) {
-		return false; // waht
-	}
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		const auto it = _global_map.find(gen_ids.at(i));
+		if (it == _global_map.end()) {
+			continue;
+		}
+		auto* rng_state = &it->second;
+
+		dispatch(
+			P2PRNG_Event::hmac,
+			P2PRNG::Events::HMAC{
+				ByteSpan{gen_ids.at(i)},
+				rng_state->hmacs.count,
+				static_cast<uint16_t>(rng_state->contacts.size()),
+			}
+		);
 
-	// rn all are prefixed with ID, so here we go
-	if (data.size < 32) {
-		std::cerr << "TP2PRNG error: packet without id\n";
-		return false;
+		// fun, this is the case in a 1to1
+		checkHaveAllHMACs(rng_state, ByteSpan{gen_ids.at(i)});
 	}
 
-	ByteSpan id{data.ptr, 32};
+	return true;
+}
 
-	switch (pkg_type) {
-		case PKG::INIT_WITH_HMAC:
-			return handle_init_with_hmac(c, id, {data.ptr+32, data.size-(32)});
-		case PKG::HMAC:
-			return handle_hmac(c, id, {data.ptr+32, data.size-(32)});
-		case PKG::HMAC_REQUEST:
-			return handle_hmac_request(c, id, {data.ptr+32, data.size-(32)});
-		case PKG::SECRET:
-			return handle_secret(c, id, {data.ptr+32, data.size-(32)});
-		case PKG::SECRET_REQUEST:
-			return handle_secret_request(c, id, {data.ptr+32, data.size-(32)});
-		default:
-			return false;
-	}
+bool ToxP2PRNG::handle_hmac_bundle(ContactHandle4 c, const ByteSpan bundle_id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet HMAC_BUNDLE\n");
 
-	return false;
-}
+	PkgCodec::Reader r{data};
 
-bool ToxP2PRNG::handleFriendPacket(
-	const uint32_t friend_number,
-	ByteSpan data
-) {
-	// packet id + packet id + id
-	if (data.size < 1+1+32) {
+	uint16_t bundle_size = 0u;
+	if (!r.u16(bundle_size)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing bundle count\n");
 		return false;
 	}
 
-	if (data[0] != TOX_PKG_ID_FRIEND) {
+	// all or nothing
+	if (r.remaining() < size_t(bundle_size) * PkgCodec::hmac_size) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing hmacs\n");
 		return false;
 	}
 
-	PKG tpr_pkg_type = static_cast<PKG>(data[1]);
-
-	auto c = _tcm.getContactFriend(friend_number);
-	if (!static_cast<bool>(c)) {
-		return false;
+	// same as individual hmacs
+	bool handled = false;
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		ByteSpan hmac;
+		r.span(PkgCodec::hmac_size, hmac);
+		const auto gen_id = bundleGenID(bundle_id, i);
+		handled = handle_hmac(c, ByteSpan{gen_id}, hmac) || handled;
 	}
 
-	return handlePacket(c, tpr_pkg_type, {data.ptr+2, data.size-2});
+	return handled;
 }
 
-bool ToxP2PRNG::handleGroupPacket(
-	const uint32_t group_number,
-	const uint32_t peer_number,
-	ByteSpan data,
-	const bool /*_private*/
-) {
-	// packet id + packet id + id
-	if (data.size < 1+1+32) {
+bool ToxP2PRNG::handle_secret_bundle(ContactHandle4 c, const ByteSpan bundle_id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet SECRET_BUNDLE\n");
+
+	PkgCodec::Reader r{data};
+
+	uint16_t bundle_size = 0u;
+	if (!r.u16(bundle_size)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing bundle count\n");
 		return false;
 	}
 
-	if (data[0] != TOX_PKG_ID_GROUP) {
+	// all or nothing
+	if (r.remaining() < size_t(bundle_size) * PkgCodec::secret_size) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing secrets\n");
 		return false;
 	}
 
-	PKG tpr_pkg_type = static_cast<PKG>(data[1]);
-
-	auto c = _tcm.getContactGroupPeer(group_number, peer_number);
-	if (!static_cast<bool>(c)) {
-		return false;
+	// same as individual secrets
+	bool handled = false;
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		ByteSpan secret;
+		r.span(PkgCodec::secret_size, secret);
+		const auto gen_id = bundleGenID(bundle_id, i);
+		handled = handle_secret(c, ByteSpan{gen_id}, secret) || handled;
 	}
 
-	return handlePacket(c, tpr_pkg_type, {data.ptr+2, data.size-2});
+	return handled;
 }
 
-#define _DATA_HAVE(x, error) if ((data.size - curser) < (x)) { error; }
+bool ToxP2PRNG::handle_secret_with_next_hmac(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet SECRET_WITH_NEXT_HMAC\n");
 
-bool ToxP2PRNG::handle_init_with_hmac(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
-	std::cerr << "TP2PRNG: got packet INIT_WITH_HMAC\n";
+	PkgCodec::Reader r{data};
 
-	if (data.size  < sizeof(uint16_t) + ToxKey{}.size() + 1) {
-		// bare minimum size is a single peer with 1byte IS
-		std::cerr << "TP2PRNG error: INIT_WITH_HMAC too small\n";
+	ByteSpan secret;
+	ByteSpan next_hmac;
+	if (!r.span(PkgCodec::secret_size, secret) || !r.span(PkgCodec::hmac_size, next_hmac)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: SECRET_WITH_NEXT_HMAC too small\n");
 		return false;
 	}
 
-	size_t curser = 0;
+	if (r.remaining() > 0) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: SECRET_WITH_NEXT_HMAC pkg has extra data!\n");
+	}
 
-	//   - peerlist (includes sender, determines fusion order)
-	// first numer of peers
-	uint16_t peer_count = 0u;
-	_DATA_HAVE(sizeof(peer_count), std::cerr << "TP2PRNG error: packet too small, missing peer_count\n"; return false)
-	for (size_t i = 0; i < sizeof(peer_count); i++, curser++) {
-		peer_count |= uint32_t(data[curser]) << (i*8);
+	size_t c_idx = 0;
+	auto* rng_state = getRngSate(c, id, c_idx);
+	if (rng_state == nullptr) {
+		return false;
 	}
 
-	// then the peers
-	_DATA_HAVE(peer_count * ToxKey{}.size(), std::cerr << "TP2PRNG error: packet too small, missing peers\n"; return false)
-	std::vector<ToxKey> peers;
-	for (size_t peer_i = 0; peer_i < peer_count; peer_i++) {
-		auto& new_peer = peers.emplace_back();
-		for (size_t i = 0; i < new_peer.size(); i++, curser++) {
-			new_peer.data[i] = data[curser];
-		}
+	if (!rng_state->pipelined) {
+		// nothing to commit to
+		return handle_secret(c, id, secret);
 	}
 
-	// then the senders hmac
-	if (data.size - curser <= P2PRNG_MAC_LEN) {
-		std::cerr << "TP2PRNG error: packet too small, missing hmac and initial_state\n";
-		return false;
+	// store first, the done event might want to chain right away
+	const bool had_next_hmac = rng_state->next_hmacs.has(c_idx);
+	if (!had_next_hmac) {
+		rng_state->next_hmacs.set(c_idx, next_hmac.ptr);
 	}
-	const ByteSpan sender_hmac {data.ptr + curser, P2PRNG_MAC_LEN};
-	curser += P2PRNG_MAC_LEN;
 
-	if (data.size - curser <= 0) {
-		std::cerr << "TP2PRNG error: packet too small, missing initial_state\n";
-		return false;
+	const bool ret = handle_secret(c, id, secret);
+
+	// events could have added generations, look up again
+	rng_state = getRngSate(c, id);
+	if (rng_state == nullptr || had_next_hmac) {
+		return ret;
 	}
 
-	const ByteSpan initial_state {data.ptr + curser, data.size - curser};
+	if (!rng_state->secrets.has(c_idx)) {
+		// secret was rejected, so is the commitment that came with it
+		rng_state->next_hmacs.erase(c_idx);
+		return ret;
+	}
+	// only restored together with a verified secret
+	storeHMAC(id, true, c_idx, rng_state->next_hmacs.at(c_idx).data());
+
+	if (rng_state->next_id.has_value()) {
+		// late commitment, the chained generation is already running without it
+		const ID next_id = rng_state->next_id.value();
+		size_t next_c_idx = 0;
+		auto* next_rng_state = getRngSate(c, ByteSpan{next_id}, next_c_idx);
+		if (next_rng_state != nullptr && !next_rng_state->hmacs.has(next_c_idx)) {
+			next_rng_state->hmacs.set(next_c_idx, rng_state->next_hmacs.at(c_idx));
+			next_rng_state->touch(_time);
+			storeHMAC(ByteSpan{next_id}, false, next_c_idx, rng_state->next_hmacs.at(c_idx).data());
 
-	// lets check if id already exists (after parse, so they cant cheap out)
-	if (const auto* rng_state = getRngSate(c, id); rng_state != nullptr) {
-		// we already know this maybe we did not send hmac or it got lost
+			dispatch(
+				P2PRNG_Event::hmac,
+				P2PRNG::Events::HMAC{
+					ByteSpan{next_id},
+					next_rng_state->hmacs.count,
+					static_cast<uint16_t>(next_rng_state->contacts.size()),
+				}
+			);
 
-		auto self = rng_state->getSelf();
-		if (!static_cast<bool>(self)) {
-			std::cerr << "uh wtf\n";
-			return true;
+			checkHaveAllHMACs(next_rng_state, ByteSpan{next_id});
+			checkHaveAllSecrets(next_rng_state, ByteSpan{next_id});
 		}
+	}
 
-		auto hmac_it = rng_state->hmacs.find(self);
-		if (hmac_it == rng_state->hmacs.cend()) {
-			std::cerr << "uh wtf, bad bad\n";
-			return true;
-		}
+	return ret;
+}
 
-		send_hmac(c, id, ByteSpan{hmac_it->second});
+bool ToxP2PRNG::handle_init_chained(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet INIT_CHAINED\n");
 
-		return true; // mark handled
+	PkgCodec::Reader r{data};
+
+	ByteSpan prev_id_bytes;
+	// secret and next hmac, same layout as SECRET_WITH_NEXT_HMAC
+	ByteSpan secret_with_next_hmac;
+	if (!r.span(PkgCodec::id_size, prev_id_bytes) || !r.span(PkgCodec::secret_size + PkgCodec::hmac_size, secret_with_next_hmac)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: INIT_CHAINED too small\n");
+		return false;
 	}
 
-	// else, its new
-	// first resolve peer keys to contacts
-	std::vector<ContactHandle4> peer_contacts;
-	if (c.all_of<Contact::Components::ToxFriendEphemeral>()) {
-		// assuming a 1to1 can only have 2 peers
-		assert(peers.size() == 2);
-		for (const auto& peer_key : peers) {
-			// TODO: accel lookup
-			for (const auto& [find_c, tfp] : c.registry()->view<Contact::Components::ToxFriendPersistent>().each()) {
-				if (tfp.key == peer_key) {
-					peer_contacts.push_back(ContactHandle4{*c.registry(), find_c});
-					break;
-				}
-			}
-		}
-		if (peer_contacts.size() != peers.size()) {
-			std::cerr << "TP2PRNG error: not all peers in peer list could be resolved to contacts\n";
-			return true;
-		}
-	} else if (c.all_of<Contact::Components::ToxGroupPeerEphemeral>()) {
-		for (const auto& peer_key : peers) {
-			// TODO: accel lookup
-			for (const auto& [find_c, tgpp] : c.registry()->view<Contact::Components::ToxGroupPeerPersistent>().each()) {
-				if (tgpp.peer_key == peer_key) {
-					peer_contacts.push_back(ContactHandle4{*c.registry(), find_c});
-					break;
-				}
-			}
-		}
-		if (peer_contacts.size() != peers.size()) {
-			std::cerr << "TP2PRNG error: not all peers in peer list could be resolved to contacts\n";
-			return true;
+	const ByteSpan initial_state = r.rest();
+	if (initial_state.empty()) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: INIT_CHAINED too small\n");
+		return false;
+	}
+
+	if (auto* rng_state = getRngSate(c, id); rng_state != nullptr) {
+		// repeated, our secret might have gotten lost
+		const auto self_idx = rng_state->self_idx;
+		if (rng_state->secret_sent && rng_state->secrets.has(self_idx) && rng_state->next_hmacs.has(self_idx)) {
+			send_secret_with_next_hmac(c, id, ByteSpan{rng_state->secrets.at(self_idx)}, ByteSpan{rng_state->next_hmacs.at(self_idx)});
 		}
-	} else {
-		// yooo how did we get here
-		assert(false);
+		return true; // mark handled
+	}
+
+	if (isEvicted(id)) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: INIT_CHAINED for evicted generation, ignoring\n");
 		return true;
 	}
 
+	// sender has to take part in prev
+	if (getRngSate(c, prev_id_bytes) == nullptr) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: INIT_CHAINED for unknown generation\n");
+		return false;
+	}
+
 	ID new_gen_id;
+	ID prev_id;
 	for (size_t i = 0; i < new_gen_id.size(); i++) {
 		new_gen_id[i] = id[i];
+		prev_id[i] = prev_id_bytes[i];
 	}
 
-	RngState& new_rng_state = _global_map[new_gen_id];
-	new_rng_state.initial_state = std::vector<uint8_t>(initial_state.cbegin(), initial_state.cend());
-	new_rng_state.contacts = std::move(peer_contacts);
-	new_rng_state.fillInitalStatePreamble(id); // could be faster if we used peer_keys directly
-
-	auto self = new_rng_state.getSelf();
-	if (!static_cast<bool>(self)) {
-		std::cerr << "TP2PRNG error: failed to find self in new gen\n";
-		_global_map.erase(new_gen_id);
+	if (!remoteQuotaAllows(c)) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: peer has too many generations running, ignoring INIT_CHAINED\n");
 		return true;
 	}
 
-	std::vector<uint8_t> gen_initial_state = new_rng_state.initial_state_preamble;
-	gen_initial_state.insert(gen_initial_state.cend(), initial_state.cbegin(), initial_state.cend());
-
-	std::array<uint8_t, P2PRNG_MAC_LEN> hmac;
-	std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret;
-	if (p2prng_gen_and_auth(secret.data(), secret.data()+P2PRNG_LEN, hmac.data(), gen_initial_state.data(), gen_initial_state.size()) != 0) {
-		std::cerr << "TP2PRNG error: failed to generate and hmac from is\n";
-		_global_map.erase(new_gen_id);
+	if (const auto prev_it = _global_map.find(prev_id); prev_it != _global_map.end() && prev_it->second.next_id.has_value()) {
+		// chained at the same time as someone else (or again)
+		const ID chained_id = prev_it->second.next_id.value();
+		resolveChainConflict(prev_id, chained_id, new_gen_id);
 		return true;
 	}
 
-	new_rng_state.hmacs[self] = hmac;
-	new_rng_state.secrets[self] = secret;
-
-	{ // sender hmac
-		auto& hmac_entry = new_rng_state.hmacs[c];
-		for (size_t i = 0; i < hmac_entry.size(); i++) {
-			hmac_entry[i] = sender_hmac[i];
+	{
+		auto* new_rng_state_ptr = createChainedRngState(new_gen_id, prev_id, initial_state);
+		if (new_rng_state_ptr == nullptr) {
+			return true;
 		}
+		countRemoteSession(*new_rng_state_ptr, c);
+		storeSession(new_gen_id, *new_rng_state_ptr);
 	}
 
-	// fire init event?
 	dispatch(
 		P2PRNG_Event::init,
 		P2PRNG::Events::Init{
@@ -641,290 +3587,382 @@ bool ToxP2PRNG::handle_init_with_hmac(ContactHandle4 c, const ByteSpan id, ByteS
 		}
 	);
 
-	for (const auto peer : new_rng_state.contacts) {
-		if (peer.all_of<Contact::Components::TagSelfStrong>()) {
-			continue; // skip self
-		}
-		// TODO: queue
-		// TODO: record send success
-		send_hmac(peer, id, ByteSpan{hmac});
+	// (event handlers might have inserted or evicted, only look things up from here on)
+	auto new_it = _global_map.find(new_gen_id);
+	if (new_it == _global_map.end()) {
+		return true;
 	}
 
-	// fire hmac event
 	dispatch(
 		P2PRNG_Event::hmac,
 		P2PRNG::Events::HMAC{
 			id,
-			static_cast<uint16_t>(new_rng_state.hmacs.size()),
-			static_cast<uint16_t>(new_rng_state.contacts.size()),
+			new_it->second.hmacs.count,
+			static_cast<uint16_t>(new_it->second.contacts.size()),
+		}
+	);
+
+	new_it = _global_map.find(new_gen_id);
+	if (new_it == _global_map.end()) {
+		return true;
+	}
+
+	// sends our secret, if all commitments made it
+	checkHaveAllHMACs(&new_it->second, id);
+
+	return handle_secret_with_next_hmac(c, id, secret_with_next_hmac);
+}
+
+void ToxP2PRNG::resolveChainConflict(const ID& prev_id, const ID& chained_id, const ID& new_id) {
+	TP2PRNG_LOG(warn, session, "TP2PRNG warning: " << bin2hex(ByteSpan{prev_id}) << " got chained twice, dropping " << bin2hex(ByteSpan{new_id}) << "\n");
+	_eviction_stats.chain_conflict++;
+
+	// the second chain never replaces the first, its sender could have held back
+	// its own secret and picked the init after seeing the ones revealed for the first
+	addTombstone(new_id);
+
+	dispatch(
+		P2PRNG_Event::chain_conflict,
+		P2PRNG::Events::ChainConflict{
+			ByteSpan{new_id},
+			ByteSpan{prev_id},
+			ByteSpan{},
+		}
+	);
+
+	// dispatch might have changed the map
+	const auto chained_it = _global_map.find(chained_id);
+	if (chained_it == _global_map.end() || chained_it->second.getState() == P2PRNG::DONE) {
+		return;
+	}
+
+	// the sender of the second one drops ours the same way, so it will never send its secret
+	abandonChained(chained_id);
+}
+
+void ToxP2PRNG::abandonChained(const ID& id) {
+	std::vector<ContactHandle4> contacts;
+	std::vector<uint8_t> initial_state;
+	ID prev_id;
+	bool ours {false};
+
+	{ // copy out, the fresh generation inserts
+		const auto it = _global_map.find(id);
+		if (it == _global_map.end() || !it->second.chained_from.has_value()) {
+			return;
+		}
+		const auto& rng_state = it->second;
+
+		contacts = rng_state.contacts;
+		const auto is = rng_state.getInitialState();
+		initial_state.assign(is.cbegin(), is.cend());
+		prev_id = rng_state.chained_from.value();
+		ours = rng_state.self_initiated;
+	}
+
+	// prev keeps its next_id, so the revealed commitments are never used again
+	storeEnd(id);
+	eraseSession(id);
+	addTombstone(id);
+
+	std::vector<uint8_t> fallback_id;
+	if (ours) {
+		fallback_id = startGeneration(contacts, ByteSpan{initial_state}, true);
+	}
+
+	dispatch(
+		P2PRNG_Event::chain_conflict,
+		P2PRNG::Events::ChainConflict{
+			ByteSpan{id},
+			ByteSpan{prev_id},
+			ByteSpan{fallback_id},
 		}
 	);
+}
+
+bool ToxP2PRNG::handle_init_with_hmac_digest(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet INIT_WITH_HMAC_DIGEST\n");
+
+	PkgCodec::Reader r{data};
+
+	//   - flags
+	//   - blob size
+	//   - blob digest
+	//   - sender hmac
+	uint8_t flags = 0u;
+	uint32_t blob_size = 0u;
+	ByteSpan blob_digest;
+	ByteSpan sender_hmac;
+	if (
+		!r.u8(flags) ||
+		!r.u32(blob_size) ||
+		!r.span(PkgCodec::id_size, blob_digest) ||
+		!r.span(PkgCodec::hmac_size, sender_hmac)
+	) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: INIT_WITH_HMAC_DIGEST too small\n");
+		return false;
+	}
 
-	// fun, this is the case in a 1to1
-	checkHaveAllHMACs(&new_rng_state, id);
+	if (r.remaining() > 0) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: INIT_WITH_HMAC_DIGEST pkg has extra data!\n");
+	}
 
-	// not possible, we hare handling INIT_WITH_HMAC here, not with secret
-	//checkHaveAllSecrets(&new_rng_state, id);
+	const bool pipelined = (flags & 0x01) != 0;
 
-	return true;
-}
+	// lets check if id already exists
+	if (const auto* rng_state = getRngSate(c, id); rng_state != nullptr) {
+		// we already know this maybe we did not send hmac or it got lost
+		if (rng_state->hmacs.has(rng_state->self_idx)) {
+			send_hmac(c, id, ByteSpan{rng_state->hmacs.at(rng_state->self_idx)});
+		}
 
-bool ToxP2PRNG::handle_hmac(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
-	std::cerr << "TP2PRNG: got packet HMAC\n";
+		return true; // mark handled
+	}
 
-	if (data.size < P2PRNG_MAC_LEN) {
-		std::cerr << "TP2PRNG error: HMAC missing from HMAC\n";
-		return false;
+	if (isEvicted(id)) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: INIT_WITH_HMAC_DIGEST for evicted generation, ignoring\n");
+		return true;
 	}
 
-	ByteSpan hmac {data.ptr, P2PRNG_MAC_LEN};
+	ID gen_id;
+	for (size_t i = 0; i < gen_id.size(); i++) {
+		gen_id[i] = id[i];
+	}
 
-	if (data.size > hmac.size) {
-		std::cerr << "TP2PRNG warning: HMAC pkg has extra data!\n";
+	if (_pending_inits.contains(gen_id)) {
+		// repeated, the fragments fill the gaps
+		return true;
 	}
 
-	auto* rng_state = getRngSate(c, id);
-	if (rng_state == nullptr) {
+	if (blob_size == 0u || blob_size > g_init_blob_max) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: INIT_WITH_HMAC_DIGEST blob size out of range\n");
 		return false;
 	}
 
-	// check if preexisting (do nothing)
-	auto hmac_it = rng_state->hmacs.find(c);
-	if (hmac_it != rng_state->hmacs.cend()) {
-		// preexisting
-		std::cerr << "TP2PRNG warning: HMAC pkg has HMAC we already had!\n";
-		return false;
+	if (_pending_inits.size() >= g_pending_inits_max) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: too many pending inits, ignoring\n");
+		return true;
 	}
 
-	// add and do events
-	auto& hmac_record = rng_state->hmacs[c];
-	for (size_t i = 0; i < P2PRNG_MAC_LEN; i++) {
-		hmac_record[i] = hmac[i];
+	// so a single peer cant take all of them
+	const size_t from_sender = std::count_if(_pending_inits.cbegin(), _pending_inits.cend(), [c](const auto& it) { return it.second.c == c; });
+	if (from_sender >= g_pending_inits_per_peer_max) {
+		TP2PRNG_LOG(warn, proto, "TP2PRNG warning: too many pending inits from this peer, ignoring\n");
+		return true;
 	}
 
-	// fire update event
-	dispatch(
-		P2PRNG_Event::hmac,
-		P2PRNG::Events::HMAC{
-			id,
-			static_cast<uint16_t>(rng_state->hmacs.size()),
-			static_cast<uint16_t>(rng_state->contacts.size()),
-		}
-	);
+	auto& pending = _pending_inits[gen_id];
+	pending.c = c;
+	pending.pipelined = pipelined;
+	pending.time = _time;
 
-	// might be the final one we need
-	checkHaveAllHMACs(rng_state, id);
+	std::memcpy(pending.digest.data(), blob_digest.ptr, pending.digest.size());
+	std::memcpy(pending.sender_hmac.data(), sender_hmac.ptr, pending.sender_hmac.size());
 
-	// :) now the funky part
-	// what if we also already have all secrets (a single hmac was the hold up)
-	checkHaveAllSecrets(rng_state, id);
+	pending.blob_size = blob_size;
+	pending.fragments_missing = (blob_size + g_init_fragment_size - 1) / g_init_fragment_size;
+	pending.have_fragments.resize(pending.fragments_missing, false);
 
 	return true;
 }
 
-bool ToxP2PRNG::handle_hmac_request(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
-	std::cerr << "TP2PRNG: got packet HMAC_REQUEST\n";
-
-	if (!data.empty()) {
-		std::cerr << "TP2PRNG warning: HMAC_REQUEST pkg has extra data!\n";
+bool ToxP2PRNG::PendingInit::havePeerList(void) const {
+	if (have_fragments.empty() || !have_fragments.front()) {
+		return false; // count is in the first one
 	}
 
-	const auto* rng_state = getRngSate(c, id);
-	if (rng_state == nullptr) {
+	PkgCodec::Reader r{ByteSpan{blob}};
+	uint16_t count = 0u;
+	if (!r.u16(count)) {
 		return false;
 	}
 
-	// no state check necessary
+	const size_t list_end = std::min(PkgCodec::peerListSize(count), blob.size());
+	for (size_t i = 0; i*g_init_fragment_size < list_end; i++) {
+		if (!have_fragments.at(i)) {
+			return false;
+		}
+	}
+
+	return true;
+}
 
-	// find self contact
-	ContactHandle4 self = rng_state->getSelf();
+bool ToxP2PRNG::handle_init_fragment(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	//TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet INIT_FRAGMENT\n");
 
-	if (!static_cast<bool>(self)) {
-		std::cerr << "TP2PRNG error: failed to look up self\n";
-		return false;
-	}
+	PkgCodec::Reader r{data};
 
-	auto self_hmac_it = rng_state->hmacs.find(self);
-	if (self_hmac_it == rng_state->hmacs.cend()) {
-		// hmmmmmmmmmm this bad
-		std::cerr << "hmmmmmmmmmm this bad\n";
+	//   - offset
+	//   - blob bytes
+	uint32_t offset = 0u;
+	if (!r.u32(offset)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: INIT_FRAGMENT too small\n");
 		return false;
 	}
+	const ByteSpan fragment = r.rest();
 
-	// TODO: queue these instead
-	// TODO: record send success
-	send_hmac(c, id, ByteSpan{self_hmac_it->second});
-	return false;
-}
+	ID gen_id;
+	for (size_t i = 0; i < gen_id.size(); i++) {
+		gen_id[i] = id[i];
+	}
 
-bool ToxP2PRNG::handle_secret(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
-	std::cerr << "TP2PRNG: got packet SECRET\n";
+	const auto pending_it = _pending_inits.find(gen_id);
+	if (pending_it == _pending_inits.end()) {
+		// late repeat of an init we already have
+		return _global_map.contains(gen_id);
+	}
+	auto& pending = pending_it->second;
 
-	if (data.size < P2PRNG_LEN + P2PRNG_MAC_KEY_LEN) {
-		std::cerr << "TP2PRNG error: SECRET missing from SECRET\n";
+	if (pending.c != c) {
+		// only the initiator can fill in
 		return false;
 	}
 
-	if (data.size > P2PRNG_LEN + P2PRNG_MAC_KEY_LEN) {
-		std::cerr << "TP2PRNG warning: SECRET pkg has extra data!\n";
+	if (offset % g_init_fragment_size != 0 || offset >= pending.blob_size) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: INIT_FRAGMENT bad offset\n");
+		return false;
 	}
 
-	auto* rng_state = getRngSate(c, id);
-	if (rng_state == nullptr) {
+	const size_t fragment_index = offset / g_init_fragment_size;
+	const size_t fragment_size = std::min(g_init_fragment_size, pending.blob_size - offset);
+	if (fragment.size != fragment_size) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: INIT_FRAGMENT bad size\n");
 		return false;
 	}
 
-	// check if preexisting (do nothing)
-	auto secret_it = rng_state->secrets.find(c);
-	if (secret_it != rng_state->secrets.cend()) {
-		// preexisting
-		std::cerr << "TP2PRNG warning: SECRET pkg has Secret we already had!\n";
-		return true; // mark handled
+	if (pending.have_fragments.at(fragment_index)) {
+		return true; // dup
 	}
 
-	const auto current_phase = rng_state->getState();
-
-	if (current_phase == P2PRNG::State::SECRET) { // validate if state correct
-		const ByteSpan msg {data.ptr, P2PRNG_LEN};
-		const ByteSpan key {data.ptr+P2PRNG_LEN, P2PRNG_MAC_KEY_LEN};
+	// not on the digest, that alone is cheap to send
+	if (pending.blob.empty()) {
+		pending.blob.resize(pending.blob_size);
+	}
 
-		// hmac is only guarrantied to exist if state is correct
-		const auto& pre_hmac = rng_state->hmacs.at(c);
-		if (p2prng_auth_verify(key.ptr, pre_hmac.data(), msg.ptr, msg.size) != 0) {
-			// bad secret
-			std::cerr
-				<< "########################################\n"
-				<< "TP2PRNG error: bad secret, validation failed!\n"
-				<< "########################################\n"
-			;
+	std::memcpy(pending.blob.data()+offset, fragment.ptr, fragment.size);
+	pending.have_fragments.at(fragment_index) = true;
+	pending.fragments_missing--;
 
-			dispatch(
-				P2PRNG_Event::val_error,
-				P2PRNG::Events::ValError{
-					id,
-					c,
-				}
-			);
+	// group members that are not participating dont need to buffer the rest
+	if (!pending.peers_checked && pending.havePeerList()) {
+		PkgCodec::Reader blob_r{ByteSpan{pending.blob}};
+		std::vector<ToxKey> peers;
+		if (!readPeerList(blob_r, peers)) {
+			_pending_inits.erase(pending_it);
+			return true;
+		}
 
+		const auto peer_contacts = resolvePeers(c, peers);
+		if (std::none_of(peer_contacts.cbegin(), peer_contacts.cend(), [](const auto& pc) { return pc.template all_of<Contact::Components::TagSelfStrong>(); })) {
+			TP2PRNG_LOG(debug, proto, "TP2PRNG: digest init without us, dropping it\n");
+			_pending_inits.erase(pending_it);
 			return true;
 		}
+		pending.peers_checked = true;
 	}
 
-	// add
-	auto& secret_record = rng_state->secrets[c];
-	for (size_t i = 0; i < P2PRNG_LEN + P2PRNG_MAC_KEY_LEN; i++) {
-		secret_record[i] = data[i];
+	if (pending.fragments_missing > 0) {
+		return true;
 	}
 
-	if (current_phase != P2PRNG::State::SECRET) {
-		// arrived early
+	// complete
+	PendingInit done = std::move(pending);
+	_pending_inits.erase(pending_it);
+
+	ID blob_digest;
+	crypto_generichash(blob_digest.data(), blob_digest.size(), done.blob.data(), done.blob.size(), nullptr, 0);
+	if (blob_digest != done.digest) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: INIT_WITH_HMAC_DIGEST blob does not match digest\n");
 		return true;
 	}
 
-	// event if phase correct
+	PkgCodec::Reader blob_r{ByteSpan{done.blob}};
 
-	dispatch(
-		P2PRNG_Event::secret,
-		P2PRNG::Events::Secret{
-			id,
-			static_cast<uint16_t>(rng_state->secrets.size()),
-			static_cast<uint16_t>(rng_state->contacts.size()),
-		}
-	);
+	//   - peerlist (includes sender, determines fusion order)
+	std::vector<ToxKey> peers;
+	if (!readPeerList(blob_r, peers)) {
+		return true;
+	}
 
-	// might have been last, we might be done
-	checkHaveAllSecrets(rng_state, id);
+	const ByteSpan initial_state = blob_r.rest();
+	if (initial_state.empty()) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: digest init missing initial_state\n");
+		return true;
+	}
 
-	return true;
+	return acceptInit(c, id, resolvePeers(c, peers), initial_state, ByteSpan{done.sender_hmac}, done.pipelined, done.digest);
 }
 
-bool ToxP2PRNG::handle_secret_request(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
-	std::cerr << "TP2PRNG: got packet SECRET_REQUEST\n";
+bool ToxP2PRNG::handle_init_with_hmac_compact(ContactHandle4 c, const ByteSpan id, ByteSpan data) {
+	TP2PRNG_LOG(debug, proto, "TP2PRNG: got packet INIT_WITH_HMAC_COMPACT\n");
 
-	if (!data.empty()) {
-		std::cerr << "TP2PRNG warning: SECRET_REQUEST pkg has extra data!\n";
-	}
+	PkgCodec::Reader r{data};
 
-	const auto* rng_state = getRngSate(c, id);
-	if (rng_state == nullptr) {
+	//   - flags
+	uint8_t flags = 0u;
+	if (!r.u8(flags)) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: INIT_WITH_HMAC_COMPACT too small\n");
 		return false;
 	}
+	const bool pipelined = (flags & 0x01) != 0;
 
-	// can only request secret if secret or done state
-	if (const auto current_state = rng_state->getState(); !(current_state == P2PRNG::SECRET || current_state == P2PRNG::DONE)) {
+	//   - peer count, prefix length, prefixes
+	uint8_t prefix_len = 0u;
+	std::vector<uint64_t> prefixes;
+	ByteSpan keys_hash;
+	if (!readCompactPeerList(r, prefix_len, prefixes, keys_hash)) {
 		return false;
 	}
 
-	// find self contact
-	ContactHandle4 self = rng_state->getSelf();
-
-	if (!static_cast<bool>(self)) {
-		std::cerr << "TP2PRNG error: failed to look up self\n";
+	//   - sender hmac
+	ByteSpan sender_hmac;
+	if (!r.span(PkgCodec::hmac_size, sender_hmac) || r.remaining() == 0) {
+		TP2PRNG_LOG(error, proto, "TP2PRNG error: packet too small, missing hmac and initial_state\n");
 		return false;
 	}
 
-	auto self_secret_it = rng_state->secrets.find(self);
-	if (self_secret_it == rng_state->secrets.cend()) {
-		// hmmmmmmmmmm this bad
-		std::cerr << "hmmmmmmmmmm this bad\n";
-		return false;
+	//   - is
+	const ByteSpan initial_state = r.rest();
+
+	if (const auto* rng_state = getRngSate(c, id); rng_state != nullptr) {
+		// we already know this maybe we did not send hmac or it got lost
+		if (rng_state->hmacs.has(rng_state->self_idx)) {
+			send_hmac(c, id, ByteSpan{rng_state->hmacs.at(rng_state->self_idx)});
+		}
+
+		return true; // mark handled
 	}
 
-	// TODO: queue these instead
-	// SEND secret to c
-	// TODO: record send success
-	send_secret(c, id, ByteSpan{self_secret_it->second});
+	if (isEvicted(id)) {
+		TP2PRNG_LOG(warn, session, "TP2PRNG warning: INIT_WITH_HMAC_COMPACT for evicted generation, ignoring\n");
+		return true;
+	}
 
-	return true;
+	// if it can not be resolved, the initiator repeats with the full list
+	return acceptInit(c, id, resolveCompactPeers(c, prefix_len, prefixes, keys_hash), initial_state, sender_hmac, pipelined, std::nullopt);
 }
 
-static std::tuple<std::vector<uint8_t>, const Contact::Components::ToxFriendEphemeral*, const Contact::Components::ToxGroupPeerEphemeral*> prepSendPkgWithID(ContactHandle4 c, ToxP2PRNG::PKG pkg_type, ByteSpan id) {
-	std::vector<uint8_t> pkg;
-
-	// determine friend or group (meh)
-	const auto* tfe = c.try_get<Contact::Components::ToxFriendEphemeral>();
-	const auto* tgpe = c.try_get<Contact::Components::ToxGroupPeerEphemeral>();
-	if (tfe != nullptr) {
-		pkg.push_back(TOX_PKG_ID_FRIEND);
-	} else if (tgpe != nullptr) {
-		pkg.push_back(TOX_PKG_ID_GROUP);
-	} else {
-		return {};
+bool ToxP2PRNG::send_pkg(ContactHandle4 c, std::vector<uint8_t>& pkg) {
+	if (!patchPkgHeader(c, pkg)) {
+		return false;
 	}
-	pkg.push_back(static_cast<uint8_t>(pkg_type));
-
-	// pack packet
-	//   - id
-	pkg.insert(pkg.cend(), id.cbegin(), id.cend());
 
-	return {pkg, tfe, tgpe};
-}
+	// nothing we commit to or reveal may leave before it is on disk
+	if (_store && _store->syncPending() && !_store->sync()) {
+		TP2PRNG_LOG(error, session, "TP2PRNG error: session store sync failed, not sending\n");
+		if (pkg.size() >= 2+32) {
+			ID id;
+			std::copy_n(pkg.cbegin()+2, id.size(), id.begin());
+			_store_failed.emplace(id);
+		}
+		return false;
+	}
 
-static bool sendToxPrivatePacket(
-	ToxI& t,
-	const Contact::Components::ToxFriendEphemeral* tfe,
-	const Contact::Components::ToxGroupPeerEphemeral* tgpe,
-	const std::vector<uint8_t>& pkg
-) {
-	// send to friend or group peer
-	if (tfe != nullptr) {
-		return
-			t.toxFriendSendLosslessPacket(
-				tfe->friend_number,
-				pkg
-			) == TOX_ERR_FRIEND_CUSTOM_PACKET_OK
-		;
-	} else if (tgpe != nullptr) {
-		return
-			t.toxGroupSendCustomPrivatePacket(
-				tgpe->group_number, tgpe->peer_number,
-				true,
-				pkg
-			) == TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK
-		;
+	if (pkg.size() >= 2+32) {
+		recordProtoEvent(c, static_cast<PKG>(pkg[1]), ByteSpan{pkg.data()+2, 32}, true);
 	}
 
-	return false;
+	return queueSend(c, pkg);
 }
 
 bool ToxP2PRNG::send_init_with_hmac(
@@ -932,121 +3970,254 @@ bool ToxP2PRNG::send_init_with_hmac(
 	const ByteSpan id,
 	const std::vector<ContactHandle4>& peers,
 	const ByteSpan initial_state,
-	const ByteSpan hmac
+	const ByteSpan hmac,
+	const bool pipelined
 ) {
-	auto [pkg, tfe, tgpe] = prepSendPkgWithID(c, PKG::INIT_WITH_HMAC, id);
+	auto pkg_buf = buildInitWithHMACPkg(_pkg_pool, id, peers, initial_state, hmac, pipelined);
+	auto& pkg = *pkg_buf;
 	if (pkg.empty()) {
 		return false;
 	}
 
-	//   - peerlist (includes sender, determines fusion order)
-	// first numer of peers
-	const uint16_t peer_count = peers.size();
-	for (size_t i = 0; i < sizeof(peer_count); i++) {
-		pkg.push_back((peer_count>>(i*8)) & 0xff);
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending INIT_WITH_HMAC s:" << pkg.size() << "\n");
+
+	return send_pkg(c, pkg);
+}
+
+std::vector<PkgPool::Buffer> ToxP2PRNG::buildInitDigestPkgs(const ByteSpan id, const RngState& rng_state) {
+	if (!rng_state.is_digest.has_value()) {
+		return {};
 	}
 
-	// second the peers
-	for (const auto peer : peers) {
-		if (const auto* tfp = peer.try_get<Contact::Components::ToxFriendPersistent>(); tfp != nullptr) {
-			pkg.insert(pkg.cend(), tfp->key.data.cbegin(), tfp->key.data.cend());
-			continue;
-		}
+	if (!rng_state.hmacs.has(rng_state.self_idx)) {
+		return {};
+	}
 
-		if (const auto* tgpp = peer.try_get<Contact::Components::ToxGroupPeerPersistent>(); tgpp != nullptr) {
-			pkg.insert(pkg.cend(), tgpp->peer_key.data.cbegin(), tgpp->peer_key.data.cend());
-			continue;
-		}
+	auto blob_buf = _pkg_pool.acquire(PkgCodec::peerListSize(rng_state.contacts.size())+rng_state.getInitialState().size);
+	auto& blob = *blob_buf;
+	if (!buildInitBlob(blob, rng_state.contacts, rng_state.getInitialState())) {
+		return {};
+	}
 
-		if (!peer.any_of<Contact::Components::ToxFriendPersistent, Contact::Components::ToxGroupPeerPersistent>()) {
-			return false;
-		}
+	std::vector<PkgPool::Buffer> pkgs;
+	pkgs.reserve(1 + (blob.size() + g_init_fragment_size - 1) / g_init_fragment_size);
+
+	{ // init
+		const auto& digest = rng_state.is_digest.value();
+		const auto& hmac = rng_state.hmacs.at(rng_state.self_idx);
+
+		auto w = bodyWriter(*pkgs.emplace_back(prepSendPkgWithID(_pkg_pool, PKG::INIT_WITH_HMAC_DIGEST, id, PkgCodec::flags_size + sizeof(uint32_t) + digest.size() + hmac.size())));
+
+		//   - flags
+		w.u8(rng_state.pipelined ? 0x01 : 0x00);
+
+		//   - blob size
+		w.u32(blob.size());
+
+		//   - blob digest
+		w.bytes(digest);
+
+		//   - sender hmac
+		w.bytes(hmac);
 	}
 
+	for (size_t offset = 0; offset < blob.size(); offset += g_init_fragment_size) {
+		const size_t fragment_size = std::min(g_init_fragment_size, blob.size() - offset);
 
-	//   - sender hmac
-	pkg.insert(pkg.cend(), hmac.cbegin(), hmac.cend());
+		auto w = bodyWriter(*pkgs.emplace_back(prepSendPkgWithID(_pkg_pool, PKG::INIT_FRAGMENT, id, sizeof(uint32_t) + fragment_size)));
 
-	//   - is
-	pkg.insert(pkg.cend(), initial_state.cbegin(), initial_state.cend());
+		//   - offset
+		w.u32(offset);
 
-	std::cout << "TP2PRNG: sending INIT_WITH_HMAC s:" << pkg.size() << "\n";
+		//   - blob bytes
+		w.bytes(blob.data() + offset, fragment_size);
+	}
 
-	return sendToxPrivatePacket(_t, tfe, tgpe, pkg);
+	return pkgs;
 }
 
-bool ToxP2PRNG::send_hmac(ContactHandle4 c, ByteSpan id, const ByteSpan hmac) {
-	auto [pkg, tfe, tgpe] = prepSendPkgWithID(c, PKG::HMAC, id);
-	if (pkg.empty()) {
+bool ToxP2PRNG::send_init_with_hmac_digest(ContactHandle4 c, const ByteSpan id, const RngState& rng_state) {
+	auto pkgs = buildInitDigestPkgs(id, rng_state);
+	if (pkgs.empty()) {
 		return false;
 	}
 
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending INIT_WITH_HMAC_DIGEST + " << pkgs.size()-1 << " fragments\n");
+
+	bool ret = true;
+	for (auto& pkg : pkgs) {
+		ret = send_pkg(c, *pkg) && ret;
+	}
+
+	return ret;
+}
+
+bool ToxP2PRNG::send_hmac(ContactHandle4 c, ByteSpan id, const ByteSpan hmac) {
+	auto pkg_buf = prepSendPkgWithID(_pkg_pool, PKG::HMAC, id, hmac.size);
+	auto& pkg = *pkg_buf;
+
 	//   - hmac
-	pkg.insert(pkg.cend(), hmac.cbegin(), hmac.cend());
+	bodyWriter(pkg).bytes(hmac);
 
-	std::cout << "TP2PRNG: sending HMAC\n";
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending HMAC\n");
 
-	return sendToxPrivatePacket(_t, tfe, tgpe, pkg);
+	return send_pkg(c, pkg);
 }
 
 bool ToxP2PRNG::send_hmac_request(ContactHandle4 c, ByteSpan id) {
-	auto [pkg, tfe, tgpe] = prepSendPkgWithID(c, PKG::HMAC_REQUEST, id);
-	if (pkg.empty()) {
-		return false;
-	}
+	auto pkg_buf = prepSendPkgWithID(_pkg_pool, PKG::HMAC_REQUEST, id);
+	auto& pkg = *pkg_buf;
 
-	std::cout << "TP2PRNG: sending HMAC_REQUEST\n";
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending HMAC_REQUEST\n");
 
-	return sendToxPrivatePacket(_t, tfe, tgpe, pkg);
+	return send_pkg(c, pkg);
 }
 
 bool ToxP2PRNG::send_secret(ContactHandle4 c, ByteSpan id, const ByteSpan secret) {
-	auto [pkg, tfe, tgpe] = prepSendPkgWithID(c, PKG::SECRET, id);
-	if (pkg.empty()) {
-		return false;
-	}
+	auto pkg_buf = prepSendPkgWithID(_pkg_pool, PKG::SECRET, id, secret.size);
+	auto& pkg = *pkg_buf;
 
 	//   - secret (msg+k)
-	pkg.insert(pkg.cend(), secret.cbegin(), secret.cend());
+	bodyWriter(pkg).bytes(secret);
 
-	std::cout << "TP2PRNG: sending SECRET\n";
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending SECRET\n");
 
-	return sendToxPrivatePacket(_t, tfe, tgpe, pkg);
+	return send_pkg(c, pkg);
 }
 
 bool ToxP2PRNG::send_secret_request(ContactHandle4 c, ByteSpan id) {
-	auto [pkg, tfe, tgpe] = prepSendPkgWithID(c, PKG::SECRET_REQUEST, id);
-	if (pkg.empty()) {
+	auto pkg_buf = prepSendPkgWithID(_pkg_pool, PKG::SECRET_REQUEST, id);
+	auto& pkg = *pkg_buf;
+
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending SECRET_REQUEST\n");
+
+	return send_pkg(c, pkg);
+}
+
+bool ToxP2PRNG::send_secret_with_next_hmac(ContactHandle4 c, ByteSpan id, const ByteSpan secret, const ByteSpan next_hmac) {
+	auto pkg_buf = prepSendPkgWithID(_pkg_pool, PKG::SECRET_WITH_NEXT_HMAC, id, secret.size + next_hmac.size);
+	auto& pkg = *pkg_buf;
+	auto w = bodyWriter(pkg);
+
+	//   - secret (msg+k)
+	w.bytes(secret);
+
+	//   - hmac for the next round
+	w.bytes(next_hmac);
+
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending SECRET_WITH_NEXT_HMAC\n");
+
+	return send_pkg(c, pkg);
+}
+
+bool ToxP2PRNG::send_init_chained(ContactHandle4 c, const ByteSpan id, const RngState& rng_state) {
+	if (!rng_state.chained_from.has_value()) {
+		return false;
+	}
+
+	if (!rng_state.secrets.has(rng_state.self_idx) || !rng_state.next_hmacs.has(rng_state.self_idx)) {
 		return false;
 	}
 
-	std::cout << "TP2PRNG: sending SECRET_REQUEST\n";
+	const auto& prev_id = rng_state.chained_from.value();
+	const auto& secret = rng_state.secrets.at(rng_state.self_idx);
+	const auto& next_hmac = rng_state.next_hmacs.at(rng_state.self_idx);
+
+	auto pkg_buf = prepSendPkgWithID(_pkg_pool, PKG::INIT_CHAINED, id, prev_id.size() + secret.size() + next_hmac.size() + rng_state.getInitialState().size);
+	auto& pkg = *pkg_buf;
+	auto w = bodyWriter(pkg);
+
+	//   - prev id
+	w.bytes(prev_id);
+
+	//   - sender secret (msg+k)
+	w.bytes(secret);
+
+	//   - sender hmac for the next round
+	w.bytes(next_hmac);
+
+	//   - is
+	w.bytes(rng_state.getInitialState());
+
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending INIT_CHAINED s:" << pkg.size() << "\n");
+
+	return send_pkg(c, pkg);
+}
+
+bool ToxP2PRNG::send_hmac_bundle(ContactHandle4 c, const ByteSpan bundle_id, const uint16_t bundle_size) {
+	auto pkg_buf = prepSendPkgWithID(_pkg_pool, PKG::HMAC_BUNDLE, bundle_id, sizeof(uint16_t) + bundle_size * PkgCodec::hmac_size);
+	auto& pkg = *pkg_buf;
+	auto w = bodyWriter(pkg);
+
+	//   - count
+	w.u16(bundle_size);
+
+	//   - per generation: hmac
+	for (uint16_t i = 0; i < bundle_size; i++) {
+		const auto it = _global_map.find(bundleGenID(bundle_id, i));
+		if (it == _global_map.cend()) {
+			return false;
+		}
+
+		w.bytes(it->second.hmacs.at(it->second.self_idx));
+	}
+
+	TP2PRNG_LOG(debug, send, "TP2PRNG: sending HMAC_BUNDLE\n");
 
-	return sendToxPrivatePacket(_t, tfe, tgpe, pkg);
+	return send_pkg(c, pkg);
 }
 
-ToxP2PRNG::RngState* ToxP2PRNG::getRngSate(ContactHandle4 c, ByteSpan id_bytes) {
-	if (id_bytes.size != ID{}.size()) {
-		return nullptr;
+P2PRNGMetricsI::Snapshot ToxP2PRNG::getMetricsSnapshot(void) const {
+	Snapshot snapshot;
+
+	snapshot.init_to_all_hmacs = _metrics.init_to_all_hmacs.get();
+	snapshot.all_hmacs_to_done = _metrics.all_hmacs_to_done.get();
+
+	for (size_t i = 0; i < _metrics.pkgs.size(); i++) {
+		const auto& counters = _metrics.pkgs[i];
+		PkgStats stats;
+		stats.type = static_cast<uint8_t>(i);
+		stats.sent = counters.sent.load(std::memory_order_relaxed);
+		stats.sent_bytes = counters.sent_bytes.load(std::memory_order_relaxed);
+		stats.received = counters.received.load(std::memory_order_relaxed);
+		stats.received_bytes = counters.received_bytes.load(std::memory_order_relaxed);
+		if (stats.sent != 0u || stats.received != 0u) {
+			snapshot.pkgs.push_back(stats);
+		}
 	}
 
-	ID r_id{};
-	{ // building the id is very annoying, should have not used array?
-		// TODO: provide custom comperator ?
-		for (size_t i = 0; i < r_id.size(); i++) {
-			r_id[i] = id_bytes[i];
+	snapshot.send_failures = _metrics.send_failures.load(std::memory_order_relaxed);
+	snapshot.val_errors = _metrics.val_errors.load(std::memory_order_relaxed);
+
+	for (const auto& [id, rng_state] : _global_map) {
+		const size_t state = rng_state.getState();
+		if (state < snapshot.sessions_by_state.size()) {
+			snapshot.sessions_by_state[state]++;
 		}
 	}
 
-	const auto find_it = _global_map.find(r_id);
+	snapshot.peers.reserve(_metrics.peers.size());
+	for (const auto& [c, peer_stats] : _metrics.peers) {
+		snapshot.peers.push_back(peer_stats);
+	}
+
+	return snapshot;
+}
+
+ToxP2PRNG::RngState* ToxP2PRNG::getRngSate(ContactHandle4 c, ByteSpan id_bytes) {
+	size_t c_idx = 0;
+	return getRngSate(c, id_bytes, c_idx);
+}
+
+ToxP2PRNG::RngState* ToxP2PRNG::getRngSate(ContactHandle4 c, ByteSpan id_bytes, size_t& c_idx) {
+	const auto find_it = _global_map.find(id_bytes); // checks size
 	if (find_it == _global_map.cend()) {
 		return nullptr;
 	}
 
-	const auto find_c = std::find(find_it->second.contacts.cbegin(), find_it->second.contacts.cend(), c);
-	if (find_c == find_it->second.contacts.cend()) {
+	if (!find_it->second.indexOf(c, c_idx)) {
 		// id exists, but peer looking into id is not participating, so we block the request
-		std::cerr << "!!!!! id exists, but peer looking into id is not participating\n";
+		TP2PRNG_LOG(warn, proto, "!!!!! id exists, but peer looking into id is not participating\n");
 		return nullptr;
 	}
 
@@ -1079,3 +4250,76 @@ bool ToxP2PRNG::onToxEvent(const Tox_Event_Group_Custom_Private_Packet* e) {
 	return handleGroupPacket(group_number, peer_number, {data, data_length}, true);
 }
 
+bool ToxP2PRNG::onToxEvent(const Tox_Event_Friend_Connection_Status* e) {
+	if (tox_event_friend_connection_status_get_connection_status(e) == TOX_CONNECTION_NONE) {
+		return false;
+	}
+
+	const auto c = getContactFriend(tox_event_friend_connection_status_get_friend_number(e));
+	if (!static_cast<bool>(c)) {
+		return false;
+	}
+
+	if (!_store_pending.empty()) {
+		restoreSessions(*c.registry());
+	}
+
+	if (auto queue_it = _send_queues.find(c); queue_it != _send_queues.end()) {
+		flushSendQueue(queue_it->second);
+	}
+
+	return false; // not ours alone
+}
+
+bool ToxP2PRNG::onToxEvent(const Tox_Event_Group_Peer_Join* e) {
+	const auto c = getContactGroupPeer(
+		tox_event_group_peer_join_get_group_number(e),
+		tox_event_group_peer_join_get_peer_id(e)
+	);
+	if (!static_cast<bool>(c)) {
+		return false;
+	}
+
+	if (!_store_pending.empty()) {
+		restoreSessions(*c.registry());
+	}
+
+	// only track groups someone asked for
+	const auto group = getContactGroup(tox_event_group_peer_join_get_group_number(e));
+	if (auto online_it = _group_online_peers.find(group); online_it != _group_online_peers.end()) {
+		online_it->second.emplace(c);
+	}
+
+	if (auto queue_it = _send_queues.find(c); queue_it != _send_queues.end()) {
+		flushSendQueue(queue_it->second);
+	}
+
+	return false; // not ours alone
+}
+
+bool ToxP2PRNG::onToxEvent(const Tox_Event_Group_Peer_Exit* e) {
+	const auto group = getContactGroup(tox_event_group_peer_exit_get_group_number(e));
+	auto online_it = _group_online_peers.find(group);
+	if (online_it == _group_online_peers.end()) {
+		return false;
+	}
+
+	const auto c = getContactGroupPeer(
+		tox_event_group_peer_exit_get_group_number(e),
+		tox_event_group_peer_exit_get_peer_id(e)
+	);
+	if (static_cast<bool>(c)) {
+		online_it->second.erase(c);
+	}
+
+	return false; // not ours alone
+}
+
+bool ToxP2PRNG::onToxEvent(const Tox_Event_Group_Self_Join* e) {
+	// (re)joined, peers that left while we were gone never sent an exit
+	const auto group = getContactGroup(tox_event_group_self_join_get_group_number(e));
+	_group_online_peers.erase(group);
+
+	return false; // not ours alone
+}
+
@@ -1,23 +1,45 @@
 #pragma once
 
 #include "./p2prng.hpp"
+#include "./p2prng_metrics.hpp"
+#include "./tox_key_index.hpp"
+#include "./id_map.hpp"
+#include "./pkg_pool.hpp"
+#include "./crypto_workers.hpp"
+#include "./session_store.hpp"
+#include "./log.hpp"
 
 #include <p2prng.h>
 
 #include <solanaceae/tox_contacts/tox_contact_model2.hpp>
 
 #include <entt/container/dense_map.hpp>
+#include <entt/container/dense_set.hpp>
 
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
 #include <vector>
 
 // implements P2PRNGI for tox
 // both tox friends(1to1) aswell as tox ngc(NtoN) should be supported
 // TODO: use generic packet handling service (eg ngc_ext) instead
-class ToxP2PRNG : public P2PRNGI, public ToxEventI {
+class ToxP2PRNG : public P2PRNGI, public P2PRNGMetricsI, public ToxEventI {
 	ToxI& _t;
 	ToxEventProviderI::SubscriptionReference _tep_sr;
-	ToxContactModel2& _tcm;
+	ToxContactModel2* _tcm {nullptr};
+
+	// resolves peer list keys to contacts, binds lazily to the registry of the first contact we see
+	ToxKeyIndex _key_index;
+
+	// connected peers per group (without self), for newGernation()
+	// filled from the group on first use, then kept current by group peer join/exit events
+	entt::dense_map<Contact4, entt::dense_set<Contact4>> _group_online_peers;
 
 	public:
 		enum class PKG : uint8_t {
@@ -28,41 +50,422 @@ class ToxP2PRNG : public P2PRNGI, public ToxEventI {
 			HMAC_REQUEST,
 			SECRET,
 			SECRET_REQUEST,
+
+			// k generations with the same peers in one set of packets
+			// the id is the bundle id, generation ids are derived from it
+			INIT_WITH_HMAC_BUNDLE,
+			HMAC_BUNDLE,
+			SECRET_BUNDLE,
+
+			// pipelined generations, every secret also commits to the next round
+			// so a chained generation only needs the secret phase
+			INIT_WITH_HMAC_PIPELINED,
+			SECRET_WITH_NEXT_HMAC,
+			INIT_CHAINED,
+
+			// for peer lists and initial states that dont fit into a single packet
+			// the init only carries a digest, the rest follows in fragments
+			INIT_WITH_HMAC_DIGEST,
+			INIT_FRAGMENT,
+
+			// like INIT_WITH_HMAC, but group peers are only sent as key prefixes
+			INIT_WITH_HMAC_COMPACT,
 		};
 
-		using ID = std::array<uint8_t, 32>;
-		struct IDHash {size_t operator()(const ID& a) const {return (a[0] | a[1] << 1*8 | a[2] << 1*16 | a[3] << 1*24) ^ (a[31] | a[30] << 1*8);}};
+		using ID = std::array<uint8_t, 32>; // same as IDMap::ID
+		// ids are random, any slice is a good hash
+		struct IDHash {size_t operator()(const ID& a) const {return static_cast<size_t>(seededIDHash(a.data(), a.size()));}};
+
+		// session eviction, all times in seconds
+		struct EvictionConfig {
+			float done_ttl {5.f*60.f}; // how long a finished generation stays queryable
+			float stall_timeout {3.f*60.f}; // unfinished generation without progress
+			float tombstone_ttl {10.f*60.f}; // remember evicted ids, so late INITs dont resurrect them
+			size_t max_sessions {4096u}; // hard cap, least recently active gets evicted first
+			size_t max_remote_sessions_per_peer {512u}; // generations a single peer can start on us, 0 is unlimited
+			size_t max_tombstones {64u*1024u}; // oldest get forgotten early beyond this
+		};
+
+		struct EvictionStats {
+			uint64_t done_ttl {0u};
+			uint64_t stalled {0u};
+			uint64_t cap {0u};
+			uint64_t store_failed {0u}; // own commitments could not be made durable
+			uint64_t remote_quota {0u}; // inits refused, the sender has too many generations running on us
+			uint64_t chain_conflict {0u}; // generations dropped for a concurrent chain onto the same prev
+		};
+
+		// outbound packets that toxcore did not take right away, per contact
+		struct SendQueueConfig {
+			size_t max_queued_bytes {64u*1024u}; // per peer, oldest get dropped beyond this
+			// token bucket per peer, keeps bursts out of toxcores sendq independent of the iterate() rate
+			size_t rate_bytes {32u*1024u}; // per peer and second
+			size_t burst_bytes {16u*1024u}; // what a peer that was idle can get at once
+		};
+
+		struct SendQueueStats {
+			uint64_t sent {0u};
+			uint64_t deferred {0u}; // packets that had to wait in the queue
+			uint64_t dropped_overflow {0u};
+			uint64_t dropped_error {0u}; // non transient send errors
+		};
+
+	protected: // session internals, for the benchmarks
+		// fixed size record per participant, indexed like RngState::contacts
+		template<size_t N>
+		struct PeerSlots {
+			std::vector<std::array<uint8_t, N>> slots; // contiguous
+			std::vector<bool> received;
+			uint16_t count {0u};
+
+			void resize(size_t n) { slots.resize(n); received.resize(n, false); }
+
+			bool has(size_t i) const { return received[i]; }
+			const std::array<uint8_t, N>& at(size_t i) const { return slots.at(i); }
+			bool complete(void) const { return count == slots.size(); }
+
+			void set(size_t i, const uint8_t* data) {
+				std::memcpy(slots[i].data(), data, N);
+				if (!received[i]) {
+					received[i] = true;
+					count++;
+				}
+			}
+			void set(size_t i, const std::array<uint8_t, N>& data) { set(i, data.data()); }
+
+			void erase(size_t i) {
+				if (received[i]) {
+					received[i] = false;
+					count--;
+				}
+			}
+		};
 
-	private:
 		struct RngState {
 			// all contacts participating, including self
 			std::vector<ContactHandle4> contacts;
-			ContactHandle4 getSelf(void) const;
+			entt::dense_map<Contact4, uint16_t> contact_index; // into contacts
+			uint16_t self_idx {0u};
+			ContactHandle4 getSelf(void) const { return contacts.at(self_idx); }
 
-			// app given
-			std::vector<uint8_t> initial_state;
+			// sets contacts and sizes everything per participant
+			// returns false if self is missing or a contact is listed twice
+			bool setContacts(std::vector<ContactHandle4>&& new_contacts);
 
-			// the other stuff needed for full IS (preamble+IS)
+			// returns false if c is not participating
+			bool indexOf(Contact4 c, size_t& idx) const;
+
+			// full IS (preamble+IS) in one buffer, built once
 			//  - ID
 			//  - list of public keys of contacts (same order as later used to calc res)
-			std::vector<uint8_t> initial_state_preamble;
-			void fillInitalStatePreamble(const ByteSpan id);
+			//  - app given IS
+			std::vector<uint8_t> is_buffer;
+			size_t is_offset {0u}; // where the app given IS starts
+
+			// set if the peer list and is were sent as fragments,
+			// the full IS is then only the id and this digest over both
+			std::optional<ID> is_digest;
+
+			// needs contacts and is_digest set
+			// peer_keys are the already parsed keys in contacts order, otherwise they are looked up
+			bool fillInitialState(const ByteSpan id, const ByteSpan initial_state, const std::vector<ToxKey>* peer_keys = nullptr);
+
+			// app given
+			ByteSpan getInitialState(void) const { return ByteSpan{is_buffer.data() + is_offset, is_buffer.size() - is_offset}; }
+
+			// preamble+IS, what gets hmaced and combined
+			ByteSpan getFullInitialState(void) const { return is_digest.has_value() ? ByteSpan{is_buffer.data(), is_offset} : ByteSpan{is_buffer}; }
+
+			// the init went out with a compact peer list
+			bool compact_init {false};
 
-			// use contacts instead?
-			entt::dense_map<Contact4, std::array<uint8_t, P2PRNG_MAC_LEN>> hmacs;
-			entt::dense_map<Contact4, std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN>> secrets;
+			PeerSlots<P2PRNG_MAC_LEN> hmacs;
+			PeerSlots<P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secrets;
+			// secrets handed to the crypto workers, duplicates are dropped until the result is back
+			std::vector<bool> secrets_verifying;
+
+			// secrets get combined in contact order as soon as they are verified,
+			// so the last packet only has to finish the tail
+			std::array<uint8_t, P2PRNG_COMBINE_LEN> combine_state;
+			uint16_t combine_next {0u}; // next contact index to fold in
+			bool combine_error {false};
+			void advanceCombine(void);
 
 			void genFinalResult(void);
 
 			std::vector<uint8_t> final_result; // cached
 
 			P2PRNG::State getState(void) const;
+
+			// time of creation or last progress (new hmac/secret)
+			double last_activity {0.0};
+
+			// for the phase latency metrics
+			double time_start {0.0};
+			std::optional<double> time_all_hmacs;
+
+			// we sent the INIT, so we are the one to repeat it
+			bool self_initiated {false};
+
+			// set if every other participant is a peer of this group,
+			// then HMACs go out once as a group packet instead of per peer
+			ContactHandle4 broadcast_group;
+			// every member of broadcast_group is participating, so the INIT (is) can be broadcast too
+			// and the secret, if still no one else joined by then
+			bool broadcast_init {false};
+
+			// set if started as part of a bundle, see newGenerationBatch()
+			std::optional<ID> bundle_id;
+			uint16_t bundle_size {0u};
+			bool secret_sent {false};
+
+			// pipelined, see newGenerationPipelined()
+			// hmacs committed for the next round, sent along with the secrets
+			bool pipelined {false};
+			PeerSlots<P2PRNG_MAC_LEN> next_hmacs;
+			std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> next_secret;
+			bool have_next_secret {false};
+			std::optional<ID> next_id; // set once the commitments got used by a chained generation
+			std::optional<ID> chained_from;
+
+			// retransmission of requests for missing hmacs/secrets, exponential backoff
+			double retry_next {0.0};
+			float retry_interval {0.f};
+
+			// marks progress, resets retransmission backoff
+			void touch(double time);
+
+			// the peer that started it, if not us, see _remote_sessions
+			Contact4 remote_initiator {entt::null};
+		};
+
+	private:
+		IDMap<RngState> _global_map;
+		// erases and keeps the quota counts in line, returns false if not found
+		bool eraseSession(const ID& id);
+
+		double _time {0.0}; // accumulated iterate() time
+		EvictionConfig _eviction_config;
+		EvictionStats _eviction_stats;
+		entt::dense_map<ID, double, IDHash> _evicted; // id -> time of eviction
+		std::deque<std::pair<double, ID>> _evicted_order; // oldest first, entries can be stale
+		void addTombstone(const ID& id);
+
+		// min heap of (last_activity, id), for the session cap
+		// touch() does not know about it, so entries are checked when they come up
+		// and pushed again if the session was active since
+		std::vector<std::pair<double, ID>> _lru_heap;
+		void lruPush(const ID& id, const double last_activity);
+
+		// generations running on us per peer that started them
+		entt::dense_map<Contact4, size_t> _remote_sessions;
+		// returns false (and counts it) if c would go over its quota with count more
+		bool remoteQuotaAllows(Contact4 c, const size_t count = 1u);
+		void countRemoteSession(RngState& rng_state, Contact4 c);
+
+		// digest inits we are still receiving fragments for
+		struct PendingInit {
+			ContactHandle4 c;
+			ID digest;
+			std::array<uint8_t, P2PRNG_MAC_LEN> sender_hmac;
+			bool pipelined {false};
+
+			size_t blob_size {0u};
+			std::vector<uint8_t> blob; // peerlist+is, allocated with the first fragment
+			std::vector<bool> have_fragments;
+			size_t fragments_missing {0u};
+			// the peer list part arrived and lists us, the rest is worth buffering
+			bool peers_checked {false};
+
+			// all fragments the peer list spans are in
+			bool havePeerList(void) const;
+
+			double time {0.0}; // time of the init, expires like a stalled session
+		};
+		entt::dense_map<ID, PendingInit, IDHash> _pending_inits;
+
+		// makes room for count more sessions
+		// returns false if that many can never fit
+		bool enforceSessionCap(const size_t count = 1u);
+		void evictSessions(void);
+
+		// sends requests to peers we are still missing something from
+		void retrySessions(void);
+		void retrySession(RngState& rng_state, const ByteSpan id);
+		bool isEvicted(const ByteSpan id) const;
+		static bool fitsFullInit(const RngState& rng_state);
+
+		// every outgoing packet is built in (and queued as) a pooled buffer
+		// needs to outlive the send queues
+		PkgPool _pkg_pool;
+
+		struct SendQueue {
+			ContactHandle4 c;
+			std::deque<PkgPool::Buffer> pkgs;
+			size_t bytes {0u};
 		};
-		entt::dense_map<ID, RngState, IDHash> _global_map;
+		// only peers with deferred packets have one
+		entt::dense_map<Contact4, SendQueue> _send_queues;
+
+		// only peers that sent recently have one, a missing bucket is a full one
+		struct SendBudget {
+			double tokens {0.0}; // bytes, goes negative for a packet larger than what is left
+			double time {0.0}; // of the last refill
+		};
+		entt::dense_map<Contact4, SendBudget> _send_budgets;
+		// returns false if c has to wait before sending size bytes
+		bool haveSendBudget(Contact4 c, const size_t size);
+		void spendSendBudget(Contact4 c, const size_t size);
+		std::vector<Contact4> _send_queues_to_remove; // scratch for flushSendQueues()
+		SendQueueConfig _send_queue_config;
+		SendQueueStats _send_queue_stats;
+
+		// sends right away if possible, queues on transient failure
+		// returns false if the packet was dropped
+		bool queueSend(ContactHandle4 c, const std::vector<uint8_t>& pkg);
+		void flushSendQueue(SendQueue& queue);
+		void flushSendQueues(void);
+
+		// optional, secret verification runs on these instead of inline
+		// completions get drained in iterate(), so events still fire on the tox thread
+		std::unique_ptr<CryptoWorkers> _crypto_workers;
+		double _crypto_progress_time {0.0}; // last completion (or first submit), iterate() polls less often the longer ago
+
+		// updated on the hot path, counters are relaxed atomics
+		struct Metrics {
+			struct PkgCounters {
+				std::atomic<uint64_t> sent {0u};
+				std::atomic<uint64_t> sent_bytes {0u};
+				std::atomic<uint64_t> received {0u};
+				std::atomic<uint64_t> received_bytes {0u};
+			};
+			// indexed by PKG, unknown types count as INVALID
+			std::array<PkgCounters, static_cast<size_t>(PKG::INIT_WITH_HMAC_COMPACT)+1> pkgs;
+
+			LatencyHistogram init_to_all_hmacs;
+			LatencyHistogram all_hmacs_to_done;
+
+			std::atomic<uint64_t> send_failures {0u};
+			std::atomic<uint64_t> val_errors {0u};
+
+			// tox thread only
+			entt::dense_map<Contact4, PeerStats> peers;
+
+			PkgCounters& pkg(const uint8_t type) { return pkgs[type < pkgs.size() ? type : 0u]; }
+			void countSent(const std::vector<uint8_t>& pkg);
+		} _metrics;
+
+		// optional, in flight generations survive a restart
+		// records are appended as the generation progresses, see session_store.hpp
+		std::unique_ptr<SessionStore> _store;
+		uint64_t _store_compacted_size {0u}; // log size after the last rewrite
+		// loaded generations whose contacts could not be resolved yet, records point into _store_loaded
+		std::vector<uint8_t> _store_loaded;
+		entt::dense_map<ID, std::vector<SessionStore::Record>, IDHash> _store_pending;
+		double _store_pending_since {0.0};
+		// key index generation of the last restore attempt, nothing new to resolve until it changes
+		uint64_t _store_restore_generation {0u};
+		bool _store_restore_tried {false};
+		// generations whose durable records failed to sync, nothing got sent for them, aborted in iterate()
+		entt::dense_set<ID, IDHash> _store_failed;
+
+		// all noops without a store
+		// the session record is durable, it holds our secret and has to be stored before our hmac leaves
+		void storeSession(const ID& id, const RngState& rng_state);
+		void storeHMAC(const ByteSpan id, const bool next_round, const size_t c_idx, const uint8_t* hmac);
+		void storeSecret(const ByteSpan id, const size_t c_idx, const uint8_t* secret);
+		void storeEnd(const ID& id);
+		// flags, participants as keys, own secret, hmacs so far and the is
+		static bool encodeSession(std::vector<uint8_t>& body, const RngState& rng_state);
+		// rewrites the log from the live generations
+		void compactSessionStore(void);
+
+		// binds the key index to reg, then restores what can be resolved
+		// cheap to call often, only retries once the key index learned a contact
+		void restoreSessions(ContactRegistry4& reg);
+		void abortStoreFailed(void);
+		// returns false if contacts are still missing, true if restored or dropped
+		bool restoreSession(const ID& id, const std::vector<SessionStore::Record>& records);
+
+		// optional, last packets in and out for post mortem debugging
+		std::unique_ptr<ProtoEventRing> _proto_event_ring;
+		void recordProtoEvent(ContactHandle4 c, const PKG pkg_type, const ByteSpan id, const bool outgoing);
+
+		bool _group_broadcast {true};
+		ContactHandle4 findBroadcastGroup(const std::vector<ContactHandle4>& contacts);
+		// no group member outside of the participants, as far as we know
+		bool isWholeGroup(ContactHandle4 group, const RngState& rng_state) const;
+		// sets broadcast_group and broadcast_init, needs contacts
+		void setBroadcast(RngState& rng_state);
+		// private packet to every other participant
+		void sendToParticipants(const RngState& rng_state, std::vector<uint8_t>& pkg);
+
+		// resolves a received peer list in the context of the sender (friend or group)
+		// returns empty if not all could be resolved
+		std::vector<ContactHandle4> resolvePeers(ContactHandle4 c, const std::vector<ToxKey>& peers);
+
+		// peers of one group as key prefixes, just long enough to be unique among the members we know
+		// returns false if not possible, the full list has to be used then
+		bool appendCompactPeerList(std::vector<uint8_t>& pkg, const std::vector<ContactHandle4>& peers);
+		// returns empty if a prefix is unknown or ambiguous for us
+		std::vector<ContactHandle4> resolveCompactPeers(ContactHandle4 c, const uint8_t prefix_len, const std::vector<uint64_t>& prefixes, const ByteSpan keys_hash);
+
+		// creates the state and generates our own secret and hmac
+		// returns nullptr on failure, nothing is left behind in that case
+		RngState* createRngState(
+			const ID& id,
+			std::vector<ContactHandle4>&& contacts,
+			const ByteSpan initial_state,
+			const std::optional<ID>& is_digest = std::nullopt,
+			const std::vector<ToxKey>* peer_keys = nullptr, // parsed keys, if at hand
+			const bool make_room = true // false if the caller made room already, eg for a whole bundle
+		);
+
+		// starts contributing to a generation someone else initiated
+		bool acceptInit(
+			ContactHandle4 c,
+			const ByteSpan id,
+			std::vector<ContactHandle4>&& peer_contacts,
+			const ByteSpan initial_state,
+			const ByteSpan sender_hmac,
+			const bool pipelined,
+			const std::optional<ID>& is_digest,
+			const std::vector<ToxKey>* peer_keys = nullptr
+		);
+
+		// INIT_WITH_HMAC_DIGEST followed by all fragments, same for every recipient
+		std::vector<PkgPool::Buffer> buildInitDigestPkgs(const ByteSpan id, const RngState& rng_state);
+
+		// creates the state from the commitments of prev, marks them as used
+		// returns nullptr if prev is unknown, not pipelined or already chained
+		RngState* createChainedRngState(const ID& id, const ID& prev_id, const ByteSpan initial_state);
+		// prev got chained by chained_id, and now by new_id too
+		// new_id is never taken, chained_id can not finish anymore (unless done already)
+		void resolveChainConflict(const ID& prev_id, const ID& chained_id, const ID& new_id);
+		// drops a chained generation that can not finish, prev stays used
+		// own ones get started again as a fresh generation, with new commitments
+		void abandonChained(const ID& id);
+
+		// commits to the secret for the next round, if not done already
+		bool ensureNextCommitment(RngState& rng_state, const ByteSpan id);
+
+		// sends own secret to everyone (with next hmac if pipelined), once
+		void sendOwnSecret(RngState& rng_state, const ByteSpan id);
+
+		std::vector<uint8_t> startGeneration(const std::vector<ContactHandle4>& c_vec, const ByteSpan initial_state_user_data, const bool pipelined);
+
+		const entt::dense_set<Contact4>& getGroupOnlinePeers(ContactHandle4 group);
+
+		// sends all own secrets of a bundle in one packet, once every generation in it has all hmacs
+		void checkBundleHaveAllHMACs(const ID& bundle_id, const uint16_t bundle_size);
 
 		void checkHaveAllHMACs(RngState* rng_state, const ByteSpan id);
 		void checkHaveAllSecrets(RngState* rng_state, const ByteSpan id); // can fire done event
 
+		// verified secret of c_idx, can fire secret and done events
+		void addVerifiedSecret(RngState& rng_state, const ByteSpan id, const size_t c_idx, const uint8_t* secret);
+		void reportBadSecret(const ByteSpan id, ContactHandle4 c);
+
 	public:
 		ToxP2PRNG(
 			ToxI& t,
@@ -71,9 +474,66 @@ class ToxP2PRNG : public P2PRNGI, public ToxEventI {
 		);
 		~ToxP2PRNG(void);
 
+	protected:
+		// without a contact model, for harnesses that override the contact lookups below
+		ToxP2PRNG(
+			ToxI& t,
+			ToxEventProviderI& tep
+		);
+
+		// tox numbers to contacts, forwards to the contact model
+		virtual ContactHandle4 getContactFriend(const uint32_t friend_number);
+		virtual ContactHandle4 getContactGroup(const uint32_t group_number);
+		virtual ContactHandle4 getContactGroupPeer(const uint32_t group_number, const uint32_t peer_number);
+
+	public:
+		// returns time till next call is wanted
+		float iterate(float time_delta);
+
+		void setEvictionConfig(const EvictionConfig& config) { _eviction_config = config; }
+		const EvictionConfig& getEvictionConfig(void) const { return _eviction_config; }
+		const EvictionStats& getEvictionStats(void) const { return _eviction_stats; }
+		size_t getSessionCount(void) const { return _global_map.size(); }
+
+		void setSendQueueConfig(const SendQueueConfig& config) { _send_queue_config = config; }
+		const SendQueueConfig& getSendQueueConfig(void) const { return _send_queue_config; }
+		const SendQueueStats& getSendQueueStats(void) const { return _send_queue_stats; }
+		size_t getSendQueueDepth(void) const; // total packets waiting
+		size_t getSendQueueDepth(Contact4 c) const;
+		// allocated stays flat once warmed up
+		const PkgPool::Stats& getPkgPoolStats(void) const { return _pkg_pool.getStats(); }
+
+		// send hmacs (and inits and secrets, if the whole group takes part) as one group packet, if possible
+		void setGroupBroadcast(bool enabled) { _group_broadcast = enabled; }
+
+		// off by default, the snapshot is oldest first
+		// log levels are set globally, see log.hpp
+		void setProtoEventRing(bool enabled);
+		std::vector<ProtoEventRing::Event> getRecentProtoEvents(void) const;
+
+		// 0 (default) runs all crypto inline on the tox thread
+		// otherwise iterate() polls for finished jobs, every 10ms backing off to 200ms
+		void setCryptoWorkers(size_t thread_count);
+		size_t getCryptoJobsInFlight(void) const { return _crypto_workers ? _crypto_workers->inFlight() : 0u; }
+
+		// off by default, empty path closes the store
+		// unfinished generations in the log get resumed once their contacts are known again,
+		// ones that cant be resolved are dropped after the stall timeout
+		bool setSessionStore(const std::string& path);
+		size_t getSessionStorePending(void) const { return _store_pending.size(); }
+
+	public: // metrics
+		// counters and histograms are safe to read from anywhere, sessions and peers are not,
+		// so call from the tox thread (eg plugin tick)
+		// latencies are measured in iterate() time steps
+		Snapshot getMetricsSnapshot(void) const override;
+
 	public: // p2prng
 		std::vector<uint8_t> newGernation(ContactHandle4 c, const ByteSpan initial_state_user_data) override;
 		std::vector<uint8_t> newGernationPeers(const std::vector<ContactHandle4>& c_vec, const ByteSpan initial_state_user_data) override;
+		std::vector<std::vector<uint8_t>> newGenerationBatch(const std::vector<ContactHandle4>& c_vec, const std::vector<ByteSpan>& initial_states) override;
+		std::vector<uint8_t> newGenerationPipelined(const std::vector<ContactHandle4>& c_vec, const ByteSpan initial_state_user_data) override;
+		std::vector<uint8_t> newGenerationChained(const ByteSpan prev_id, const ByteSpan initial_state_user_data) override;
 
 		P2PRNG::State getSate(const ByteSpan id) override;
 		ByteSpan getResult(const ByteSpan id) override;
@@ -96,18 +556,39 @@ class ToxP2PRNG : public P2PRNGI, public ToxEventI {
 			const bool _private
 		);
 
+		// all handlers get the packet body after the id, at least as large as the
+		// minimum size of the packet type (see handlePacket())
 		bool handle_init_with_hmac(ContactHandle4 c, const ByteSpan id, ByteSpan data);
+		bool handle_init_with_hmac_pipelined(ContactHandle4 c, const ByteSpan id, ByteSpan data);
+		bool handleInitWithHMAC(ContactHandle4 c, const ByteSpan id, ByteSpan data, const bool pipelined);
 		bool handle_hmac(ContactHandle4 c, const ByteSpan id, ByteSpan data);
 		bool handle_hmac_request(ContactHandle4 c, const ByteSpan id, ByteSpan data);
 		bool handle_secret(ContactHandle4 c, const ByteSpan id, ByteSpan data);
 		bool handle_secret_request(ContactHandle4 c, const ByteSpan id, ByteSpan data);
+		bool handle_init_with_hmac_bundle(ContactHandle4 c, const ByteSpan bundle_id, ByteSpan data);
+		bool handle_hmac_bundle(ContactHandle4 c, const ByteSpan bundle_id, ByteSpan data);
+		bool handle_secret_bundle(ContactHandle4 c, const ByteSpan bundle_id, ByteSpan data);
+		bool handle_secret_with_next_hmac(ContactHandle4 c, const ByteSpan id, ByteSpan data);
+		bool handle_init_chained(ContactHandle4 c, const ByteSpan id, ByteSpan data);
+		bool handle_init_with_hmac_digest(ContactHandle4 c, const ByteSpan id, ByteSpan data);
+		bool handle_init_fragment(ContactHandle4 c, const ByteSpan id, ByteSpan data);
+		bool handle_init_with_hmac_compact(ContactHandle4 c, const ByteSpan id, ByteSpan data);
+
+		// patches the recipient dependent header byte and queues
+		bool send_pkg(ContactHandle4 c, std::vector<uint8_t>& pkg);
 
 		bool send_init_with_hmac(
 			ContactHandle4 c,
 			const ByteSpan id,
 			const std::vector<ContactHandle4>& peers,
 			const ByteSpan initial_state,
-			const ByteSpan hmac
+			const ByteSpan hmac,
+			const bool pipelined = false
+		);
+		bool send_init_with_hmac_digest(
+			ContactHandle4 c,
+			const ByteSpan id,
+			const RngState& rng_state
 		);
 		bool send_hmac(
 			ContactHandle4 c,
@@ -127,12 +608,36 @@ class ToxP2PRNG : public P2PRNGI, public ToxEventI {
 			ContactHandle4 c,
 			const ByteSpan id
 		);
+		bool send_secret_with_next_hmac(
+			ContactHandle4 c,
+			const ByteSpan id,
+			const ByteSpan secret,
+			const ByteSpan next_hmac
+		);
+		// own secret and next hmac, everything else is known from prev
+		bool send_init_chained(
+			ContactHandle4 c,
+			const ByteSpan id,
+			const RngState& rng_state
+		);
+		// own hmacs of every generation in the bundle
+		bool send_hmac_bundle(
+			ContactHandle4 c,
+			const ByteSpan bundle_id,
+			const uint16_t bundle_size
+		);
 
 		RngState* getRngSate(ContactHandle4 c, ByteSpan id);
+		// also returns the index of c in the participants
+		RngState* getRngSate(ContactHandle4 c, ByteSpan id, size_t& c_idx);
 
 	protected:
 		bool onToxEvent(const Tox_Event_Friend_Lossless_Packet* e) override;
 		bool onToxEvent(const Tox_Event_Group_Custom_Packet* e) override;
 		bool onToxEvent(const Tox_Event_Group_Custom_Private_Packet* e) override;
+		bool onToxEvent(const Tox_Event_Friend_Connection_Status* e) override;
+		bool onToxEvent(const Tox_Event_Group_Peer_Join* e) override;
+		bool onToxEvent(const Tox_Event_Group_Peer_Exit* e) override;
+		bool onToxEvent(const Tox_Event_Group_Self_Join* e) override;
 };
 
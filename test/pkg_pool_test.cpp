@@ -0,0 +1,79 @@
+#include <solanaceae/tox_p2prng/pkg_pool.hpp>
+
+#include <iostream>
+#include <vector>
+
+#define CHECK(x) do { if (!(x)) { std::cerr << __FILE__ << ":" << __LINE__ << " failed: " #x "\n"; return 1; } } while (false)
+
+// what sending a round of packets does with the pool: build, copy some into the send queue, drop
+static void sendRound(PkgPool& pool, std::vector<PkgPool::Buffer>& queued, const size_t pkg_count) {
+	for (size_t i = 0; i < pkg_count; i++) {
+		auto pkg = pool.acquire(1372u);
+		pkg->resize(100u + i*10u);
+
+		if (i % 3 == 0) {
+			queued.push_back(pool.copy(*pkg)); // deferred by toxcore
+		}
+	}
+
+	queued.clear(); // flushed
+}
+
+int main(void) {
+	{ // cold pool allocates, warm pool does not
+		PkgPool pool;
+		std::vector<PkgPool::Buffer> queued;
+		queued.reserve(64u);
+
+		// small copies get grown when reused for bigger packets, that settles after a few rounds
+		for (size_t round = 0; round < 8u; round++) {
+			sendRound(pool, queued, 32u);
+		}
+		const auto warm = pool.getStats();
+		CHECK(warm.allocated > 0u);
+		CHECK(warm.allocated <= warm.acquired);
+
+		for (size_t round = 0; round < 100u; round++) {
+			sendRound(pool, queued, 32u);
+		}
+
+		const auto after = pool.getStats();
+		CHECK(after.acquired > warm.acquired);
+		CHECK(after.allocated == warm.allocated);
+	}
+
+	{ // growing past a released buffer counts, the grown one is reused after
+		PkgPool pool;
+		{ auto pkg = pool.acquire(16u); }
+		CHECK(pool.getStats().allocated == 1u);
+
+		{ auto pkg = pool.acquire(4096u); }
+		CHECK(pool.getStats().allocated == 2u);
+
+		{ auto pkg = pool.acquire(4096u); }
+		CHECK(pool.getStats().allocated == 2u);
+	}
+
+	{ // moved from handles dont release twice
+		PkgPool pool;
+		{
+			auto a = pool.acquire(64u);
+			auto b = std::move(a);
+			PkgPool::Buffer c;
+			c = std::move(b);
+		}
+		{ auto pkg = pool.acquire(64u); }
+		{ auto pkg = pool.acquire(64u); }
+		CHECK(pool.getStats().allocated == 1u);
+	}
+
+	{ // oversized buffers are not kept
+		PkgPool pool;
+		{ auto pkg = pool.acquire(128u*1024u); }
+		{ auto pkg = pool.acquire(128u*1024u); }
+		CHECK(pool.getStats().allocated == 2u);
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,126 @@
+#include "loopback.hpp"
+
+#include <solanaceae/tox_p2prng/log.hpp>
+
+#include <sodium.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <vector>
+
+// the send path of a warm instance makes no heap allocations,
+// counted with operator new around the real send_* and newGernationPeers calls
+
+static std::atomic<uint64_t> g_allocations {0u};
+
+void* operator new(std::size_t size) {
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* ptr = std::malloc(size == 0 ? 1 : size); ptr != nullptr) {
+		return ptr;
+	}
+	throw std::bad_alloc{};
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	return std::malloc(size == 0 ? 1 : size);
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+
+#define CHECK(x) do { if (!(x)) { std::cerr << __FILE__ << ":" << __LINE__ << " failed: " #x "\n"; return 1; } } while (false)
+
+// sent packets are thrown away, the buffers go back to the net
+class DiscardNet : public LoopbackNet {
+	protected:
+		bool enqueue(Packet&& pkg) override {
+			dropPacket(pkg);
+			return true;
+		}
+
+	public:
+		using LoopbackNet::LoopbackNet;
+};
+
+static const std::vector<uint8_t> g_initial_state {'a', 'l', 'l', 'o', 'c'};
+
+// heap allocations of the calls after the first, which warms the pools
+template<typename Fn>
+static uint64_t countAllocations(Fn&& fn, const size_t rounds = 100u) {
+	fn();
+	const uint64_t before = g_allocations.load();
+	for (size_t i = 0; i < rounds; i++) {
+		fn();
+	}
+	return g_allocations.load() - before;
+}
+
+// fewest heap allocations of a single call, containers growing now and then dont count
+template<typename Fn>
+static uint64_t minAllocations(Fn&& fn, const size_t rounds = 10u) {
+	uint64_t min = ~uint64_t(0);
+	for (size_t i = 0; i < rounds; i++) {
+		min = std::min(min, countAllocations(fn, 1u));
+	}
+	return min;
+}
+
+int main(void) {
+	if (sodium_init() < 0) {
+		std::cerr << "sodium_init failed\n";
+		return 1;
+	}
+
+	TP2PRNGLog::setLevel(TP2PRNGLog::Level::error);
+
+	DiscardNet net{10u};
+	auto& p2prng = net.peer(0);
+	const auto c_vec = p2prng.groupPeers();
+	const auto c = c_vec.at(1);
+
+	ToxP2PRNG::ID id {};
+	id.fill(0x42);
+	std::array<uint8_t, P2PRNG_MAC_LEN> hmac {};
+	std::array<uint8_t, P2PRNG_LEN + P2PRNG_MAC_KEY_LEN> secret {};
+
+	{ // every packet type
+		CHECK(countAllocations([&]() { p2prng.send_init_with_hmac(c, ByteSpan{id}, c_vec, ByteSpan{g_initial_state}, ByteSpan{hmac}); }) == 0u);
+		CHECK(countAllocations([&]() { p2prng.send_hmac(c, ByteSpan{id}, ByteSpan{hmac}); }) == 0u);
+		CHECK(countAllocations([&]() { p2prng.send_hmac_request(c, ByteSpan{id}); }) == 0u);
+		CHECK(countAllocations([&]() { p2prng.send_secret(c, ByteSpan{id}, ByteSpan{secret}); }) == 0u);
+		CHECK(countAllocations([&]() { p2prng.send_secret_request(c, ByteSpan{id}); }) == 0u);
+		CHECK(countAllocations([&]() { p2prng.send_secret_with_next_hmac(c, ByteSpan{id}, ByteSpan{secret}, ByteSpan{hmac}); }) == 0u);
+
+		LoopbackPeer::RngState rng_state;
+		rng_state.setContacts(p2prng.groupPeers());
+		rng_state.fillInitialState(ByteSpan{id}, ByteSpan{g_initial_state});
+		rng_state.chained_from = ToxP2PRNG::ID{};
+		rng_state.secrets.set(rng_state.self_idx, secret);
+		rng_state.next_hmacs.set(rng_state.self_idx, hmac);
+		CHECK(countAllocations([&]() { p2prng.send_init_chained(c, ByteSpan{id}, rng_state); }) == 0u);
+	}
+
+	{ // starting a generation allocates its state, but nothing per packet sent
+		// the same generation, once sent as one group packet and once privately to all 9 others
+		p2prng.setGroupBroadcast(true);
+		const auto start_broadcast = minAllocations([&]() { p2prng.newGernationPeers(c_vec, ByteSpan{g_initial_state}); });
+		p2prng.setGroupBroadcast(false);
+		const auto start_private = minAllocations([&]() { p2prng.newGernationPeers(c_vec, ByteSpan{g_initial_state}); });
+		CHECK(start_broadcast > 0u);
+		CHECK(start_private == start_broadcast);
+
+		// and the packet buffers come from the pool
+		const auto pool_before = p2prng.getPkgPoolStats();
+		countAllocations([&]() { p2prng.newGernationPeers(c_vec, ByteSpan{g_initial_state}); }, 10u);
+		CHECK(p2prng.getPkgPoolStats().allocated == pool_before.allocated);
+	}
+
+	return 0;
+}
+